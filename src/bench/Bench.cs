@@ -0,0 +1,56 @@
+using System;
+using System.Collections;
+using PLMono;
+
+namespace PLMonoBench
+{
+	public static class Bench
+	{
+		public static int AddInt(int a, int b)
+		{
+			return a + b;
+		}
+
+		public static double AddFloat(double a, double b)
+		{
+			return a + b;
+		}
+
+		public static string Upper(string s)
+		{
+			return s.ToUpperInvariant();
+		}
+
+		public static void MinMax(int a, int b, out int min, out int max)
+		{
+			min = Math.Min(a, b);
+			max = Math.Max(a, b);
+		}
+
+		public static IEnumerable Series(int start, int finish)
+		{
+			for (int i = start; i <= finish; i++)
+				yield return i;
+		}
+
+		public static void Touch(TriggerData trigger)
+		{
+			trigger.New["touched"] = true;
+		}
+	}
+
+	public class Sum
+	{
+		private long sum;
+
+		public void Accumulate(int value)
+		{
+			sum += value;
+		}
+
+		public long Terminate()
+		{
+			return sum;
+		}
+	}
+}
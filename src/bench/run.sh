@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# Benchmark PL/Mono call path against PL/pgSQL and built-in C functions.
+#
+# For every case and implementation, pgbench runs a script of 1000 calls per
+# transaction; calls/sec, p50 and p99 transaction latency and growth of RSS
+# of a backend running the script repeatedly are reported.
+#
+# Usage: run.sh [case ...]
+#
+# Environment:
+#   PGDATABASE, PGHOST, ...  connection to the database to run in
+#   BENCH_TIME               seconds each pgbench run takes (10)
+#   BENCH_CLIENTS            pgbench clients (1)
+#   BENCH_RSS_LOOPS          script runs of the RSS measurement (200)
+#   PLMONO_DLL               PLMono.dll to compile against
+#                            ($pkglibdir/PLMono.dll)
+#   MCS                      C# compiler (mcs)
+
+set -e
+
+BENCH_DIR=`cd \`dirname $0\` && pwd`
+BENCH_TIME=${BENCH_TIME:-10}
+BENCH_CLIENTS=${BENCH_CLIENTS:-1}
+BENCH_RSS_LOOPS=${BENCH_RSS_LOOPS:-200}
+PLMONO_DLL=${PLMONO_DLL:-`pg_config --pkglibdir`/PLMono.dll}
+MCS=${MCS:-mcs}
+CALLS=1000
+
+WORK=`mktemp -d ${TMPDIR:-/tmp}/plmono_bench.XXXXXX`
+trap 'rm -rf "$WORK"' EXIT
+
+# Implementations of each case
+langs()
+{
+	case $1 in
+		add_int|add_float|upper|series|sum) echo "plmono plpgsql c" ;;
+		minmax) echo "plmono plpgsql" ;;
+		narrow|wide) echo "plmono plpgsql none" ;;
+		*) echo "Unknown case $1" >&2; exit 1 ;;
+	esac
+}
+
+# Sizes of text values the text case is run with
+sizes()
+{
+	case $1 in
+		upper) echo "16 1024 65536" ;;
+		*) echo "0" ;;
+	esac
+}
+
+# Transaction latency percentile in milliseconds from pgbench logs
+percentile()
+{
+	cat "$WORK"/pgbench_log.* | awk '{ print $3 }' | sort -n |
+		awk -v p=$1 '{ v[NR] = $1 } END { i = int(NR * p / 100); if (i < 1) i = 1; printf "%.3f", v[i] / 1000 }'
+}
+
+# Growth of backend RSS in kB over repeated runs of the script
+rss_growth()
+{
+	{
+		echo 'SELECT pg_backend_pid() AS pid \gset'
+		echo '\setenv PID :pid'
+		echo '\! grep VmRSS /proc/$PID/status'
+		i=0
+		while [ $i -lt $BENCH_RSS_LOOPS ]; do
+			echo "\\i $BENCH_DIR/scripts/$1.sql"
+			i=`expr $i + 1`
+		done
+		echo '\! grep VmRSS /proc/$PID/status'
+	} | psql -X -q -A -t -v lang=$2 -v size=$3 |
+		awk '/^VmRSS/ { if (!n++) a = $2; b = $2 } END { print b - a }'
+}
+
+# Build the assembly and create functions
+$MCS -target:library -r:"$PLMONO_DLL" -out:"$WORK/PLMonoBench.dll" "$BENCH_DIR/Bench.cs"
+sed "s|@ASSEMBLY@|$WORK/PLMonoBench.dll|g" "$BENCH_DIR/setup.sql.in" > "$WORK/setup.sql"
+psql -X -q -v ON_ERROR_STOP=1 -f "$WORK/setup.sql"
+
+CASES=${*:-"add_int add_float upper minmax series sum narrow wide"}
+
+printf "%-10s %-8s %6s %12s %10s %10s %10s\n" case lang size calls/sec p50_ms p99_ms rss_kB
+for c in $CASES; do
+	for size in `sizes $c`; do
+		for lang in `langs $c`; do
+			psql -X -q -c "TRUNCATE plmono_bench.narrow_$lang, plmono_bench.wide_$lang" >/dev/null 2>&1 || true
+			rm -f "$WORK"/pgbench_log.*
+
+			tps=`cd "$WORK" && pgbench -n -M simple -l -T $BENCH_TIME -c $BENCH_CLIENTS \
+				-D lang=$lang -D size=$size -f "$BENCH_DIR/scripts/$c.sql" |
+				awk '/^tps = / { print $3; exit }'`
+
+			printf "%-10s %-8s %6s %12.0f %10s %10s %10s\n" $c $lang $size \
+				`echo "$tps * $CALLS" | bc` `percentile 50` `percentile 99` \
+				`rss_growth $c $lang $size`
+		done
+	done
+done
@@ -0,0 +1 @@
+SELECT sum(plmono_bench.add_float_:lang(i, 0.5)) FROM generate_series(1, 1000) i;
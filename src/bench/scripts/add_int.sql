@@ -0,0 +1 @@
+SELECT sum(plmono_bench.add_int_:lang(i, 1)) FROM generate_series(1, 1000) i;
@@ -0,0 +1 @@
+SELECT sum((plmono_bench.minmax_:lang(i, 500)).max) FROM generate_series(1, 1000) i;
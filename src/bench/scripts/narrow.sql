@@ -0,0 +1 @@
+INSERT INTO plmono_bench.narrow_:lang (id) SELECT i FROM generate_series(1, 1000) i;
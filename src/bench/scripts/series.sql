@@ -0,0 +1 @@
+SELECT sum(v) FROM plmono_bench.series_:lang(1, 1000) v;
@@ -0,0 +1 @@
+SELECT plmono_bench.sum_:lang(i) FROM generate_series(1, 1000) i;
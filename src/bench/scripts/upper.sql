@@ -0,0 +1 @@
+SELECT sum(length(plmono_bench.upper_:lang(s))) FROM (SELECT repeat('x', :size) || i AS s FROM generate_series(1, 1000) i) t;
@@ -0,0 +1 @@
+INSERT INTO plmono_bench.wide_:lang (id, c1, c2, c3, c4, n1, n2, d1, t1) SELECT i, 'a', 'bb', 'ccc', 'dddd', i, i * 2, i / 3.0, now() FROM generate_series(1, 1000) i;
@@ -23,10 +23,10 @@ namespace PLMono
 			");\n";
 
 		private const string CreateAggregateQuery =
-			"CREATE AGGREGATE {0} (\n" + 
-			"    BASETYPE = {1}\n" + 
-			"    SFUNC = {2}\n" + 
-			"    STYPE = {3}\n" + 
+			"CREATE AGGREGATE {0} ({1}) (\n" + 
+			"    SFUNC = {2},\n" + 
+			"    STYPE = internal,\n" + 
+			"    FINALFUNC = {3}\n" + 
 			");\n";
 
 		private Dictionary<string,string> TypeMappings = new Dictionary<string,string>
@@ -37,7 +37,8 @@ namespace PLMono
 			{"System.Int64",  "bigint"          },
 			{"System.Single", "real"            },
 			{"System.Double", "double precision"},
-			{"System.String", "text"            }
+			{"System.String", "text"            },
+			{"System.Byte[]", "bytea"           }
 		};
 
 		private string DatabaseTypeName(Type type)
@@ -158,9 +159,34 @@ namespace PLMono
 				string.Format(CreateTypeQuery, name, inputFuncName, outputFuncName);
 		}
 
+		private string SupportFunctionDeclaration(string name, string args, string returns, MethodInfo method)
+		{
+			return string.Format(CreateFunctionQuery, name, args, returns, FullMethodName(method));
+		}
+
 		public string AggregateDeclaration(string name, Type type)
 		{
-			return "";
+			MethodInfo accumulate, terminate;
+			StringBuilder declaration = new StringBuilder();
+			string args;
+
+			accumulate = type.GetMethod("Accumulate");
+			terminate = type.GetMethod("Terminate", Type.EmptyTypes);
+
+			if (accumulate == null || terminate == null)
+				throw new NotImplementedException("Aggregate " + type.FullName + " must define Accumulate and Terminate methods");
+
+			args = ArgumentsDeclaration(accumulate.GetParameters());
+
+			declaration.Append(SupportFunctionDeclaration(name + "_accumulate",
+				args == string.Empty ? "internal" : "internal, " + args, "internal", accumulate));
+			declaration.Append(SupportFunctionDeclaration(name + "_terminate",
+				"internal", DatabaseTypeName(terminate.ReturnType), terminate));
+
+			declaration.Append(string.Format(CreateAggregateQuery, name,
+				args == string.Empty ? "*" : args, name + "_accumulate", name + "_terminate"));
+
+			return declaration.ToString();
 		}
 	}
 }
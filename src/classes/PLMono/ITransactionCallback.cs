@@ -0,0 +1,9 @@
+using System;
+
+namespace PLMono
+{
+	public interface ITransactionCallback
+	{
+		void OnTransactionEnd(bool committed);
+	}
+}
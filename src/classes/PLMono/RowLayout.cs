@@ -0,0 +1,44 @@
+using System;
+using System.Collections.Generic;
+
+namespace PLMono
+{
+	public class RowLayout
+	{
+		private string[] names;
+		private Dictionary<string,int> ordinals = 
+			new Dictionary<string,int>();
+
+		internal RowLayout(string[] names)
+		{
+			this.names = names;
+
+			for (int i = 0; i < names.Length; i++)
+				if (names[i] != null)
+					ordinals.Add(names[i], i);
+		}
+
+		public int Count
+		{
+			get
+			{
+				return names.Length;
+			}
+		}
+
+		public string GetName(int index)
+		{
+			return names[index];
+		}
+
+		public int GetOrdinal(string name)
+		{
+			int index;
+
+			if (!ordinals.TryGetValue(name, out index))
+				throw new InexistingColumnException(name);
+
+			return index;
+		}
+	}
+}
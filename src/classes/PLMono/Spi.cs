@@ -0,0 +1,41 @@
+using System;
+using System.Runtime.CompilerServices;
+
+namespace PLMono
+{
+	public static class Spi
+	{
+		public static int Execute(string query)
+		{
+			return ExecuteQuery(query, 0);
+		}
+
+		public static int Execute(string query, int limit)
+		{
+			return ExecuteQuery(query, limit);
+		}
+
+		public static SpiPlan Prepare(string query, params string[] argTypes)
+		{
+			return new SpiPlan(PrepareQuery(query, argTypes));
+		}
+
+		public static SpiCursor Query(string query)
+		{
+			return Query(query, SpiCursor.DefaultBatchSize);
+		}
+
+		public static SpiCursor Query(string query, int batchSize)
+		{
+			SpiCursor cursor = new SpiCursor();
+			cursor.Open(query, batchSize);
+			return cursor;
+		}
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern int ExecuteQuery(string query, int limit);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern IntPtr PrepareQuery(string query, string[] argTypes);
+	}
+}
@@ -0,0 +1,147 @@
+using System;
+using System.Runtime.CompilerServices;
+
+namespace PLMono
+{
+	public class SpiCursor : IDisposable
+	{
+		public const int DefaultBatchSize = 100;
+
+		private IntPtr handle;
+
+		internal SpiCursor()
+		{
+		}
+
+		internal void Open(string query, int batchSize)
+		{
+			handle = OpenQuery(this, query, batchSize);
+		}
+
+		internal void Open(IntPtr plan, object[] args, int batchSize)
+		{
+			handle = OpenPlan(this, plan, args, batchSize);
+		}
+
+		public int FieldCount
+		{
+			get
+			{
+				return GetFieldCount(Handle);
+			}
+		}
+
+		public object this[int index]
+		{
+			get
+			{
+				return GetValue(Handle, index);
+			}
+		}
+
+		public bool Read()
+		{
+			return Read(Handle);
+		}
+
+		public string GetName(int index)
+		{
+			return GetName(Handle, index);
+		}
+
+		public bool IsNull(int index)
+		{
+			return IsNull(Handle, index);
+		}
+
+		public object GetValue(int index)
+		{
+			return GetValue(Handle, index);
+		}
+
+		public bool GetBoolean(int index)
+		{
+			return GetBoolean(Handle, index);
+		}
+
+		public int GetInt32(int index)
+		{
+			return GetInt32(Handle, index);
+		}
+
+		public long GetInt64(int index)
+		{
+			return GetInt64(Handle, index);
+		}
+
+		public double GetDouble(int index)
+		{
+			return GetDouble(Handle, index);
+		}
+
+		public string GetString(int index)
+		{
+			return GetString(Handle, index);
+		}
+
+		public void Close()
+		{
+			if (handle != IntPtr.Zero)
+				Close(handle);
+		}
+
+		public void Dispose()
+		{
+			Close();
+		}
+
+		private IntPtr Handle
+		{
+			get
+			{
+				if (handle == IntPtr.Zero)
+					throw new ObjectDisposedException("SpiCursor");
+				return handle;
+			}
+		}
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern IntPtr OpenQuery(SpiCursor owner, string query, int batchSize);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern IntPtr OpenPlan(SpiCursor owner, IntPtr plan, object[] args, int batchSize);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern bool Read(IntPtr cursor);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern void Close(IntPtr cursor);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern int GetFieldCount(IntPtr cursor);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern string GetName(IntPtr cursor, int index);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern bool IsNull(IntPtr cursor, int index);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern object GetValue(IntPtr cursor, int index);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern bool GetBoolean(IntPtr cursor, int index);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern int GetInt32(IntPtr cursor, int index);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern long GetInt64(IntPtr cursor, int index);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern double GetDouble(IntPtr cursor, int index);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern string GetString(IntPtr cursor, int index);
+	}
+}
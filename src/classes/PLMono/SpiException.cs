@@ -0,0 +1,21 @@
+using System;
+
+namespace PLMono
+{
+	public class SpiException : Exception
+	{
+		private string sqlState;
+
+		public SpiException(string message) : base(message)
+		{
+		}
+
+		public string SqlState
+		{
+			get
+			{
+				return sqlState;
+			}
+		}
+	}
+}
@@ -0,0 +1,40 @@
+using System;
+using System.Runtime.CompilerServices;
+
+namespace PLMono
+{
+	public class SpiPlan
+	{
+		private IntPtr handle;
+
+		internal SpiPlan(IntPtr handle)
+		{
+			this.handle = handle;
+		}
+
+		public int Execute(params object[] args)
+		{
+			return ExecutePlan(handle, args, 0);
+		}
+
+		public int ExecuteLimit(int limit, params object[] args)
+		{
+			return ExecutePlan(handle, args, limit);
+		}
+
+		public SpiCursor Open(params object[] args)
+		{
+			return OpenBatched(SpiCursor.DefaultBatchSize, args);
+		}
+
+		public SpiCursor OpenBatched(int batchSize, params object[] args)
+		{
+			SpiCursor cursor = new SpiCursor();
+			cursor.Open(handle, args, batchSize);
+			return cursor;
+		}
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern int ExecutePlan(IntPtr plan, object[] args, int limit);
+	}
+}
@@ -0,0 +1,22 @@
+using System;
+
+namespace PLMono
+{
+	[AttributeUsage (AttributeTargets.Method)]
+	public class SqlBatch : Attribute
+	{
+		private int size;
+
+		public int Size
+		{
+			get
+			{
+				return size;
+			}
+			set
+			{
+				size = value;
+			}
+		}
+	}
+}
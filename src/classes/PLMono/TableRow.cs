@@ -1,19 +1,32 @@
 using System;
 using System.Collections;
 using System.Collections.Generic;
+using System.Runtime.CompilerServices;
 
 namespace PLMono
 {
 	public class TableRow : IEnumerable
 	{
-		private Dictionary<string,object> columns = 
-			new Dictionary<string,object>();
+		private IntPtr handle;
+		private RowLayout layout;
+
+		internal TableRow()
+		{
+		}
 
 		public int Count
 		{
 			get
 			{
-				return columns.Count;
+				return layout.Count;
+			}
+		}
+
+		public RowLayout Layout
+		{
+			get
+			{
+				return layout;
 			}
 		}
 
@@ -21,26 +34,45 @@ namespace PLMono
 		{
 			get
 			{
-				return columns[name];
+				return GetValue(handle, layout.GetOrdinal(name));
 			}
 			set
 			{
-				if (columns.ContainsKey(name))
-					columns[name] = value;
-				else
-					throw new InexistingColumnException(name);
+				SetValue(handle, layout.GetOrdinal(name), value);
 			}
 		}
 
-		internal void Add(string name, object val)
+		public object this[int index]
 		{
-			columns.Add(name, val);
+			get
+			{
+				return GetValue(handle, index);
+			}
+			set
+			{
+				SetValue(handle, index, value);
+			}
+		}
+
+		public bool IsModified(string name)
+		{
+			return IsModified(handle, layout.GetOrdinal(name));
 		}
 
 		public IEnumerator GetEnumerator()
 		{
-			foreach (KeyValuePair<string,object> pair in columns)
-				yield return pair; 
+			for (int i = 0; i < layout.Count; i++)
+				if (layout.GetName(i) != null)
+					yield return new KeyValuePair<string,object>(layout.GetName(i), this[i]); 
 		}
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern object GetValue(IntPtr row, int index);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern void SetValue(IntPtr row, int index, object value);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern bool IsModified(IntPtr row, int index);
 	}
 }
@@ -0,0 +1,107 @@
+using System;
+using System.IO;
+using System.Runtime.CompilerServices;
+
+namespace PLMono
+{
+	public class ToastStream : Stream
+	{
+		private IntPtr handle;
+		private long position;
+
+		internal ToastStream()
+		{
+		}
+
+		public override bool CanRead
+		{
+			get
+			{
+				return handle != IntPtr.Zero;
+			}
+		}
+
+		public override bool CanSeek
+		{
+			get
+			{
+				return handle != IntPtr.Zero;
+			}
+		}
+
+		public override bool CanWrite
+		{
+			get
+			{
+				return false;
+			}
+		}
+
+		public override long Length
+		{
+			get
+			{
+				return GetLength(handle);
+			}
+		}
+
+		public override long Position
+		{
+			get
+			{
+				return position;
+			}
+			set
+			{
+				if (value < 0)
+					throw new ArgumentOutOfRangeException("value");
+				position = value;
+			}
+		}
+
+		public override int Read(byte[] buffer, int offset, int count)
+		{
+			int read = Read(handle, position, buffer, offset, count);
+			position += read;
+			return read;
+		}
+
+		public override long Seek(long offset, SeekOrigin origin)
+		{
+			switch (origin)
+			{
+				case SeekOrigin.Begin:
+					Position = offset;
+					break;
+				case SeekOrigin.Current:
+					Position = position + offset;
+					break;
+				case SeekOrigin.End:
+					Position = Length + offset;
+					break;
+			}
+
+			return position;
+		}
+
+		public override void Flush()
+		{
+		}
+
+		public override void SetLength(long value)
+		{
+			throw new NotSupportedException();
+		}
+
+		public override void Write(byte[] buffer, int offset, int count)
+		{
+			throw new NotSupportedException();
+		}
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern int Read(IntPtr toast, long position, byte[] buffer, int offset, int count);
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern long GetLength(IntPtr toast);
+	}
+}
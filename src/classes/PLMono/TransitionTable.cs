@@ -0,0 +1,31 @@
+using System;
+using System.Runtime.CompilerServices;
+
+namespace PLMono
+{
+	public class TransitionTable
+	{
+		private IntPtr handle;
+		private TableRow row = new TableRow();
+
+		internal TransitionTable()
+		{
+		}
+
+		public TableRow Current
+		{
+			get
+			{
+				return row;
+			}
+		}
+
+		public bool Read()
+		{
+			return Read(handle);
+		}
+
+		[MethodImplAttribute(MethodImplOptions.InternalCall)]
+		private static extern bool Read(IntPtr table);
+	}
+}
@@ -2,16 +2,151 @@ using System;
 
 namespace PLMono
 {
+	public enum TriggerEvent
+	{
+		Insert,
+		Update,
+		Delete,
+		Truncate
+	}
+
+	public enum TriggerWhen
+	{
+		Before,
+		After
+	}
+
+	public enum TriggerLevel
+	{
+		Row,
+		Statement
+	}
+
 	public class TriggerData
 	{
-		private static TableRow tableRow = new TableRow();
+		private static TriggerData current;
+
+		private TableRow oldRow = new TableRow();
+		private TableRow newRow = new TableRow();
+		private TransitionTable oldTable = new TransitionTable();
+		private TransitionTable newTable = new TransitionTable();
+		private bool hasOld;
+		private bool hasNew;
+		private bool hasOldTable;
+		private bool hasNewTable;
+		private TriggerEvent triggerEvent;
+		private TriggerWhen triggerWhen;
+		private TriggerLevel triggerLevel;
+		private string triggerName;
+		private string tableName;
+		private string tableSchema;
+
+		internal TriggerData()
+		{
+		}
+
+		public static TriggerData Current
+		{
+			get
+			{
+				return current;
+			}
+		}
+
 		public static TableRow Columns
 		{
 			get
 			{
-				return tableRow;
+				return current == null ? null : current.Row;
+			}
+		}
+
+		public TableRow Old
+		{
+			get
+			{
+				return hasOld ? oldRow : null;
+			}
+		}
+
+		public TableRow New
+		{
+			get
+			{
+				return hasNew ? newRow : null;
+			}
+		}
+
+		public TableRow Row
+		{
+			get
+			{
+				return hasNew ? newRow : Old;
+			}
+		}
+
+		public TransitionTable OldTable
+		{
+			get
+			{
+				return hasOldTable ? oldTable : null;
+			}
+		}
+
+		public TransitionTable NewTable
+		{
+			get
+			{
+				return hasNewTable ? newTable : null;
+			}
+		}
+
+		public TriggerEvent Event
+		{
+			get
+			{
+				return triggerEvent;
+			}
+		}
+
+		public TriggerWhen When
+		{
+			get
+			{
+				return triggerWhen;
+			}
+		}
+
+		public TriggerLevel Level
+		{
+			get
+			{
+				return triggerLevel;
+			}
+		}
+
+		public string TriggerName
+		{
+			get
+			{
+				return triggerName;
+			}
+		}
+
+		public string TableName
+		{
+			get
+			{
+				return tableName;
+			}
+		}
+
+		public string TableSchema
+		{
+			get
+			{
+				return tableSchema;
 			}
 		}
 	}
 }
-
@@ -0,0 +1,386 @@
+/*-------------------------------------------------------------------------
+ *
+ * agg.c
+ *     aggregates whose transition state is a managed object
+ *
+ * Copyright (c) 2009, Olexandr Melnyk <me@omelnyk.net>
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/heapam.h"
+#include "access/xact.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "executor/executor.h"
+#include "nodes/execnodes.h"
+#include "nodes/plannodes.h"
+#include "utils/memutils.h"
+
+#include <mono/jit/jit.h>
+#include <mono/metadata/assembly.h>
+#include <mono/metadata/appdomain.h>
+#include <mono/metadata/object.h>
+#include <mono/metadata/tabledefs.h>
+
+#include "helpers.h"
+#include "core.h"
+#include "assembly.h"
+#include "marshal.h"
+#include "cache.h"
+#include "function.h"
+#include "agg.h"
+#include "stats.h"
+
+/*
+ * Transition state of a managed aggregate, passed around as internal. It
+ * lives in the aggregate's memory context and keeps the managed object
+ * alive through a GC handle, so the object is neither copied nor serialized
+ * between rows. The handle is freed along with the context where memory
+ * context callbacks exist; on older servers, by the final function or when
+ * the node calling the aggregate ends
+ */
+typedef struct PLMonoAggState
+{
+	guint32 handle;                        /* GC handle of the object */
+#if PG_VERSION_NUM >= 90500
+	MemoryContextCallback callback;        /* frees handle with the context */
+#endif
+} PLMonoAggState;
+
+#if PG_VERSION_NUM < 90500
+/*
+ * Handles of states not freed yet. Expression context callbacks aren't run
+ * when a query fails, so whatever is left is freed when the transaction ends
+ */
+static GHashTable *agg_handles = NULL;
+#endif
+
+/*
+ * plmono_agg_role
+ *
+ *     Tell part played by the function in an aggregate from its signature
+ */
+PLMonoAggRole
+plmono_agg_role(PLMonoFunction *desc)
+{
+	if (desc->argcount >= 1 && desc->argtypes[0] == INTERNALOID)
+	{
+		if (desc->rettype != INTERNALOID)
+			return PLMONO_AGG_FINAL;
+
+		if (desc->argcount == 2 && desc->argtypes[1] == INTERNALOID)
+			return PLMONO_AGG_COMBINE;
+
+		return PLMONO_AGG_TRANSITION;
+	}
+
+	if (desc->rettype == INTERNALOID)
+	{
+		if (desc->argcount == 2 && desc->argtypes[0] == BYTEAOID && desc->argtypes[1] == INTERNALOID)
+			return PLMONO_AGG_DESERIAL;
+
+		elog(ERROR, "PL/Mono function returning internal must be an aggregate support function");
+	}
+
+	return PLMONO_AGG_NONE;
+}
+
+/*
+ * plmono_agg_resolve
+ *
+ *     Find method implementing the part of the aggregate. Deserialization is
+ *     done by a static method returning a new state, other parts are instance
+ *     methods of the state; combine method takes the other state
+ */
+void
+plmono_agg_resolve(PLMonoFunction *desc)
+{
+	bool is_static;
+
+	if (mono_class_is_valuetype(desc->klass))
+		elog(ERROR, "Aggregate class %s must be a reference type", desc->sig);
+
+	if (desc->agg_role == PLMONO_AGG_COMBINE)
+	{
+		desc->paramtypes[0] = mono_class_get_type(desc->klass);
+		desc->nparams = 1;
+	}
+
+	desc->method = plmono_method_find(desc->klass, desc->method_name, desc->paramtypes, desc->nparams);
+
+	is_static = (mono_method_get_flags(desc->method, NULL) & METHOD_ATTRIBUTE_STATIC) != 0;
+	if (is_static != (desc->agg_role == PLMONO_AGG_DESERIAL))
+		elog(ERROR, "Method %s of aggregate class %s must %sbe static",
+			 desc->method_name, desc->sig, is_static ? "not " : "");
+
+	/*
+     * Empty groups get a fresh state
+     */
+	if (desc->agg_role == PLMONO_AGG_TRANSITION || desc->agg_role == PLMONO_AGG_FINAL)
+		if (!(desc->ctor = mono_class_get_method_from_name(desc->klass, ".ctor", 0)))
+			elog(ERROR, "Aggregate class %s has no default constructor", desc->sig);
+}
+
+/*
+ * plmono_agg_context
+ *
+ *     Get memory context of the aggregate calling the function
+ */
+static MemoryContext
+plmono_agg_context(FunctionCallInfo fcinfo)
+{
+	MemoryContext aggcontext;
+
+#if PG_VERSION_NUM >= 90000
+	if (!AggCheckCallContext(fcinfo, &aggcontext))
+		elog(ERROR, "PL/Mono aggregate support function called in non-aggregate context");
+#else
+	if (!fcinfo->context || !IsA(fcinfo->context, AggState))
+		elog(ERROR, "PL/Mono aggregate support function called in non-aggregate context");
+	aggcontext = ((AggState*) fcinfo->context)->aggcontext;
+#endif
+
+	return aggcontext;
+}
+
+#if PG_VERSION_NUM >= 90500
+/*
+ * plmono_agg_state_free
+ *
+ *     Memory context callback releasing the object of a state
+ */
+static void
+plmono_agg_state_free(void *arg)
+{
+	PLMonoAggState *state = (PLMonoAggState*) arg;
+
+	mono_gchandle_free(state->handle);
+}
+#else
+/*
+ * plmono_agg_econtext
+ *
+ *     Get expression context of the Agg or WindowAgg node calling the
+ *     function, which lives as long as the node
+ */
+static ExprContext*
+plmono_agg_econtext(FunctionCallInfo fcinfo)
+{
+	return ((ScanState*) fcinfo->context)->ps.ps_ExprContext;
+}
+
+/*
+ * plmono_agg_handle_free
+ *
+ *     Expression context callback releasing the object of a state. Takes the
+ *     handle rather than the state, as the state may go away with its group
+ */
+static void
+plmono_agg_handle_free(Datum arg)
+{
+	guint32 handle = DatumGetUInt32(arg);
+
+	if (g_hash_table_remove(agg_handles, GUINT_TO_POINTER(handle)))
+		mono_gchandle_free(handle);
+}
+
+/*
+ * plmono_agg_xact_callback
+ *
+ *     Release objects of states left by queries of the ending transaction
+ */
+static void
+plmono_agg_xact_callback(XactEvent event, void *arg)
+{
+	GHashTableIter iter;
+	gpointer handle;
+
+	g_hash_table_iter_init(&iter, agg_handles);
+	while (g_hash_table_iter_next(&iter, &handle, NULL))
+		mono_gchandle_free(GPOINTER_TO_UINT(handle));
+
+	g_hash_table_remove_all(agg_handles);
+}
+
+/*
+ * plmono_agg_state_release
+ *
+ *     Release object of the state once its result is computed. Only sorted
+ *     and plain Agg nodes are done with a state after the final function;
+ *     window aggregates compute results of growing frames from the same
+ *     state, and hashed ones may compute them again on rescan. Those states
+ *     are released when the node ends
+ */
+static void
+plmono_agg_state_release(FunctionCallInfo fcinfo, PLMonoAggState *state)
+{
+	if (!IsA(fcinfo->context, AggState) ||
+		((Agg*) ((AggState*) fcinfo->context)->ss.ps.plan)->aggstrategy == AGG_HASHED)
+		return;
+
+	UnregisterExprContextCallback(plmono_agg_econtext(fcinfo), plmono_agg_handle_free,
+								  UInt32GetDatum(state->handle));
+	plmono_agg_handle_free(UInt32GetDatum(state->handle));
+}
+#endif
+
+/*
+ * plmono_agg_state_new
+ *
+ *     Make the object a transition state living in the aggregate's context
+ */
+static PLMonoAggState*
+plmono_agg_state_new(FunctionCallInfo fcinfo, MemoryContext aggcontext, MonoObject *obj)
+{
+	PLMonoAggState *state;
+
+	state = (PLMonoAggState*) MemoryContextAlloc(aggcontext, sizeof(PLMonoAggState));
+	state->handle = mono_gchandle_new(obj, FALSE);
+
+#if PG_VERSION_NUM >= 90500
+	state->callback.func = plmono_agg_state_free;
+	state->callback.arg = state;
+	MemoryContextRegisterResetCallback(aggcontext, &state->callback);
+#else
+	if (!agg_handles)
+	{
+		agg_handles = g_hash_table_new(g_direct_hash, g_direct_equal);
+		RegisterXactCallback(plmono_agg_xact_callback, NULL);
+	}
+	g_hash_table_insert(agg_handles, GUINT_TO_POINTER(state->handle), NULL);
+	RegisterExprContextCallback(plmono_agg_econtext(fcinfo), plmono_agg_handle_free,
+								UInt32GetDatum(state->handle));
+#endif
+
+	return state;
+}
+
+/*
+ * plmono_agg_instance
+ *
+ *     Create new object of aggregate's class
+ */
+static MonoObject*
+plmono_agg_instance(PLMonoFunction *desc)
+{
+	MonoObject *obj, *exc = NULL;
+
+	obj = mono_object_new(plmono_get_domain(), desc->klass);
+	mono_runtime_invoke(desc->ctor, obj, NULL, &exc);
+	if (exc)
+		plmono_report_exception(exc);
+
+	return obj;
+}
+
+/*
+ * plmono_agg_get_state
+ *
+ *     Get transition state passed as argument, or NULL
+ */
+static PLMonoAggState*
+plmono_agg_get_state(FunctionCallInfo fcinfo, int argno)
+{
+	return PG_ARGISNULL(argno) ? NULL : (PLMonoAggState*) PG_GETARG_POINTER(argno);
+}
+
+/*
+ * plmono_agg_handler
+ *
+ *     Call method implementing a part of managed aggregate
+ */
+Datum
+plmono_agg_handler(FunctionCallInfo fcinfo, PLMonoFunction *desc)
+{
+	MemoryContext aggcontext = plmono_agg_context(fcinfo);
+	PLMonoAggState *state, *other;
+	MonoObject *obj, *result, *exc = NULL;
+	gpointer *args;
+	gpointer arg[1];
+	Datum retval;
+
+	switch (desc->agg_role)
+	{
+		case PLMONO_AGG_TRANSITION:
+			/*
+             * Accumulate row into the state, creating it for the first row
+             */
+			if (!(state = plmono_agg_get_state(fcinfo, 0)))
+				state = plmono_agg_state_new(fcinfo, aggcontext, plmono_agg_instance(desc));
+
+			args = plmono_func_build_args(fcinfo, desc);
+			mono_runtime_invoke(desc->method, mono_gchandle_get_target(state->handle), args, &exc);
+			if (exc)
+				plmono_report_exception(exc);
+
+			PG_RETURN_POINTER(state);
+
+		case PLMONO_AGG_COMBINE:
+			/*
+             * Merge the second partial state into the first one
+             */
+			state = plmono_agg_get_state(fcinfo, 0);
+			other = plmono_agg_get_state(fcinfo, 1);
+
+			if (!other)
+			{
+				if (!state)
+					PG_RETURN_NULL();
+				PG_RETURN_POINTER(state);
+			}
+
+			if (!state)
+				PG_RETURN_POINTER(plmono_agg_state_new(fcinfo, aggcontext, mono_gchandle_get_target(other->handle)));
+
+			arg[0] = mono_gchandle_get_target(other->handle);
+			mono_runtime_invoke(desc->method, mono_gchandle_get_target(state->handle), arg, &exc);
+			if (exc)
+				plmono_report_exception(exc);
+
+			PG_RETURN_POINTER(state);
+
+		case PLMONO_AGG_FINAL:
+			/*
+             * Compute result of the state; aggregate over no rows gets it
+             * from a fresh state
+             */
+			state = plmono_agg_get_state(fcinfo, 0);
+			obj = state ? mono_gchandle_get_target(state->handle) : plmono_agg_instance(desc);
+
+			args = plmono_func_build_args(fcinfo, desc);
+			result = mono_runtime_invoke(desc->method, obj, args, &exc);
+			if (exc)
+				plmono_report_exception(exc);
+
+			plmono_stat_phase(PLMONO_PHASE_RESULT);
+			retval = plmono_func_build_result(fcinfo, desc, args, result);
+#if PG_VERSION_NUM < 90500
+			if (state)
+				plmono_agg_state_release(fcinfo, state);
+#endif
+			return retval;
+
+		case PLMONO_AGG_DESERIAL:
+			/*
+             * Rebuild partial state received from a parallel worker
+             */
+			args = plmono_func_build_args(fcinfo, desc);
+			result = mono_runtime_invoke(desc->method, NULL, args, &exc);
+			if (exc)
+				plmono_report_exception(exc);
+
+			if (!result)
+				PG_RETURN_NULL();
+
+			PG_RETURN_POINTER(plmono_agg_state_new(fcinfo, aggcontext, result));
+
+		default:
+			elog(ERROR, "PL/Mono function is not an aggregate support function");
+	}
+
+	return (Datum) 0;
+}
@@ -0,0 +1,8 @@
+#ifndef _PLMONO_AGG_H
+#define _PLMONO_AGG_H
+
+PLMonoAggRole plmono_agg_role(PLMonoFunction *desc);
+void plmono_agg_resolve(PLMonoFunction *desc);
+Datum plmono_agg_handler(FunctionCallInfo fcinfo, PLMonoFunction *desc);
+
+#endif
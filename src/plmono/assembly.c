@@ -0,0 +1,520 @@
+/*-------------------------------------------------------------------------
+ *
+ * assembly.c
+ *     per-backend registry of loaded assemblies
+ *
+ * Copyright (c) 2009, Olexandr Melnyk <me@omelnyk.net>
+ *
+ *------------------------------------------------------------------------- 
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/proc.h"
+#include "lib/stringinfo.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#include "utils/tuplestore.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <mono/jit/jit.h>
+#include <mono/metadata/assembly.h>
+#include <mono/metadata/appdomain.h>
+#include <mono/metadata/image.h>
+
+#include "core.h"
+#include "assembly.h"
+
+/*
+ * Mono executable used for AOT compilation
+ */
+#ifndef PLMONO_MONO_BIN
+#define PLMONO_MONO_BIN "mono"
+#endif
+
+extern Datum plmono_assemblies(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(plmono_assemblies);
+
+extern Datum plmono_aot_compile(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(plmono_aot_compile);
+
+/*
+ * Directory of AOT compiled copies of assemblies (plmono.aot_cache_dir)
+ */
+char *plmono_aot_cache_dir = NULL;
+
+/*
+ * Registry of loaded assemblies, keyed by file name
+ */
+static HTAB *assembly_registry = NULL;
+
+/*
+ * plmono_assembly_registry_init
+ *
+ *     Create assembly registry
+ */
+static void
+plmono_assembly_registry_init(void)
+{
+	HASHCTL ctl;
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = MAXPGPATH;
+	ctl.entrysize = sizeof(PLMonoAssembly);
+	ctl.hcxt = TopMemoryContext;
+
+	assembly_registry = hash_create("PL/Mono assembly registry", 16, &ctl,
+									HASH_ELEM | HASH_CONTEXT);
+}
+
+/*
+ * plmono_assembly_stat
+ *
+ *     Get file status of an assembly, or report error if it cannot be accessed
+ */
+static void
+plmono_assembly_stat(const char *filename, struct stat *st)
+{
+	if (stat(filename, st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("Could not access assembly %s: %m", filename)));
+}
+
+/*
+ * plmono_assembly_is_changed
+ *
+ *     Check whether assembly file differs from the one entry was loaded from
+ */
+static bool
+plmono_assembly_is_changed(PLMonoAssembly *entry, struct stat *st)
+{
+	return entry->st_dev != st->st_dev || entry->st_ino != st->st_ino ||
+		entry->st_mtime != st->st_mtime || entry->st_size != st->st_size;
+}
+
+/*
+ * plmono_assembly_reload
+ *
+ *     Load a new build of already loaded assembly from its file contents. Mono
+ *     cannot unload assemblies, so if the new build has the same identity as
+ *     the old one, Mono keeps using the old one and only new backends will see
+ *     the change
+ */
+static MonoAssembly*
+plmono_assembly_reload(PLMonoAssembly *entry)
+{
+	MonoAssembly *assembly;
+	MonoImage *image;
+	MonoImageOpenStatus status;
+	gchar *data;
+	gsize len;
+
+	if (!g_file_get_contents(entry->filename, &data, &len, NULL))
+		elog(ERROR, "Cannot read assembly %s", entry->filename);
+
+	image = mono_image_open_from_data_full(data, len, TRUE, &status, FALSE);
+	g_free(data);
+
+	if (!image)
+		elog(ERROR, "Cannot load image of assembly %s", entry->filename);
+
+	assembly = mono_assembly_load_from_full(image, entry->filename, &status, FALSE);
+	if (!assembly)
+		elog(ERROR, "Cannot load assembly %s", entry->filename);
+
+	if (assembly == entry->assembly)
+		elog(NOTICE, "Assembly %s has changed, but its previous build with the same identity is already loaded; new build will be used by new sessions", entry->filename);
+
+	return assembly;
+}
+
+/*
+ * plmono_aot_cached_path
+ *
+ *     Get path of the copy of assembly in AOT cache, followed by the suffix,
+ *     or false if there is no cache. Copies are placed under the full path of
+ *     the assembly, so that assemblies of the same name don't collide. Mono
+ *     looks for the AOT image of an assembly next to it, named after the
+ *     assembly with .so appended
+ */
+static bool
+plmono_aot_cached_path(const char *filename, const char *suffix, char *path)
+{
+	char *dir, *abspath;
+
+	if (!plmono_aot_cache_dir || !*plmono_aot_cache_dir)
+		return false;
+
+	dir = plmono_expand_path(plmono_aot_cache_dir);
+	abspath = make_absolute_path(filename);
+	snprintf(path, MAXPGPATH, "%s%s%s", dir, abspath, suffix);
+	free(abspath);
+	pfree(dir);
+
+	return true;
+}
+
+/*
+ * plmono_aot_find
+ *
+ *     Get path to load assembly from: its copy in AOT cache if the copy is
+ *     of the same build and has an AOT image, or the assembly itself
+ */
+static const char*
+plmono_aot_find(const char *filename, struct stat *st)
+{
+	static char path[MAXPGPATH];
+	char image[MAXPGPATH];
+	struct stat cst;
+
+	if (!plmono_aot_cached_path(filename, "", path) ||
+		!plmono_aot_cached_path(filename, ".so", image))
+		return filename;
+
+	if (stat(path, &cst) < 0 || cst.st_mtime != st->st_mtime || cst.st_size != st->st_size ||
+		access(image, R_OK) < 0)
+		return filename;
+
+	return path;
+}
+
+/*
+ * plmono_aot_open
+ *
+ *     Open assembly from its copy in AOT cache. The image is opened from the
+ *     copy, so that Mono finds the AOT image next to it, while the assembly is
+ *     based in the directory of the original, where its private references
+ *     are looked for
+ */
+static MonoAssembly*
+plmono_aot_open(PLMonoAssembly *entry, const char *path)
+{
+	MonoImage *image;
+	MonoImageOpenStatus status;
+
+	image = mono_image_open_full(path, &status, FALSE);
+	if (!image)
+		elog(ERROR, "Cannot load image of assembly %s", path);
+
+	return mono_assembly_load_from_full(image, entry->filename, &status, FALSE);
+}
+
+/*
+ * plmono_assembly_load
+ *
+ *     (Re)load assembly of registry entry and remember file status it was
+ *     loaded with. Assemblies are first loaded from AOT cache if possible;
+ *     new builds are JIT compiled until they are compiled into the cache
+ */
+static void
+plmono_assembly_load(PLMonoAssembly *entry, struct stat *st)
+{
+	MonoAssembly *assembly;
+	MonoImageOpenStatus status;
+	const char *path;
+
+	if (!entry->assembly)
+	{
+		path = plmono_aot_find(entry->filename, st);
+		entry->aot = (path != entry->filename);
+
+		if (entry->aot)
+			assembly = plmono_aot_open(entry, path);
+		else
+			assembly = mono_assembly_open(path, &status);
+		if (!assembly)
+			elog(ERROR, "Assembly %s not found", path);
+	}
+	else
+	{
+		assembly = plmono_assembly_reload(entry);
+		entry->aot = false;
+	}
+
+	entry->assembly = assembly;
+	entry->image = mono_assembly_get_image(assembly);
+	entry->st_dev = st->st_dev;
+	entry->st_ino = st->st_ino;
+	entry->st_mtime = st->st_mtime;
+	entry->st_size = st->st_size;
+	entry->generation++;
+	entry->loaded_at = GetCurrentTimestamp();
+	entry->checked_lxid = MyProc->lxid;
+}
+
+/*
+ * plmono_assembly_open
+ *
+ *     Get registry entry of specified assembly, loading the assembly if it
+ *     hasn't been loaded yet or if its file has changed since
+ */
+PLMonoAssembly*
+plmono_assembly_open(const char *filename)
+{
+	PLMonoAssembly *entry;
+	char key[MAXPGPATH];
+	struct stat st;
+	bool found;
+
+	if (!assembly_registry)
+		plmono_assembly_registry_init();
+
+	MemSet(key, 0, MAXPGPATH);
+	strlcpy(key, filename, MAXPGPATH);
+
+	entry = (PLMonoAssembly*) hash_search(assembly_registry, key, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->assembly = NULL;
+		entry->image = NULL;
+		entry->aot = false;
+		entry->generation = 0;
+		entry->hits = 0;
+	}
+
+	plmono_assembly_stat(filename, &st);
+
+	if (entry->assembly && !plmono_assembly_is_changed(entry, &st))
+	{
+		entry->checked_lxid = MyProc->lxid;
+		entry->hits++;
+		return entry;
+	}
+
+	plmono_assembly_load(entry, &st);
+
+	return entry;
+}
+
+/*
+ * plmono_assembly_is_current
+ *
+ *     Check whether specified generation of assembly is still the current one.
+ *     Assembly file is looked at no more than once per transaction
+ */
+bool
+plmono_assembly_is_current(PLMonoAssembly *entry, int generation)
+{
+	struct stat st;
+
+	entry->hits++;
+
+	if (entry->checked_lxid != MyProc->lxid)
+	{
+		plmono_assembly_stat(entry->filename, &st);
+
+		if (plmono_assembly_is_changed(entry, &st))
+			plmono_assembly_load(entry, &st);
+		else
+			entry->checked_lxid = MyProc->lxid;
+	}
+
+	return entry->generation == generation;
+}
+
+/*
+ * plmono_image_open
+ *
+ *     Try to load specified assembly and get its image, or report error on
+ *     failure
+ */
+MonoImage*
+plmono_image_open(const char *filename)
+{
+	return plmono_assembly_open(filename)->image;
+}
+
+/*
+ * plmono_assemblies
+ *
+ *     List assemblies loaded into the backend
+ */
+Datum
+plmono_assemblies(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo*) fcinfo->resultinfo;
+	Tuplestorestate *tupstore;
+	TupleDesc tupdesc;
+	MemoryContext per_query_ctx, oldcontext;
+	HASH_SEQ_STATUS status;
+	PLMonoAssembly *entry;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (!assembly_registry)
+		return (Datum) 0;
+
+	hash_seq_init(&status, assembly_registry);
+	while ((entry = (PLMonoAssembly*) hash_seq_search(&status)))
+	{
+		Datum values[8];
+		bool nulls[8];
+		MonoAssemblyName *aname;
+
+		MemSet(nulls, 0, sizeof(nulls));
+
+		if (!entry->assembly)
+			continue;
+
+		aname = mono_assembly_get_name(entry->assembly);
+
+		values[0] = CStringGetTextDatum(entry->filename);
+		values[1] = CStringGetTextDatum(mono_assembly_name_get_name(aname));
+		values[2] = Int32GetDatum(entry->generation);
+		values[3] = TimestampTzGetDatum(entry->loaded_at);
+		values[4] = TimestampTzGetDatum(time_t_to_timestamptz(entry->st_mtime));
+		values[5] = Int64GetDatum((int64) entry->st_size);
+		values[6] = Int64GetDatum(entry->hits);
+		values[7] = BoolGetDatum(entry->aot);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * plmono_aot_append_quoted
+ *
+ *     Append path to a shell command, quoted
+ */
+static void
+plmono_aot_append_quoted(StringInfo cmd, const char *path)
+{
+	const char *p;
+
+	appendStringInfoChar(cmd, '\'');
+	for (p = path; *p; p++)
+	{
+		if (*p == '\'')
+			appendStringInfoString(cmd, "'\\''");
+		else
+			appendStringInfoChar(cmd, *p);
+	}
+	appendStringInfoChar(cmd, '\'');
+}
+
+/*
+ * plmono_aot_compile
+ *
+ *     Compile assembly into AOT cache. The assembly is compiled where it is,
+ *     so that its references are resolved as at run time, and both its copy
+ *     and the image are moved into place only once complete; the copy keeps
+ *     modification time of the original, by which its build is recognized
+ */
+Datum
+plmono_aot_compile(PG_FUNCTION_ARGS)
+{
+	char copy[MAXPGPATH], tmpcopy[MAXPGPATH], image[MAXPGPATH], tmpimage[MAXPGPATH];
+	char dir[MAXPGPATH];
+	char *filename;
+	struct stat st;
+	struct utimbuf times;
+	StringInfoData cmd;
+	gchar *data;
+	gsize len;
+	gboolean written;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to compile assemblies")));
+
+	filename = plmono_expand_path(text_to_cstring(PG_GETARG_TEXT_PP(0)));
+
+	if (!plmono_aot_cached_path(filename, "", copy))
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("plmono.aot_cache_dir is not set")));
+
+	plmono_aot_cached_path(filename, ".tmp", tmpcopy);
+	plmono_aot_cached_path(filename, ".so", image);
+	plmono_aot_cached_path(filename, ".so.tmp", tmpimage);
+
+	strlcpy(dir, copy, MAXPGPATH);
+	get_parent_directory(dir);
+	if (pg_mkdir_p(dir, S_IRWXU) < 0 && errno != EEXIST)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("Could not create directory %s: %m", dir)));
+
+	/*
+     * Copy the assembly
+     */
+	plmono_assembly_stat(filename, &st);
+	if (!g_file_get_contents(filename, &data, &len, NULL))
+		elog(ERROR, "Cannot read assembly %s", filename);
+
+	written = g_file_set_contents(tmpcopy, data, len, NULL);
+	g_free(data);
+	if (!written)
+		elog(ERROR, "Cannot write %s", tmpcopy);
+
+	times.actime = st.st_atime;
+	times.modtime = st.st_mtime;
+	if (utime(tmpcopy, &times) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("Could not set modification time of %s: %m", tmpcopy)));
+
+	/*
+     * Compile it
+     */
+	initStringInfo(&cmd);
+	appendStringInfo(&cmd, "%s --aot=outfile=", PLMONO_MONO_BIN);
+	plmono_aot_append_quoted(&cmd, tmpimage);
+	appendStringInfoChar(&cmd, ' ');
+	plmono_aot_append_quoted(&cmd, filename);
+
+	fflush(stdout);
+	fflush(stderr);
+
+	if (system(cmd.data) != 0)
+	{
+		unlink(tmpcopy);
+		unlink(tmpimage);
+		ereport(ERROR,
+				(errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+				 errmsg("AOT compilation of assembly %s failed", filename),
+				 errdetail("Failed command was: %s", cmd.data)));
+	}
+
+	if (rename(tmpimage, image) < 0 || rename(tmpcopy, copy) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("Could not move AOT image of %s into place: %m", filename)));
+
+	PG_RETURN_TEXT_P(cstring_to_text(image));
+}
@@ -0,0 +1,33 @@
+#ifndef _PLMONO_ASSEMBLY_H
+#define _PLMONO_ASSEMBLY_H
+
+#include <sys/types.h>
+
+#include "utils/timestamp.h"
+
+/*
+ * Assembly loaded into PL/Mono backend, keyed by file name
+ */
+typedef struct PLMonoAssembly
+{
+	char filename[MAXPGPATH];        /* hash key, must be first */
+	MonoAssembly *assembly;          /* loaded assembly, or NULL */
+	MonoImage *image;                /* its image */
+	dev_t st_dev;                    /* device of the file it was loaded from */
+	ino_t st_ino;                    /* inode of the file it was loaded from */
+	time_t st_mtime;                 /* modification time of the file */
+	off_t st_size;                   /* size of the file */
+	bool aot;                        /* loaded from AOT cache */
+	int generation;                  /* number of times the file was loaded */
+	TimestampTz loaded_at;           /* time of the last load */
+	LocalTransactionId checked_lxid; /* transaction file was last checked in */
+	int64 hits;                      /* number of lookups served from registry */
+} PLMonoAssembly;
+
+extern char *plmono_aot_cache_dir;
+
+PLMonoAssembly* plmono_assembly_open(const char *filename);
+bool plmono_assembly_is_current(PLMonoAssembly *entry, int generation);
+MonoImage* plmono_image_open(const char *filename);
+
+#endif
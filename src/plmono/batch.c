@@ -0,0 +1,502 @@
+/*-------------------------------------------------------------------------
+ *
+ * batch.c
+ *     batch methods, called once for many rows with arrays of arguments
+ *
+ * Copyright (c) 2009, Olexandr Melnyk <me@omelnyk.net>
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "access/heapam.h"
+#include "executor/spi.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
+#include "catalog/pg_language.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+
+#include <mono/jit/jit.h>
+#include <mono/metadata/assembly.h>
+#include <mono/metadata/appdomain.h>
+#include <mono/metadata/object.h>
+#include <mono/metadata/reflection.h>
+#include <mono/metadata/tabledefs.h>
+
+#include "helpers.h"
+#include "core.h"
+#include "assembly.h"
+#include "marshal.h"
+#include "cache.h"
+#include "spi.h"
+#include "batch.h"
+#include "composite.h"
+#include "stats.h"
+
+PG_FUNCTION_INFO_V1(plmono_map);
+
+/*
+ * Rows passed to a batch method at once unless SqlBatch.Size says otherwise
+ */
+#define PLMONO_BATCH_DEFAULT_SIZE 1000
+
+/*
+ * plmono_batch_resolve
+ *
+ *     Find method marked with SqlBatch attribute, which takes an array for
+ *     each argument of the function and returns an array of results. Only
+ *     scalar functions with IN arguments qualify
+ */
+void
+plmono_batch_resolve(PLMonoFunction *desc)
+{
+	MonoClass *attr_class;
+	MonoCustomAttrInfo *cinfo;
+	MonoMethod *method;
+	MonoObject *attr;
+	MonoType **types;
+	MonoClass *retclass;
+	gint32 size = 0;
+	int i;
+
+	if (desc->retset || desc->nouts || desc->nparams == 0 || !desc->retplan.tm ||
+		desc->rettype == VOIDOID)
+		return;
+
+	/*
+     * Composite arguments are converted by layouts, not by to_obj, so they
+     * cannot be stored in arrays
+     */
+	for (i = 0; i < desc->nparams; i++)
+		if (!desc->argplan[i].klass || desc->argplan[i].tm == &plmono_composite_marshal)
+			return;
+
+	types = (MonoType**) palloc(desc->nparams * sizeof(MonoType*));
+	for (i = 0; i < desc->nparams; i++)
+		types[i] = mono_class_get_type(mono_array_class_get(desc->argplan[i].klass, 1));
+
+	method = mono_method_find(desc->klass, desc->method_name, types, desc->nparams);
+	pfree(types);
+
+	if (!method)
+		return;
+
+	if (!(mono_method_get_flags(method, NULL) & METHOD_ATTRIBUTE_STATIC))
+		return;
+
+	retclass = mono_class_from_mono_type(mono_signature_get_return_type(mono_method_signature(method)));
+	if (retclass != mono_array_class_get(desc->retplan.klass, 1))
+		return;
+
+	attr_class = plmono_class_from_name(plmono_get_plmono_image(), "PLMono", "SqlBatch");
+	if (!(cinfo = mono_custom_attrs_from_method(method)))
+		return;
+
+	if (!mono_custom_attrs_has_attr(cinfo, attr_class))
+	{
+		mono_custom_attrs_free(cinfo);
+		return;
+	}
+
+	attr = mono_custom_attrs_get_attr(cinfo, attr_class);
+	mono_field_get_value(attr, mono_class_get_field_from_name(attr_class, "size"), &size);
+	mono_custom_attrs_free(cinfo);
+
+	desc->batch_method = method;
+	desc->batch_size = size > 0 ? size : PLMONO_BATCH_DEFAULT_SIZE;
+}
+
+/*
+ * plmono_batch_set
+ *
+ *     Store argument value in element of the array, without boxing
+ */
+static void
+plmono_batch_set(PLMonoMarshal *m, MonoArray *arr, int index, Datum val, bool isnull)
+{
+	PLMonoValue slot;
+	gpointer obj;
+	int elsize;
+
+	if (isnull)
+	{
+		if (!m->tm->is_reference)
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("NULL cannot be passed to batch method as %s", mono_class_get_name(m->klass))));
+
+		mono_array_setref(arr, index, NULL);
+		return;
+	}
+
+	obj = m->tm->to_obj(val, &slot);
+	if (m->tm->is_reference)
+		mono_array_setref(arr, index, obj);
+	else
+	{
+		elsize = mono_class_array_element_size(m->klass);
+		memcpy(mono_array_addr_with_size(arr, elsize, index), obj, elsize);
+	}
+}
+
+/*
+ * plmono_batch_get
+ *
+ *     Convert element of result array into a Datum
+ */
+static Datum
+plmono_batch_get(PLMonoMarshal *m, MonoArray *arr, int index, bool *isnull)
+{
+	MonoObject *obj;
+
+	*isnull = false;
+
+	if (!m->tm->is_reference)
+		return m->tm->to_datum(mono_array_addr_with_size(arr, mono_class_array_element_size(m->klass), index));
+
+	if (!(obj = mono_array_get(arr, MonoObject*, index)))
+	{
+		*isnull = true;
+		return (Datum) 0;
+	}
+
+	return m->tm->to_datum(obj);
+}
+
+/*
+ * plmono_batch_new_args
+ *
+ *     Create argument arrays for n rows. They are kept in an object array, so
+ *     that they are reachable by the GC while the others are allocated
+ */
+static MonoArray*
+plmono_batch_new_args(PLMonoFunction *desc, int n)
+{
+	MonoDomain *domain = plmono_get_domain();
+	MonoArray *holder;
+	int i;
+
+	holder = mono_array_new(domain, mono_get_object_class(), desc->nparams);
+	for (i = 0; i < desc->nparams; i++)
+		mono_array_setref(holder, i, mono_array_new(domain, desc->argplan[i].klass, n));
+
+	return holder;
+}
+
+/*
+ * plmono_batch_invoke
+ *
+ *     Call batch method with argument arrays of n rows, returning array of
+ *     n results
+ */
+static MonoArray*
+plmono_batch_invoke(PLMonoFunction *desc, MonoArray *holder, int n)
+{
+	MonoObject *result, *exc = NULL;
+	gpointer *args;
+	int i;
+
+	args = (gpointer*) palloc(desc->nparams * sizeof(gpointer));
+	for (i = 0; i < desc->nparams; i++)
+		args[i] = mono_array_get(holder, MonoArray*, i);
+
+	result = mono_runtime_invoke(desc->batch_method, NULL, args, &exc);
+	if (exc)
+		plmono_report_exception(exc);
+
+	if (!result || mono_array_length((MonoArray*) result) != n)
+		elog(ERROR, "Batch method %s must return one result per row", desc->method_name);
+
+	pfree(args);
+
+	return (MonoArray*) result;
+}
+
+/*
+ * plmono_batch_call
+ *
+ *     Call batch method for a single row, for functions which have no
+ *     per-row method
+ */
+Datum
+plmono_batch_call(FunctionCallInfo fcinfo, PLMonoFunction *desc)
+{
+	MonoArray *holder, *result;
+	PLMonoMarshal *m;
+	Datum retval;
+	bool isnull;
+	int i;
+
+	plmono_stat_phase(PLMONO_PHASE_ARGS);
+	plmono_stat_args(desc, fcinfo);
+
+	holder = plmono_batch_new_args(desc, 1);
+	for (i = 0; i < desc->nparams; i++)
+	{
+		m = &desc->argplan[i];
+		plmono_batch_set(m, mono_array_get(holder, MonoArray*, i), 0,
+						 fcinfo->arg[m->argno], fcinfo->argnull[m->argno]);
+	}
+
+	plmono_stat_phase(PLMONO_PHASE_MANAGED);
+	result = plmono_batch_invoke(desc, holder, 1);
+
+	plmono_stat_phase(PLMONO_PHASE_RESULT);
+	retval = plmono_batch_get(&desc->retplan, result, 0, &isnull);
+	fcinfo->isnull = isnull;
+
+	return retval;
+}
+
+/*
+ * plmono_batch_run
+ *
+ *     Pass a batch of rows, whose columns are arguments of the function, to
+ *     the batch method and append results to the tuplestore. Rows with NULL
+ *     arguments of a strict function yield NULL without being passed
+ */
+static void
+plmono_batch_run(PLMonoFunction *desc, SPITupleTable *tuptable, int nrows,
+				 Tuplestorestate *tupstore, TupleDesc restupdesc)
+{
+	PLMonoSpiFrame frame;
+	MonoArray *holder, *result = NULL;
+	Datum *values, retval;
+	bool *nulls, *skip, isnull;
+	int nargs = desc->nparams;
+	int i, j, n;
+
+	values = (Datum*) palloc(nrows * nargs * sizeof(Datum));
+	nulls = (bool*) palloc(nrows * nargs * sizeof(bool));
+	skip = (bool*) palloc0(nrows * sizeof(bool));
+
+	n = 0;
+	for (j = 0; j < nrows; j++)
+	{
+		heap_deform_tuple(tuptable->vals[j], tuptable->tupdesc, &values[j * nargs], &nulls[j * nargs]);
+
+		if (desc->strict)
+			for (i = 0; i < nargs; i++)
+				if (nulls[j * nargs + i])
+					skip[j] = true;
+
+		if (!skip[j])
+			n++;
+	}
+
+	if (n > 0)
+	{
+		holder = plmono_batch_new_args(desc, n);
+		for (i = 0; i < nargs; i++)
+		{
+			MonoArray *arr = mono_array_get(holder, MonoArray*, i);
+			int k = 0;
+
+			for (j = 0; j < nrows; j++)
+				if (!skip[j])
+					plmono_batch_set(&desc->argplan[i], arr, k++, values[j * nargs + i], nulls[j * nargs + i]);
+		}
+
+		/*
+         * Queries run by the method are attributed to the function
+         */
+		plmono_spi_push(&frame, desc);
+		PG_TRY();
+		{
+			result = plmono_batch_invoke(desc, holder, n);
+		}
+		PG_CATCH();
+		{
+			plmono_spi_pop(&frame, true);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+		plmono_spi_pop(&frame, false);
+	}
+
+	n = 0;
+	for (j = 0; j < nrows; j++)
+	{
+		if (skip[j])
+		{
+			retval = (Datum) 0;
+			isnull = true;
+		}
+		else
+			retval = plmono_batch_get(&desc->retplan, result, n++, &isnull);
+
+		tuplestore_putvalues(tupstore, restupdesc, &retval, &isnull);
+	}
+}
+
+/*
+ * plmono_batch_check_language
+ *
+ *     Report error unless function is written in PL/Mono
+ */
+static void
+plmono_batch_check_language(Oid fn_oid)
+{
+	HeapTuple procTup, langTup;
+	Oid langoid;
+
+	langTup = SearchSysCache(LANGNAME, CStringGetDatum("plmono"), 0, 0, 0);
+	if (!HeapTupleIsValid(langTup))
+		elog(ERROR, "Language plmono does not exist");
+	langoid = HeapTupleGetOid(langTup);
+	ReleaseSysCache(langTup);
+
+	procTup = plmono_search_pg_function(fn_oid);
+	if (((Form_pg_proc) GETSTRUCT(procTup))->prolang != langoid)
+		ereport(ERROR,
+				(errcode(ERRCODE_WRONG_OBJECT_TYPE),
+				 errmsg("Function %u is not written in PL/Mono", fn_oid)));
+	ReleaseSysCache(procTup);
+}
+
+/*
+ * plmono_map
+ *
+ *     Apply PL/Mono function with a batch method to rows of a query, whose
+ *     columns are arguments of the function, returning a row with the result
+ *     for each of them. Rows are passed to the method in batches
+ */
+Datum
+plmono_map(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo*) fcinfo->resultinfo;
+	Oid fn_oid;
+	char *query;
+	int batch = PG_ARGISNULL(2) ? 0 : PG_GETARG_INT32(2);
+	PLMonoFunction *desc;
+	Tuplestorestate *tupstore;
+	TupleDesc tupdesc;
+	MemoryContext per_query_ctx, oldcontext, batchcxt;
+	Portal portal;
+	bool checked = false;
+	int i;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("Function and query of plmono_map must not be NULL")));
+
+	fn_oid = PG_GETARG_OID(0);
+	query = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Return type must be a row type");
+
+	plmono_warm_up();
+	plmono_batch_check_language(fn_oid);
+
+	desc = plmono_cache_lookup(fn_oid);
+	if (!desc->batch_method)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("Function %u has no method marked with SqlBatch attribute", fn_oid)));
+
+	if (tupdesc->natts != 1 || tupdesc->attrs[0]->atttypid != desc->rettype)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("Result must be a single column of the function's return type")));
+
+	if (batch <= 0)
+		batch = desc->batch_size;
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	/*
+     * The descriptor must outlive the scan, even if the function is replaced
+     * by a query it runs
+     */
+	desc->depth++;
+	PG_TRY();
+	{
+		if (SPI_connect() != SPI_OK_CONNECT)
+			elog(ERROR, "SPI_connect failed");
+
+		if (!(portal = SPI_cursor_open_with_args(NULL, query, 0, NULL, NULL, NULL, true, 0)))
+			elog(ERROR, "SPI_cursor_open_with_args failed: %s", SPI_result_code_string(SPI_result));
+
+		/*
+         * Converted values of a batch are released before the next one
+         */
+		batchcxt = AllocSetContextCreate(CurrentMemoryContext,
+										 "PL/Mono batch",
+										 ALLOCSET_DEFAULT_MINSIZE,
+										 ALLOCSET_DEFAULT_INITSIZE,
+										 ALLOCSET_DEFAULT_MAXSIZE);
+
+		for (;;)
+		{
+			SPI_cursor_fetch(portal, true, batch);
+			if (SPI_processed == 0)
+				break;
+
+			if (!checked)
+			{
+				TupleDesc argdesc = SPI_tuptable->tupdesc;
+
+				if (argdesc->natts != desc->nparams)
+					ereport(ERROR,
+							(errcode(ERRCODE_DATATYPE_MISMATCH),
+							 errmsg("Query must return %d columns, one for each argument of the function", desc->nparams)));
+
+				for (i = 0; i < desc->nparams; i++)
+					if (argdesc->attrs[i]->atttypid != desc->argplan[i].typeoid)
+						ereport(ERROR,
+								(errcode(ERRCODE_DATATYPE_MISMATCH),
+								 errmsg("Type of query column %d doesn't match type of function argument", i + 1)));
+
+				checked = true;
+			}
+
+			oldcontext = MemoryContextSwitchTo(batchcxt);
+			plmono_batch_run(desc, SPI_tuptable, SPI_processed, tupstore, tupdesc);
+			MemoryContextSwitchTo(oldcontext);
+			MemoryContextReset(batchcxt);
+
+			SPI_freetuptable(SPI_tuptable);
+		}
+
+		SPI_cursor_close(portal);
+		MemoryContextDelete(batchcxt);
+		SPI_finish();
+	}
+	PG_CATCH();
+	{
+		plmono_cache_release(desc);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	plmono_cache_release(desc);
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
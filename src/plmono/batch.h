@@ -0,0 +1,8 @@
+#ifndef _PLMONO_BATCH_H
+#define _PLMONO_BATCH_H
+
+void plmono_batch_resolve(PLMonoFunction *desc);
+Datum plmono_batch_call(FunctionCallInfo fcinfo, PLMonoFunction *desc);
+Datum plmono_map(PG_FUNCTION_ARGS);
+
+#endif
@@ -0,0 +1,664 @@
+/*-------------------------------------------------------------------------
+ *
+ * cache.c
+ *     backend-wide cache of resolved PL/Mono functions
+ *
+ * Copyright (c) 2009, Olexandr Melnyk <me@omelnyk.net>
+ *
+ *------------------------------------------------------------------------- 
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "access/heapam.h"
+#include "utils/syscache.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "funcapi.h"
+#include "string.h"
+
+#include <mono/jit/jit.h>
+#include <mono/metadata/assembly.h>
+#include <mono/metadata/appdomain.h>
+
+#include "helpers.h"
+#include "core.h"
+#include "assembly.h"
+#include "marshal.h"
+#include "cache.h"
+#include "thunk.h"
+#include "trigger.h"
+#include "agg.h"
+#include "batch.h"
+#include "toast.h"
+#include "composite.h"
+#include "instance.h"
+
+/*
+ * Entry of function cache hash table
+ */
+typedef struct PLMonoFunctionEntry
+{
+	Oid fn_oid;                      /* hash key, must be first */
+	PLMonoFunction *desc;            /* most recent descriptor of the function */
+	uint32 generation;               /* bumped whenever desc is replaced */
+	GHashTable *plans;               /* prepared SPI plans of the function */
+} PLMonoFunctionEntry;
+
+/*
+ * Function cache, keyed by function Oid
+ */
+static HTAB *function_cache = NULL;
+
+/*
+ * Parent context of all function descriptors
+ */
+static MemoryContext function_cache_mcxt = NULL;
+
+static void plmono_cache_invalidate(Datum arg, int cacheid, ItemPointer tuplePtr);
+
+/*
+ * plmono_cache_init
+ *
+ *     Create function cache and subscribe to pg_proc invalidations
+ */
+static void
+plmono_cache_init(void)
+{
+	HASHCTL ctl;
+
+	function_cache_mcxt = AllocSetContextCreate(TopMemoryContext,
+												"PL/Mono function cache",
+												ALLOCSET_DEFAULT_MINSIZE,
+												ALLOCSET_DEFAULT_INITSIZE,
+												ALLOCSET_DEFAULT_MAXSIZE);
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(PLMonoFunctionEntry);
+	ctl.hash = oid_hash;
+	ctl.hcxt = function_cache_mcxt;
+
+	function_cache = hash_create("PL/Mono function cache", 128, &ctl,
+								 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	CacheRegisterSyscacheCallback(PROCOID, plmono_cache_invalidate, (Datum) 0);
+}
+
+/*
+ * plmono_cache_invalidate
+ *
+ *     Syscache callback marking descriptors of changed pg_proc entries as
+ *     invalid. A NULL tuplePtr means that all entries must be invalidated
+ */
+static void
+plmono_cache_invalidate(Datum arg, int cacheid, ItemPointer tuplePtr)
+{
+	HASH_SEQ_STATUS status;
+	PLMonoFunctionEntry *entry;
+
+	hash_seq_init(&status, function_cache);
+	while ((entry = (PLMonoFunctionEntry*) hash_seq_search(&status)))
+	{
+		if (entry->desc == NULL)
+			continue;
+
+		if (tuplePtr == NULL || ItemPointerEquals(&entry->desc->fn_tid, tuplePtr))
+			entry->desc->valid = false;
+	}
+}
+
+/*
+ * plmono_cache_build_plan
+ *
+ *     Build marshalling plans of method parameters and function result, and
+ *     allocate buffers reused by its calls. OUT arguments of set-returning
+ *     functions describe result columns rather than method parameters
+ */
+static void
+plmono_cache_build_plan(PLMonoFunction *desc)
+{
+	int argcount = desc->argcount;
+	int nvals, i, argno;
+	PLMonoMarshal *m;
+	char argmode;
+
+	desc->argplan = (PLMonoMarshal*) palloc0((argcount + 1) * sizeof(PLMonoMarshal));
+	desc->paramtypes = (MonoType**) palloc((argcount + 1) * sizeof(MonoType*));
+	desc->argbuf = (PLMonoValue*) palloc0((argcount + 1) * sizeof(PLMonoValue));
+	desc->args = (gpointer*) palloc0((argcount + 1) * sizeof(gpointer));
+
+	desc->nparams = 0;
+	desc->nouts = 0;
+	argno = 0;
+	for (i = 0; i < argcount; i++)
+	{
+		argmode = desc->argmodes ? desc->argmodes[i] : PROARGMODE_IN;
+		m = &desc->argplan[desc->nparams];
+
+		/*
+         * State of managed aggregate is passed to the method as its target
+         * or as a parameter of aggregate's class
+         */
+		if (desc->argtypes[i] == INTERNALOID)
+		{
+			argno++;
+			continue;
+		}
+
+		if (argmode == PROARGMODE_OUT || argmode == PROARGMODE_TABLE)
+		{
+			if (desc->retset)
+				continue;
+
+			plmono_marshal_init(m, desc->argtypes[i], argmode, -1);
+		}
+		else if (type_is_rowtype(desc->argtypes[i]))
+			plmono_composite_init(m, desc->argtypes[i], argmode, argno++);
+		else if (desc->retset)
+			plmono_marshal_init(m, desc->argtypes[i], PROARGMODE_IN, argno++);
+		else
+			plmono_marshal_init(m, desc->argtypes[i], argmode, argno++);
+
+		if (m->byref)
+			desc->nouts++;
+
+		desc->paramtypes[desc->nparams++] = m->type;
+	}
+
+	/*
+     * Plans of result columns of set-returning functions
+     */
+	nvals = desc->nouts;
+	if (desc->retset && desc->rettypeclass == TYPEFUNC_COMPOSITE)
+	{
+		nvals = desc->rettupdesc->natts;
+		desc->colplan = (PLMonoMarshal*) palloc0(nvals * sizeof(PLMonoMarshal));
+
+		for (i = 0; i < nvals; i++)
+			plmono_marshal_init(&desc->colplan[i], desc->rettupdesc->attrs[i]->atttypid, PROARGMODE_IN, -1);
+	}
+
+	desc->outvals = (Datum*) palloc0((nvals + 1) * sizeof(Datum));
+	desc->outnulls = (bool*) palloc0((nvals + 1) * sizeof(bool));
+
+	if (!desc->is_trigger && desc->nouts == 0 && desc->rettypeclass == TYPEFUNC_SCALAR &&
+		desc->rettype != INTERNALOID)
+		plmono_marshal_init(&desc->retplan, desc->rettype, PROARGMODE_IN, -1);
+}
+
+/*
+ * plmono_cache_match_method
+ *
+ *     Look for method whose parameters match arguments one by one, allowing
+ *     Nullable<T> in place of value types, and classes or structs of user's
+ *     assemblies having fields of composite types in place of them. Plans of
+ *     arguments are switched to the types of the method found; more than one
+ *     method matching is an error
+ */
+static void
+plmono_cache_match_method(PLMonoFunction *desc)
+{
+	MonoClass **nullable;
+	MonoMethod *method, *found = NULL;
+	MonoMethodSignature *sig;
+	MonoType *ptype;
+	MonoClass *pclass;
+	gpointer iter, piter;
+	bool any = false, match;
+	int i;
+
+	nullable = (MonoClass**) palloc0((desc->nparams + 1) * sizeof(MonoClass*));
+	for (i = 0; i < desc->nparams; i++)
+	{
+		if (!desc->argplan[i].klass)
+			any = true;
+		else if (!desc->argplan[i].byref && !desc->argplan[i].tm->is_reference)
+		{
+			nullable[i] = plmono_marshal_nullable_class(desc->argplan[i].klass);
+			any = true;
+		}
+	}
+
+	iter = NULL;
+	while (any && (method = mono_class_get_methods(desc->klass, &iter)))
+	{
+		if (strcmp(mono_method_get_name(method), desc->method_name) != 0)
+			continue;
+
+		sig = mono_method_signature(method);
+		if (mono_signature_get_param_count(sig) != desc->nparams)
+			continue;
+
+		match = true;
+		piter = NULL;
+		for (i = 0; match && (ptype = mono_signature_get_params(sig, &piter)); i++)
+		{
+			pclass = mono_class_from_mono_type(ptype);
+			if (mono_type_is_byref(ptype) != desc->argplan[i].byref)
+				match = false;
+			else if (!desc->argplan[i].klass)
+				match = plmono_composite_maps(desc->argplan[i].typeoid, pclass);
+			else if (pclass != desc->argplan[i].klass && pclass != nullable[i])
+				match = false;
+		}
+
+		if (!match)
+			continue;
+
+		if (found)
+			ereport(ERROR,
+					(errcode(ERRCODE_AMBIGUOUS_FUNCTION),
+					 errmsg("Method %s of class %s is ambiguous for arguments of the function",
+							desc->method_name, mono_class_get_name(desc->klass)),
+					 errhint("Leave only one overload taking %d parameters that match the arguments.",
+							 desc->nparams)));
+		found = method;
+	}
+
+	if (found)
+	{
+		sig = mono_method_signature(found);
+		piter = NULL;
+		for (i = 0; (ptype = mono_signature_get_params(sig, &piter)); i++)
+		{
+			if (!desc->argplan[i].klass)
+			{
+				desc->argplan[i].klass = mono_class_from_mono_type(ptype);
+				desc->argplan[i].type = ptype;
+				desc->paramtypes[i] = ptype;
+			}
+			else if (nullable[i] && mono_class_from_mono_type(ptype) == nullable[i])
+			{
+				plmono_marshal_use_nullable(&desc->argplan[i], nullable[i]);
+				desc->paramtypes[i] = ptype;
+			}
+		}
+
+		desc->method = found;
+	}
+
+	pfree(nullable);
+}
+
+/*
+ * plmono_cache_check_result
+ *
+ *     Check that method returns the Mono counterpart of the declared result
+ *     type, or Nullable<T> of it. Functions returning void may call methods
+ *     returning anything, their return value being discarded
+ */
+static void
+plmono_cache_check_result(PLMonoFunction *desc)
+{
+	MonoClass *retclass;
+
+	if (!desc->method || desc->retset || !desc->retplan.tm || desc->rettype == VOIDOID)
+		return;
+
+	retclass = mono_class_from_mono_type(mono_signature_get_return_type(mono_method_signature(desc->method)));
+	if (retclass == desc->retplan.klass)
+		return;
+
+	if (!desc->retplan.tm->is_reference &&
+		retclass == plmono_marshal_nullable_class(desc->retplan.klass))
+		return;
+
+	ereport(ERROR,
+			(errcode(ERRCODE_DATATYPE_MISMATCH),
+			 errmsg("Method %s returns %s, which doesn't match result type %s",
+					desc->method_name, mono_class_get_name(retclass), format_type_be(desc->rettype)),
+			 errhint("Declare the method as returning %s.", mono_class_get_name(desc->retplan.klass))));
+}
+
+/*
+ * plmono_cache_resolve
+ *
+ *     Fill descriptor from pg_proc tuple of the function and find its method
+ */
+static void
+plmono_cache_resolve(PLMonoFunction *desc, HeapTuple procTup)
+{
+	Form_pg_proc procStruct = (Form_pg_proc) GETSTRUCT(procTup);
+	TupleDesc resultTupleDesc;
+	char **argnames;
+	char *source;
+
+	desc->fn_xmin = HeapTupleHeaderGetXmin(procTup->t_data);
+	desc->fn_tid = procTup->t_self;
+	desc->rettype = procStruct->prorettype;
+	desc->is_trigger = (procStruct->prorettype == TRIGGEROID);
+	desc->retset = procStruct->proretset;
+	desc->strict = procStruct->proisstrict;
+
+	/*
+     * Get characteristics of the function and parse its body
+     */
+	plmono_lookup_pg_function(procTup, &source, &desc->argtypes, &argnames,
+	    &desc->argmodes, &desc->argcount);
+	plmono_parse_function_body(source, &desc->assembly, &desc->sig, &desc->method_name);
+
+	if (desc->is_trigger && desc->argcount)
+		elog(ERROR, "PL/Mono trigger function cannot have explicit arguments");
+
+	desc->agg_role = plmono_agg_role(desc);
+
+	/*
+     * Remember shape of the result, so that it's not recomputed on each call
+     */
+	if (!desc->is_trigger)
+	{
+		desc->rettypeclass = get_func_result_type(desc->fn_oid, NULL, &resultTupleDesc);
+		if (resultTupleDesc)
+			desc->rettupdesc = BlessTupleDesc(CreateTupleDescCopy(resultTupleDesc));
+	}
+
+	/*
+     * Find corresponding Mono method
+     */
+	plmono_cache_build_plan(desc);
+	desc->assembly_entry = plmono_assembly_open(desc->assembly);
+	desc->assembly_generation = desc->assembly_entry->generation;
+	desc->image = desc->assembly_entry->image;
+	desc->klass = plmono_class_find(desc->image, desc->sig);
+
+	/*
+     * Trigger methods may either take TriggerData or access it through
+     * TriggerData.Current
+     */
+	if (desc->is_trigger)
+	{
+		desc->paramtypes[0] = mono_class_get_type(plmono_trigger_data_get_class());
+		desc->method = mono_method_find(desc->klass, desc->method_name, desc->paramtypes, 1);
+		desc->nparams = desc->method ? 1 : 0;
+	}
+	else if (desc->agg_role != PLMONO_AGG_NONE)
+		plmono_agg_resolve(desc);
+
+	/*
+     * Large text and bytea arguments may be taken as streams, arguments of
+     * value types as Nullable<T> to receive NULL, and composite arguments as
+     * user's classes. Functions may also have a batch method, taking arrays
+     * of arguments, either alongside the per-row one or instead of it
+     */
+	if (!desc->method)
+	{
+		desc->method = mono_method_find(desc->klass, desc->method_name, desc->paramtypes, desc->nparams);
+		if (!desc->method)
+			plmono_toast_resolve(desc);
+		if (!desc->method)
+			plmono_cache_match_method(desc);
+		plmono_batch_resolve(desc);
+
+		if (!desc->method && !desc->batch_method)
+			elog(ERROR, "Method %s with specified signature not found", desc->method_name);
+	}
+	plmono_cache_check_result(desc);
+	plmono_instance_resolve(desc);
+	plmono_thunk_prepare(desc);
+
+	desc->scratch = AllocSetContextCreate(desc->mcxt,
+										  "PL/Mono call scratch",
+										  ALLOCSET_SMALL_MINSIZE,
+										  ALLOCSET_SMALL_INITSIZE,
+										  ALLOCSET_SMALL_MAXSIZE);
+}
+
+/*
+ * plmono_cache_compile
+ *
+ *     Resolve function described by pg_proc tuple into a new descriptor. Its
+ *     context is deleted if the function cannot be resolved
+ */
+static PLMonoFunction*
+plmono_cache_compile(Oid fn_oid, HeapTuple procTup)
+{
+	MemoryContext mcxt, oldcxt;
+	PLMonoFunction *desc;
+
+	mcxt = AllocSetContextCreate(function_cache_mcxt,
+								 "PL/Mono function",
+								 ALLOCSET_SMALL_MINSIZE,
+								 ALLOCSET_SMALL_INITSIZE,
+								 ALLOCSET_SMALL_MAXSIZE);
+	oldcxt = MemoryContextSwitchTo(mcxt);
+
+	desc = (PLMonoFunction*) palloc0(sizeof(PLMonoFunction));
+	desc->fn_oid = fn_oid;
+	desc->mcxt = mcxt;
+
+	PG_TRY();
+	{
+		plmono_cache_resolve(desc, procTup);
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcxt);
+		MemoryContextDelete(mcxt);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	MemoryContextSwitchTo(oldcxt);
+
+	desc->valid = true;
+	return desc;
+}
+
+/*
+ * plmono_cache_lookup_entry
+ *
+ *     Get cache entry of function by its Oid, resolving the function if it
+ *     isn't cached yet or if its pg_proc entry has changed since
+ */
+static PLMonoFunctionEntry*
+plmono_cache_lookup_entry(Oid fn_oid)
+{
+	PLMonoFunctionEntry *entry;
+	HeapTuple procTup;
+	bool found;
+
+	if (!function_cache)
+		plmono_cache_init();
+
+	entry = (PLMonoFunctionEntry*) hash_search(function_cache, &fn_oid, HASH_ENTER, &found);
+	if (!found)
+	{
+		entry->desc = NULL;
+		entry->generation = 0;
+		entry->plans = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	}
+
+	if (entry->desc && entry->desc->valid &&
+		plmono_assembly_is_current(entry->desc->assembly_entry, entry->desc->assembly_generation))
+		return entry;
+
+	/*
+     * Stale descriptors are freed unless calls in progress still use them,
+     * in which case the last of those does. Call sites bound to them notice
+     * the new generation and come here
+     */
+	if (entry->desc)
+	{
+		plmono_instance_release(entry->desc);
+		if (entry->desc->depth == 0)
+			MemoryContextDelete(entry->desc->mcxt);
+		else
+			entry->desc->orphaned = true;
+	}
+	entry->desc = NULL;
+	entry->generation++;
+
+	procTup = plmono_search_pg_function(fn_oid);
+	entry->desc = plmono_cache_compile(fn_oid, procTup);
+	entry->desc->plans = entry->plans;
+	ReleaseSysCache(procTup);
+
+	return entry;
+}
+
+/*
+ * plmono_cache_lookup
+ *
+ *     Get descriptor of function by its Oid
+ */
+PLMonoFunction*
+plmono_cache_lookup(Oid fn_oid)
+{
+	return plmono_cache_lookup_entry(fn_oid)->desc;
+}
+
+/*
+ * plmono_cache_bind_result
+ *
+ *     Set shape of the result at the call site. Functions returning record
+ *     get it from the call site, once per call site rather than per call
+ */
+static void
+plmono_cache_bind_result(FunctionCallInfo fcinfo, PLMonoCallSite *site, PLMonoFunction *desc)
+{
+	MemoryContext oldcxt;
+	TupleDesc tupdesc;
+	int i;
+
+	if (site->own_result)
+	{
+		if (site->rettupdesc)
+			FreeTupleDesc(site->rettupdesc);
+		if (site->colplan)
+			pfree(site->colplan);
+		pfree(site->values);
+		pfree(site->nulls);
+		site->own_result = false;
+	}
+
+	if (desc->is_trigger || desc->rettypeclass != TYPEFUNC_RECORD)
+	{
+		site->rettypeclass = desc->rettypeclass;
+		site->rettupdesc = desc->rettupdesc;
+		site->colplan = desc->colplan;
+		site->values = desc->outvals;
+		site->nulls = desc->outnulls;
+		site->own_result = false;
+		return;
+	}
+
+	oldcxt = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+	site->rettypeclass = get_call_result_type(fcinfo, NULL, &tupdesc);
+	site->rettupdesc = tupdesc ? BlessTupleDesc(CreateTupleDescCopy(tupdesc)) : NULL;
+	site->colplan = NULL;
+	site->own_result = true;
+
+	if (site->rettupdesc && desc->retset)
+	{
+		site->colplan = (PLMonoMarshal*) palloc0(site->rettupdesc->natts * sizeof(PLMonoMarshal));
+		for (i = 0; i < site->rettupdesc->natts; i++)
+			plmono_marshal_init(&site->colplan[i], site->rettupdesc->attrs[i]->atttypid, PROARGMODE_IN, -1);
+	}
+
+	site->values = (Datum*) palloc0(((site->rettupdesc ? site->rettupdesc->natts : 0) + 1) * sizeof(Datum));
+	site->nulls = (bool*) palloc0(((site->rettupdesc ? site->rettupdesc->natts : 0) + 1) * sizeof(bool));
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * plmono_cache_get
+ *
+ *     Get descriptor of function called through specified call site. The
+ *     call site, kept in fn_extra, refers to the cache entry and remembers
+ *     generation of the descriptor, so that subsequent calls skip hash lookup
+ *     until the function changes. The call site is bound only once the
+ *     function is resolved, so that calls following an error look it up again
+ */
+PLMonoFunction*
+plmono_cache_get(FunctionCallInfo fcinfo)
+{
+	FmgrInfo *flinfo = fcinfo->flinfo;
+	PLMonoCallSite *site = (PLMonoCallSite*) flinfo->fn_extra;
+	PLMonoFunctionEntry *entry;
+	PLMonoFunction *desc;
+
+	if (site && site->entry && site->generation == site->entry->generation)
+	{
+		desc = site->entry->desc;
+		if (desc->valid && plmono_assembly_is_current(desc->assembly_entry, desc->assembly_generation))
+			return desc;
+	}
+
+	entry = plmono_cache_lookup_entry(flinfo->fn_oid);
+
+	if (!site)
+	{
+		site = (PLMonoCallSite*) MemoryContextAllocZero(flinfo->fn_mcxt, sizeof(PLMonoCallSite));
+		flinfo->fn_extra = site;
+	}
+
+	site->entry = NULL;
+	plmono_cache_bind_result(fcinfo, site, entry->desc);
+	site->entry = entry;
+	site->generation = entry->generation;
+
+	return entry->desc;
+}
+
+/*
+ * plmono_cache_site
+ *
+ *     Get call site of the function being called, bound by plmono_cache_get
+ */
+PLMonoCallSite*
+plmono_cache_site(FunctionCallInfo fcinfo)
+{
+	return (PLMonoCallSite*) fcinfo->flinfo->fn_extra;
+}
+
+/*
+ * plmono_cache_release
+ *
+ *     End a call of the function. Once no call is in progress, argument
+ *     conversions are released, and so is the descriptor if it has been
+ *     replaced meanwhile
+ */
+void
+plmono_cache_release(PLMonoFunction *desc)
+{
+	if (--desc->depth > 0)
+		return;
+
+	if (desc->orphaned)
+		MemoryContextDelete(desc->mcxt);
+	else
+		MemoryContextReset(desc->scratch);
+}
+
+/*
+ * plmono_cache_validate
+ *
+ *     Resolve function into the cache, which checks its method and types,
+ *     and compile its methods, so that neither is left to the first call
+ */
+void
+plmono_cache_validate(Oid fn_oid)
+{
+	PLMonoFunction *desc = plmono_cache_lookup(fn_oid);
+	MonoMethod *ctor;
+
+	if (desc->method)
+		mono_compile_method(desc->method);
+
+	if (desc->batch_method)
+		mono_compile_method(desc->batch_method);
+
+	if (desc->ctor)
+		mono_compile_method(desc->ctor);
+
+	if (!desc->is_static && (ctor = mono_class_get_method_from_name(desc->klass, ".ctor", 0)))
+		mono_compile_method(ctor);
+}
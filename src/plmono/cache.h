@@ -0,0 +1,118 @@
+#ifndef _PLMONO_CACHE_H
+#define _PLMONO_CACHE_H
+
+/*
+ * Part a function plays in a managed aggregate, told by where it takes or
+ * returns the internal type holding aggregate's state
+ */
+typedef enum PLMonoAggRole
+{
+	PLMONO_AGG_NONE,                 /* ordinary function */
+	PLMONO_AGG_TRANSITION,           /* (internal, ...) -> internal */
+	PLMONO_AGG_COMBINE,              /* (internal, internal) -> internal */
+	PLMONO_AGG_FINAL,                /* (internal, ...) -> result, also used
+	                                  * for serialization functions */
+	PLMONO_AGG_DESERIAL              /* (bytea, internal) -> internal */
+} PLMonoAggRole;
+
+/*
+ * Resolved form of a PL/Mono function, shared by all its call sites within
+ * the backend
+ */
+typedef struct PLMonoFunction
+{
+	Oid fn_oid;                      /* Oid of the function */
+	TransactionId fn_xmin;           /* xmin of pg_proc tuple it was built from */
+	ItemPointerData fn_tid;          /* tid of pg_proc tuple it was built from */
+	bool valid;                      /* false once pg_proc entry has changed */
+	bool orphaned;                   /* replaced by a newer descriptor, freed
+	                                  * once no call is in progress */
+	MemoryContext mcxt;              /* context holding this descriptor */
+
+	char *assembly;                  /* assembly file name */
+	char *sig;                       /* Namespace.Class signature */
+	char *method_name;               /* method name */
+
+	PLMonoAssembly *assembly_entry;  /* registry entry of the assembly */
+	int assembly_generation;         /* generation of the assembly it was
+	                                  * resolved against */
+	MonoImage *image;                /* image of the assembly */
+	MonoClass *klass;                /* class declaring the method */
+	MonoMethod *method;              /* method to invoke */
+	gpointer thunk;                  /* unmanaged thunk of the method, if any */
+	PLMonoThunkCaller thunk_caller;  /* caller of the thunk, if any */
+	MonoMethod *batch_method;        /* method taking arrays of arguments of
+	                                  * many rows, if any */
+	int batch_size;                  /* rows passed to it at once */
+
+	bool is_static;                  /* method is static */
+	int instance_scope;              /* PLMonoInstanceScope of the object
+	                                  * instance method is invoked on */
+	struct PLMonoInstance *instance; /* that object, once constructed */
+
+	bool is_trigger;                 /* declared as RETURNS trigger */
+	PLMonoAggRole agg_role;          /* part played in an aggregate, if any */
+	MonoMethod *ctor;                /* constructor of aggregate's state */
+	bool retset;                     /* declared as RETURNS SETOF */
+	bool strict;                     /* declared as STRICT */
+	Oid rettype;                     /* declared return type */
+	TypeFuncClass rettypeclass;      /* kind of result of the function */
+	TupleDesc rettupdesc;            /* descriptor of composite result, if any */
+
+	int argcount;                    /* number of arguments, including OUT ones */
+	Oid *argtypes;                   /* argument types */
+	char *argmodes;                  /* argument modes, or NULL if all are IN */
+	int nparams;                     /* number of method parameters */
+	int nouts;                       /* number of INOUT and OUT parameters */
+
+	PLMonoMarshal *argplan;          /* marshalling plans of arguments */
+	PLMonoMarshal retplan;           /* marshalling plan of return value */
+	PLMonoMarshal *colplan;          /* marshalling plans of result columns of
+	                                  * set-returning function */
+	MonoType **paramtypes;           /* Mono types of method parameters */
+
+	PLMonoValue *argbuf;             /* reusable slots of argument values */
+	gpointer *args;                  /* reusable argument vector */
+	Datum *outvals;                  /* reusable INOUT and OUT or result
+	                                  * column values */
+	bool *outnulls;                  /* reusable null flags of the above */
+	MemoryContext scratch;           /* argument conversions of calls in
+	                                  * progress, reset once none are */
+	GHashTable *plans;               /* prepared SPI plans, keyed by query
+	                                  * text and parameter types, shared by
+	                                  * all descriptors of the function */
+	int depth;                       /* number of calls in progress */
+} PLMonoFunction;
+
+/*
+ * Call site of a function, kept in fn_extra. It refers to the function's
+ * cache entry rather than to a descriptor, which may be replaced and freed
+ * while the call site lives on
+ */
+typedef struct PLMonoCallSite
+{
+	struct PLMonoFunctionEntry *entry;  /* cache entry of the function */
+	uint32 generation;                  /* generation of the descriptor
+	                                     * the call site is bound to */
+
+	/*
+     * Shape of the result at the call site. It is the declared one, unless
+     * the function returns record and the call site tells its columns
+     */
+	TypeFuncClass rettypeclass;         /* kind of result */
+	TupleDesc rettupdesc;               /* descriptor of composite result */
+	PLMonoMarshal *colplan;             /* plans of result columns of
+	                                     * set-returning function */
+	Datum *values;                      /* reusable result column values */
+	bool *nulls;                        /* and their null flags */
+	bool own_result;                    /* above are allocated by the call
+	                                     * site rather than the descriptor */
+} PLMonoCallSite;
+
+PLMonoFunction* plmono_cache_lookup(Oid fn_oid);
+PLMonoFunction* plmono_cache_get(FunctionCallInfo fcinfo);
+PLMonoCallSite* plmono_cache_site(FunctionCallInfo fcinfo);
+void plmono_cache_release(PLMonoFunction *desc);
+void plmono_cache_validate(Oid fn_oid);
+
+#endif
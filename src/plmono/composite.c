@@ -0,0 +1,394 @@
+/*-------------------------------------------------------------------------
+ *
+ * composite.c
+ *     composite values passed to and returned from managed classes
+ *
+ * Copyright (c) 2009, Olexandr Melnyk <me@omelnyk.net>
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/heapam.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/typcache.h"
+
+#include <mono/jit/jit.h>
+#include <mono/metadata/assembly.h>
+#include <mono/metadata/appdomain.h>
+#include <mono/metadata/attrdefs.h>
+#include <mono/metadata/object.h>
+
+#include "core.h"
+#include "marshal.h"
+#include "cache.h"
+#include "composite.h"
+
+/*
+ * Composite layouts, keyed by type, typmod and class
+ */
+static HTAB *composite_cache = NULL;
+
+static gpointer plmono_composite_to_arg(PLMonoMarshal *m, Datum val, bool isnull, PLMonoValue *slot);
+
+static MonoClass*
+plmono_composite_get_class(void)
+{
+	return mono_get_object_class();
+}
+
+/*
+ * Placeholder conversions of composite positions. The actual class is known
+ * only once the method is resolved, and values are converted by layouts
+ */
+const PLMonoTypeMarshal plmono_composite_marshal =
+	{RECORDOID, plmono_composite_get_class, true, PLMONO_KIND_NONE, NULL, NULL};
+
+/*
+ * plmono_composite_invalidate
+ *
+ *     Relcache callback marking layouts of changed row types as invalid
+ */
+static void
+plmono_composite_invalidate(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	PLMonoComposite *comp;
+
+	hash_seq_init(&status, composite_cache);
+	while ((comp = (PLMonoComposite*) hash_seq_search(&status)))
+		if (relid == InvalidOid || comp->typrelid == relid)
+			comp->valid = false;
+}
+
+/*
+ * plmono_composite_cache_init
+ *
+ *     Create composite layout cache and subscribe to relcache invalidations
+ */
+static void
+plmono_composite_cache_init(void)
+{
+	HASHCTL ctl;
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(PLMonoCompositeKey);
+	ctl.entrysize = sizeof(PLMonoComposite);
+	ctl.hash = tag_hash;
+	ctl.hcxt = TopMemoryContext;
+
+	composite_cache = hash_create("PL/Mono composite cache", 32, &ctl,
+								  HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	CacheRegisterRelcacheCallback(plmono_composite_invalidate, (Datum) 0);
+}
+
+/*
+ * plmono_composite_find_field
+ *
+ *     Find instance field of the class named after an attribute. Exact names
+ *     are preferred, but case is ignored otherwise, so that PascalCase fields
+ *     match unquoted SQL names
+ */
+static MonoClassField*
+plmono_composite_find_field(MonoClass *klass, const char *name)
+{
+	MonoClassField *field;
+	gpointer iter = NULL;
+
+	if ((field = mono_class_get_field_from_name(klass, name)) &&
+		!(mono_field_get_flags(field) & MONO_FIELD_ATTR_STATIC))
+		return field;
+
+	while ((field = mono_class_get_fields(klass, &iter)))
+		if (!(mono_field_get_flags(field) & MONO_FIELD_ATTR_STATIC) &&
+			g_ascii_strcasecmp(mono_field_get_name(field), name) == 0)
+			return field;
+
+	return NULL;
+}
+
+/*
+ * plmono_composite_maps
+ *
+ *     Check whether the class may take values of the composite type: it must
+ *     come from user's assemblies and have a field for at least one attribute.
+ *     Attributes of record arguments are not known until the call, so any
+ *     user's class is accepted for them
+ */
+bool
+plmono_composite_maps(Oid typeoid, MonoClass *klass)
+{
+	MonoImage *image = mono_class_get_image(klass);
+	TupleDesc tupdesc;
+	bool found = false;
+	int i;
+
+	if (image == mono_get_corlib() || image == plmono_get_plmono_image())
+		return false;
+
+	if (typeoid == RECORDOID)
+		return true;
+
+	tupdesc = lookup_rowtype_tupdesc(typeoid, -1);
+	for (i = 0; !found && i < tupdesc->natts; i++)
+		found = (!tupdesc->attrs[i]->attisdropped &&
+				 plmono_composite_find_field(klass, NameStr(tupdesc->attrs[i]->attname)));
+	ReleaseTupleDesc(tupdesc);
+
+	return found;
+}
+
+/*
+ * plmono_composite_get
+ *
+ *     Get layout mapping the composite type onto the class, building it on
+ *     first use or after the type has changed. Attributes without a field
+ *     of the same name are skipped, and left NULL in results
+ */
+PLMonoComposite*
+plmono_composite_get(Oid typeoid, int32 typmod, MonoClass *klass)
+{
+	PLMonoCompositeKey key;
+	PLMonoComposite *comp;
+	MemoryContext oldcxt;
+	TupleDesc tupdesc;
+	MonoClassField *field;
+	Form_pg_attribute attr;
+	bool found;
+	int i;
+
+	if (!composite_cache)
+		plmono_composite_cache_init();
+
+	/*
+     * Key is hashed as a whole, including padding
+     */
+	MemSet(&key, 0, sizeof(key));
+	key.typeoid = typeoid;
+	key.typmod = (typeoid == RECORDOID) ? typmod : -1;
+	key.klass = klass;
+
+	comp = (PLMonoComposite*) hash_search(composite_cache, &key, HASH_ENTER, &found);
+	if (found && comp->valid)
+		return comp;
+
+	if (found)
+		MemoryContextDelete(comp->mcxt);
+
+	comp->valid = false;
+	comp->typrelid = (typeoid == RECORDOID) ? InvalidOid : get_typ_typrelid(typeoid);
+	comp->mcxt = AllocSetContextCreate(TopMemoryContext,
+									   "PL/Mono composite",
+									   ALLOCSET_SMALL_MINSIZE,
+									   ALLOCSET_SMALL_INITSIZE,
+									   ALLOCSET_SMALL_MAXSIZE);
+	oldcxt = MemoryContextSwitchTo(comp->mcxt);
+
+	tupdesc = lookup_rowtype_tupdesc(typeoid, key.typmod);
+	comp->tupdesc = CreateTupleDescCopy(tupdesc);
+	ReleaseTupleDesc(tupdesc);
+	tupdesc = comp->tupdesc;
+
+	comp->fields = (MonoClassField**) palloc0((tupdesc->natts + 1) * sizeof(MonoClassField*));
+	comp->marshals = (const PLMonoTypeMarshal**) palloc0((tupdesc->natts + 1) * sizeof(PLMonoTypeMarshal*));
+	comp->values = (Datum*) palloc((tupdesc->natts + 1) * sizeof(Datum));
+	comp->nulls = (bool*) palloc((tupdesc->natts + 1) * sizeof(bool));
+
+	MemoryContextSwitchTo(oldcxt);
+
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		attr = tupdesc->attrs[i];
+		if (attr->attisdropped)
+			continue;
+
+		if (!(field = plmono_composite_find_field(klass, NameStr(attr->attname))))
+			continue;
+
+		comp->marshals[i] = plmono_marshal_lookup(attr->atttypid);
+		if (mono_class_from_mono_type(mono_field_get_type(field)) != comp->marshals[i]->get_class())
+			elog(ERROR, "Field %s of class %s doesn't match type %s of attribute %s",
+				 mono_field_get_name(field), mono_class_get_name(klass),
+				 format_type_be(attr->atttypid), NameStr(attr->attname));
+
+		comp->fields[i] = field;
+	}
+
+	comp->valid = true;
+
+	return comp;
+}
+
+/*
+ * plmono_composite_to_obj
+ *
+ *     Deform tuple into layout's slots at once and copy the attributes into
+ *     fields of a new object
+ */
+static MonoObject*
+plmono_composite_to_obj(PLMonoComposite *comp, HeapTuple tuple)
+{
+	MonoObject *obj;
+	PLMonoValue slot;
+	gpointer value;
+	int i;
+
+	obj = mono_object_new(plmono_get_domain(), comp->key.klass);
+	heap_deform_tuple(tuple, comp->tupdesc, comp->values, comp->nulls);
+
+	for (i = 0; i < comp->tupdesc->natts; i++)
+	{
+		if (!comp->fields[i])
+			continue;
+
+		if (comp->nulls[i])
+		{
+			if (!comp->marshals[i]->is_reference)
+				ereport(ERROR,
+						(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+						 errmsg("NULL cannot be assigned to field %s of type %s",
+								mono_field_get_name(comp->fields[i]),
+								mono_class_get_name(comp->marshals[i]->get_class()))));
+			continue;
+		}
+
+		/*
+         * Value types are copied from the slot, references from the pointer
+         * to them
+         */
+		value = comp->marshals[i]->to_obj(comp->values[i], &slot);
+		mono_field_set_value(obj, comp->fields[i], comp->marshals[i]->is_reference ? &value : value);
+	}
+
+	return obj;
+}
+
+/*
+ * plmono_composite_to_arg
+ *
+ *     Convert composite argument into an instance of parameter's class. Structs
+ *     are passed unboxed
+ */
+static gpointer
+plmono_composite_to_arg(PLMonoMarshal *m, Datum val, bool isnull, PLMonoValue *slot)
+{
+	HeapTupleHeader td;
+	HeapTupleData tuple;
+	PLMonoComposite *comp;
+	MonoObject *obj;
+
+	if (isnull)
+	{
+		if (mono_class_is_valuetype(m->klass))
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("NULL cannot be passed to parameter of type %s", mono_class_get_name(m->klass)),
+					 errhint("Declare %s as a class or the function as STRICT.", mono_class_get_name(m->klass))));
+		return NULL;
+	}
+
+	td = DatumGetHeapTupleHeader(val);
+	comp = plmono_composite_get(HeapTupleHeaderGetTypeId(td), HeapTupleHeaderGetTypMod(td), m->klass);
+
+	tuple.t_len = HeapTupleHeaderGetDatumLength(td);
+	ItemPointerSetInvalid(&(tuple.t_self));
+	tuple.t_tableOid = InvalidOid;
+	tuple.t_data = td;
+
+	obj = plmono_composite_to_obj(comp, &tuple);
+
+	return mono_class_is_valuetype(m->klass) ? mono_object_unbox(obj) : (gpointer) obj;
+}
+
+/*
+ * plmono_composite_init
+ *
+ *     Build marshalling plan of a composite argument. Its class is bound when
+ *     the method is resolved
+ */
+void
+plmono_composite_init(PLMonoMarshal *m, Oid typeoid, char argmode, int argno)
+{
+	if (argmode != PROARGMODE_IN && argmode != PROARGMODE_VARIADIC)
+		elog(ERROR, "Composite arguments can only be passed IN");
+
+	m->typeoid = typeoid;
+	m->typlen = -1;
+	m->typbyval = false;
+	m->klass = NULL;
+	m->type = NULL;
+	m->byref = false;
+	m->out = false;
+	m->value_offset = 0;
+	m->has_value_offset = 0;
+	m->argno = argno;
+	m->tm = &plmono_composite_marshal;
+	m->to_arg = plmono_composite_to_arg;
+	m->from_arg = NULL;
+	m->from_result = NULL;
+}
+
+/*
+ * plmono_composite_from_result
+ *
+ *     Form function's composite result from fields of the returned object.
+ *     Results declared as record take their descriptor from the call site
+ */
+Datum
+plmono_composite_from_result(FunctionCallInfo fcinfo, PLMonoFunction *desc, MonoObject *result)
+{
+	PLMonoCallSite *site = plmono_cache_site(fcinfo);
+	PLMonoComposite *comp;
+	TupleDesc tupdesc;
+	PLMonoValue slot;
+	int i;
+
+	if (!result)
+	{
+		fcinfo->isnull = true;
+		return (Datum) 0;
+	}
+
+	if (site->rettypeclass == TYPEFUNC_COMPOSITE)
+		tupdesc = site->rettupdesc;
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in context "
+						"that cannot accept type record")));
+
+	comp = plmono_composite_get(tupdesc->tdtypeid, tupdesc->tdtypmod, mono_object_get_class(result));
+
+	for (i = 0; i < comp->tupdesc->natts; i++)
+	{
+		comp->nulls[i] = true;
+		if (!comp->fields[i])
+			continue;
+
+		/*
+         * Value fields are copied into the slot, reference ones stored in it
+         */
+		mono_field_get_value(result, comp->fields[i], &slot);
+		if (comp->marshals[i]->is_reference)
+		{
+			if (!slot.p)
+				continue;
+			comp->values[i] = comp->marshals[i]->to_datum(slot.p);
+		}
+		else
+			comp->values[i] = comp->marshals[i]->to_datum(&slot);
+
+		comp->nulls[i] = false;
+	}
+
+	return HeapTupleGetDatum(heap_form_tuple(comp->tupdesc, comp->values, comp->nulls));
+}
@@ -0,0 +1,40 @@
+#ifndef _PLMONO_COMPOSITE_H
+#define _PLMONO_COMPOSITE_H
+
+/*
+ * Hash key of a composite layout. Layouts depend on both the row type and
+ * the managed class, since one type may be mapped to several classes
+ */
+typedef struct PLMonoCompositeKey
+{
+	Oid typeoid;                           /* composite type or RECORDOID */
+	int32 typmod;                          /* typmod of blessed record type */
+	MonoClass *klass;                      /* managed class or struct */
+} PLMonoCompositeKey;
+
+/*
+ * Mapping between attributes of a composite type and fields of a managed
+ * class, computed once and shared by all values of the type
+ */
+typedef struct PLMonoComposite
+{
+	PLMonoCompositeKey key;                /* hash key, must be first */
+	bool valid;                            /* false once the type has changed */
+	Oid typrelid;                          /* relation behind the type, if any */
+	MemoryContext mcxt;                    /* context holding the layout */
+	TupleDesc tupdesc;                     /* copy of the type's descriptor */
+	MonoClassField **fields;               /* field of each attribute, NULL for
+	                                        * dropped and unmapped ones */
+	const PLMonoTypeMarshal **marshals;    /* conversions of mapped attributes */
+	Datum *values;                         /* slots a value is deformed into */
+	bool *nulls;                           /* or formed from */
+} PLMonoComposite;
+
+extern const PLMonoTypeMarshal plmono_composite_marshal;
+
+bool plmono_composite_maps(Oid typeoid, MonoClass *klass);
+PLMonoComposite* plmono_composite_get(Oid typeoid, int32 typmod, MonoClass *klass);
+void plmono_composite_init(PLMonoMarshal *m, Oid typeoid, char argmode, int argno);
+Datum plmono_composite_from_result(FunctionCallInfo fcinfo, PLMonoFunction *desc, MonoObject *result);
+
+#endif
@@ -12,6 +12,7 @@
 #include "executor/spi.h"
 #include "commands/trigger.h"
 #include "fmgr.h"
+#include "miscadmin.h"
 #include "access/heapam.h"
 #include "utils/syscache.h"
 #include "utils/builtins.h"
@@ -23,9 +24,22 @@
 #include <mono/jit/jit.h>
 #include <mono/metadata/assembly.h>
 #include <mono/metadata/appdomain.h>
+#include <mono/metadata/reflection.h>
+#include <mono/metadata/tokentype.h>
+#include <mono/metadata/blob.h>
+#include <mono/metadata/image.h>
 
 #include "helpers.h"
 #include "core.h"
+#include "assembly.h"
+#include "marshal.h"
+#include "row.h"
+#include "trigger.h"
+#include "spi.h"
+#include "cache.h"
+#include "toast.h"
+#include "stats.h"
+#include "profile.h"
 
 /*
  * AppDomain of PL/Mono backend
@@ -38,9 +52,26 @@ static MonoDomain *domain = NULL;
 static MonoImage *plmono_image = NULL;
 
 /*
- * TODO: Remove this!
+ * Path of PLMono assembly (plmono.assembly_path)
  */
-static char *plmono_assembly = "/home/kynlem/Projects/PLMono/src/classes/PLMono/PLMono.dll";
+char *plmono_assembly_path = NULL;
+
+/*
+ * Comma-separated list of assemblies loaded on warm-up
+ * (plmono.preload_assemblies)
+ */
+char *plmono_preload_assemblies = NULL;
+
+/*
+ * Whether SQL methods of preloaded assemblies are compiled on warm-up
+ * (plmono.preload_jit)
+ */
+bool plmono_preload_jit = false;
+
+/*
+ * Version of Mono runtime to initialize (plmono.runtime_version)
+ */
+char *plmono_runtime_version = NULL;
 
 /*
  * plmono_get_domain
@@ -75,6 +106,108 @@ plmono_get_corlib_image(void)
 	return mono_get_corlib();
 }
 
+/*
+ * plmono_expand_path
+ *
+ *     Expand leading $libdir of a path into package library directory
+ */
+char*
+plmono_expand_path(const char *path)
+{
+	if (strncmp(path, "$libdir", 7) == 0)
+	{
+		char *expanded = palloc(strlen(pkglib_path) + strlen(path + 7) + 1);
+
+		strcpy(expanded, pkglib_path);
+		strcat(expanded, path + 7);
+		return expanded;
+	}
+
+	return pstrdup(path);
+}
+
+/*
+ * plmono_compile_sql_methods
+ *
+ *     Force JIT compilation of methods in the image that are marked with
+ *     SqlFunction or SqlTrigger attributes
+ */
+static void
+plmono_compile_sql_methods(MonoImage *image)
+{
+	MonoClass *attrs[2];
+	MonoClass *klass;
+	MonoMethod *method;
+	MonoCustomAttrInfo *cinfo;
+	gpointer method_iter;
+	int ntypes, i, j;
+
+	attrs[0] = plmono_class_from_name(plmono_image, "PLMono", "SqlFunction");
+	attrs[1] = plmono_class_from_name(plmono_image, "PLMono", "SqlTrigger");
+
+	/*
+     * Row 1 of TypeDef table is the <Module> pseudo-class
+     */
+	ntypes = mono_image_get_table_rows(image, MONO_TABLE_TYPEDEF);
+	for (i = 2; i <= ntypes; i++)
+	{
+		klass = mono_class_get(image, MONO_TOKEN_TYPE_DEF | i);
+		if (!klass)
+			continue;
+
+		method_iter = NULL;
+		while ((method = mono_class_get_methods(klass, &method_iter)))
+		{
+			if (!(cinfo = mono_custom_attrs_from_method(method)))
+				continue;
+
+			for (j = 0; j < 2; j++)
+				if (mono_custom_attrs_has_attr(cinfo, attrs[j]))
+				{
+					mono_compile_method(method);
+					break;
+				}
+
+			mono_custom_attrs_free(cinfo);
+		}
+	}
+}
+
+/*
+ * plmono_preload
+ *
+ *     Load assemblies listed in plmono.preload_assemblies
+ */
+static void
+plmono_preload(void)
+{
+	char *list, *item, *next;
+	MonoImage *image;
+
+	if (!plmono_preload_assemblies || !*plmono_preload_assemblies)
+		return;
+
+	list = pstrdup(plmono_preload_assemblies);
+	for (item = list; item; item = next)
+	{
+		if ((next = strchr(item, ',')))
+			*next++ = '\0';
+
+		while (*item == ' ')
+			item++;
+
+		if (!*item)
+			continue;
+
+		image = plmono_image_open(plmono_expand_path(item));
+
+		if (plmono_preload_jit)
+			plmono_compile_sql_methods(image);
+	}
+
+	pfree(list);
+}
+
 /*
  * plmono_warm_up
  *
@@ -85,32 +218,74 @@ void
 plmono_warm_up(void)
 {
 	if (!domain)
-		domain = mono_jit_init_version("plmono", "v2.0.50727");
+	{
+		plmono_profile_install();
+		domain = mono_jit_init_version("plmono", plmono_runtime_version);
 
-	if (!domain)
-		elog(ERROR, "Cannot initialize Mono JIT");
+		if (!domain)
+			elog(ERROR, "Cannot initialize Mono JIT");
+
+		plmono_row_register_icalls();
+		plmono_trigger_register_icalls();
+		plmono_spi_register_icalls();
+		plmono_toast_register_icalls();
+	}
 
 	if (!plmono_image)
-		plmono_image = plmono_image_open(plmono_assembly);
+	{
+		plmono_image = plmono_image_open(plmono_expand_path(plmono_assembly_path));
+		plmono_preload();
+	}
 }
 
 /*
- * plmono_image_open
+ * plmono_report_exception
  *
- *     Try to load specified assembly and get its image, or report error on
- *     failure
+ *     Report unhandled managed exception as an error
  */
-MonoImage*
-plmono_image_open(const char *filename)
+void
+plmono_report_exception(MonoObject *exc)
+{
+	MonoString *str;
+	char *utf8, *detail;
+
+	plmono_stat_exception();
+
+	str = mono_object_to_string(exc, NULL);
+	utf8 = mono_string_to_utf8(str);
+	detail = pstrdup(utf8);
+	g_free(utf8);
+
+	ereport(ERROR,
+			(errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+			 errmsg("Unhandled exception %s.%s in PL/Mono function",
+					mono_class_get_namespace(mono_object_get_class(exc)),
+					mono_class_get_name(mono_object_get_class(exc))),
+			 errdetail("%s", detail)));
+}
+
+/*
+ * plmono_intern_string
+ *
+ *     Get managed string with specified contents, creating it only once per
+ *     backend. Returned strings are shared and must not be modified
+ */
+MonoString*
+plmono_intern_string(const char *str)
 {
-	MonoAssembly *assembly;
-	MonoImageOpenStatus status;
+	static GHashTable *strings = NULL;
+	gpointer handle;
 
-	assembly = mono_assembly_open(filename, &status);
-	if (!assembly)
-   		elog(ERROR, "Assembly %s not found", filename);
+	if (!strings)
+		strings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 
-	return mono_assembly_get_image(assembly);
+	if (!(handle = g_hash_table_lookup(strings, str)))
+	{
+		handle = GUINT_TO_POINTER(mono_gchandle_new((MonoObject*) mono_string_new(domain, str), FALSE));
+		g_hash_table_insert(strings, g_strdup(str), handle);
+	}
+
+	return (MonoString*) mono_gchandle_get_target(GPOINTER_TO_UINT(handle));
 }
 
 /*
@@ -209,22 +384,35 @@ plmono_parse_function_body(char *body, char **passembly, char **psig, char **pme
 }
 
 /*
- * plmono_lookup_pg_function
+ * plmono_search_pg_function
  *
- *     Get information about function by its Oid
+ *     Get pg_proc tuple of function by its Oid, or report error if there is no
+ *     such function. Returned tuple must be released with ReleaseSysCache
  */
-void
-plmono_lookup_pg_function(Oid fn_oid, Form_pg_proc *p_procStruct, char **psource, Oid **p_argtypes, char ***p_argnames, char **p_argmodes, int *p_argcount)
+HeapTuple
+plmono_search_pg_function(Oid fn_oid)
 {
 	HeapTuple procTup;
-	Datum sourceDatum;
-	bool isnull;
-	int nargs;
 
 	procTup = SearchSysCache(PROCOID, ObjectIdGetDatum(fn_oid), 0, 0, 0);
 	if (!HeapTupleIsValid(procTup))
 		elog(ERROR, "Cache lookup failed for function %u", fn_oid);
 
+	return procTup;
+}
+
+/*
+ * plmono_lookup_pg_function
+ *
+ *     Get information about function from its pg_proc tuple
+ */
+void
+plmono_lookup_pg_function(HeapTuple procTup, char **psource, Oid **p_argtypes, char ***p_argnames, char **p_argmodes, int *p_argcount)
+{
+	Datum sourceDatum;
+	bool isnull;
+	int nargs;
+
 	if (!p_argtypes)
 		if (!(p_argtypes = palloc(sizeof(Oid**))))
 			elog(ERROR, "Not enough memory");
@@ -237,9 +425,6 @@ plmono_lookup_pg_function(Oid fn_oid, Form_pg_proc *p_procStruct, char **psource
 		if (!(p_argmodes = palloc(sizeof(char**))))
 			elog(ERROR, "Not enough memory");
 
-	if (p_procStruct)
-		*p_procStruct = (Form_pg_proc) GETSTRUCT(procTup);
-
 	nargs = get_func_arg_info(procTup, p_argtypes, p_argnames, p_argmodes);
 
 	if(p_argcount)
@@ -250,8 +435,6 @@ plmono_lookup_pg_function(Oid fn_oid, Form_pg_proc *p_procStruct, char **psource
 		elog(ERROR, "'AS' clause of Mono function cannot be NULL'");
 
 	*psource = pstrdup(DatumGetCString(DirectFunctionCall1(textout, sourceDatum)));
-	
-  	ReleaseSysCache(procTup);
 }
 
 /*
@@ -262,50 +445,13 @@ plmono_lookup_pg_function(Oid fn_oid, Form_pg_proc *p_procStruct, char **psource
 void*
 plmono_datum_to_obj(Datum val, Oid typeoid)
 {
-	void *obj = NULL;
+	const PLMonoTypeMarshal *tm = plmono_marshal_lookup(typeoid);
+	PLMonoValue *slot;
 
-	switch (typeoid)
-	{
-		case BOOLOID:
-			obj = (int32*) palloc(sizeof(int32));
-			*((int32*) obj) = DatumGetBool(val);
-			break;
-
-		case INT2OID:
-			obj = (int16*) palloc(sizeof(int16));
-			*((int16*) obj) = DatumGetInt16(val);
-			break;
-
-		case INT4OID:
-			obj = (int32*) palloc(sizeof(int32));
-			*((int32*) obj) = DatumGetInt32(val);
-			break;
-
-		case INT8OID:
-			obj = (int64*) palloc(sizeof(int64));
-			*((int64*) obj) = DatumGetInt64(val);
-			break;
-
-		case FLOAT4OID:
-			obj = (float4*) palloc(sizeof(float4));
-			*((float4*) obj) = DatumGetFloat4(val);
-			break;
-
-		case FLOAT8OID:
-			obj = (float8*) palloc(sizeof(float8));
-			*((float8*) obj) = DatumGetFloat8(val);
-			break;
-
-		case TEXTOID:
-			obj = (MonoString*) palloc(sizeof(MonoString));
-			obj = mono_string_new(domain, TextDatumGetCString(val));
-			break;
-
-		default:
-			elog(ERROR, "Data type with OID %d is not supported by PL/Mono", typeoid);
-	}
+	if (!(slot = (PLMonoValue*) palloc(sizeof(PLMonoValue))))
+		elog(ERROR, "Not enough memory");
 
-	return obj;
+	return tm->to_obj(val, slot);
 }
 
 /*
@@ -316,43 +462,7 @@ plmono_datum_to_obj(Datum val, Oid typeoid)
 Datum
 plmono_obj_to_datum(void *obj, Oid typeoid)
 {
-	Datum val = Int32GetDatum(0);
-
-	switch (typeoid)
-	{
-		case BOOLOID:
-			val = BoolGetDatum(*((int32*) obj));
-			break;
-
-		case INT2OID:
-			val = Int16GetDatum(*((int16*) obj));
-			break;
-
-		case INT4OID:
-			val = Int32GetDatum(*((int32*) obj));
-			break;
-
-		case INT8OID:
-			val = Int64GetDatum(*((int64*) obj));
-			break;
-
-		case FLOAT4OID:
-			val = Float4GetDatum(*((float4*) obj));
-			break;
-
-		case FLOAT8OID:
-			val = Float8GetDatum(*((float8*) obj));
-			break;
-
-		case TEXTOID:
-			val = CStringGetTextDatum(mono_string_to_utf8((MonoString*) obj));
-			break;
-
-		default:
-			elog(ERROR, "Data type with OID %d is not supported by PL/Mono", typeoid);
-	}
-
-	return val;
+	return plmono_marshal_lookup(typeoid)->to_datum(obj);
 }
 
 /*
@@ -363,42 +473,5 @@ plmono_obj_to_datum(void *obj, Oid typeoid)
 MonoClass*
 plmono_typeoid_to_class(Oid typeoid)
 {
-	MonoClass *klass = NULL;
-
-	switch (typeoid)
-	{
-		case BOOLOID:
-			klass = mono_get_boolean_class();
-			break;
-
-		case INT2OID:
-			klass = mono_get_int16_class();
-			break;
-
-		case INT4OID:
-			klass = mono_get_int32_class();
-			break;
-
-		case INT8OID:
-			klass = mono_get_int64_class();
-			break;
-
-		case FLOAT4OID:
-			klass = mono_get_single_class();
-			break;
-
-		case FLOAT8OID:
-			klass = mono_get_double_class();
-			break;
-
-		case TEXTOID:
-			klass = mono_get_string_class();
-			break;
-
-		default:
-			elog(ERROR, "Data type with OID %d is not supported by PL/Mono", typeoid);
-	}
-
-	return klass;
+	return plmono_marshal_lookup(typeoid)->get_class();
 }
-
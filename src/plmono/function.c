@@ -26,62 +26,59 @@
 
 #include "helpers.h"
 #include "core.h"
+#include "assembly.h"
+#include "marshal.h"
+#include "cache.h"
+#include "thunk.h"
+#include "srf.h"
+#include "spi.h"
+#include "agg.h"
+#include "batch.h"
+#include "instance.h"
+#include "stats.h"
+#include "profile.h"
 #include "function.h"
 
-/*
- * plmono_func_build_param_types
- *
- *     Build an array of function argument classes 
- */
-MonoType**
-plmono_func_build_param_types(FunctionCallInfo fcinfo, Oid *argtypes, char *argmodes, int argcount)
-{
-	MonoType** params;
-	int i;
-
-	params = (MonoType**) palloc(fcinfo->nargs * sizeof(MonoType*));
-	for (i = 0; i < argcount; i++)
-	{
-		MonoClass *klass = plmono_typeoid_to_class(argtypes[i]);
-		if (argmodes == NULL || argmodes[i] == PROARGMODE_IN)
-			params[i] = mono_class_get_type(klass);
-		else /* PROARGMODE_INOUT or PROARGMODE_OUT */
-			params[i] = mono_class_get_byref_type(klass);
-	}
-
-	return params;
-}
-
 /*
  * plmono_func_build_args
  *
- *     Convert function arguments into a form suitable for calling a Mono method
+ *     Convert function arguments into a form suitable for calling a Mono method.
+ *     Detoasted copies and other temporaries go to function's scratch context
  */
-void
-plmono_func_build_args(FunctionCallInfo fcinfo, Oid *argtypes, char *argmodes, int nparams, gpointer **pparams)
+gpointer*
+plmono_func_build_args(FunctionCallInfo fcinfo, PLMonoFunction *desc)
 {
-	void **p;
+	PLMonoValue *argbuf = desc->argbuf;
+	gpointer *args = desc->args;
+	PLMonoMarshal *m = desc->argplan;
+	MemoryContext oldcxt;
 	int i;
 
-	if (!(*pparams = palloc(nparams * sizeof(gpointer))))
-		elog(ERROR, "Not enough memory");
+	plmono_stat_phase(PLMONO_PHASE_ARGS);
+	plmono_stat_args(desc, fcinfo);
 
-	for (i = 0; i < nparams; i++)
+	oldcxt = MemoryContextSwitchTo(desc->scratch);
+
+	/*
+     * Nested call of the same function must not overwrite buffers which
+     * outer call's ref parameters point to
+     */
+	if (desc->depth > 1)
 	{
-		(*pparams)[i] = plmono_datum_to_obj(fcinfo->arg[i], argtypes[i]);
+		if (!(argbuf = palloc((desc->nparams + 1) * sizeof(PLMonoValue))))
+			elog(ERROR, "Not enough memory");
 
-		if (argmodes == NULL)
-			continue;
+		if (!(args = palloc((desc->nparams + 1) * sizeof(gpointer))))
+			elog(ERROR, "Not enough memory");
+	}
 
-		if ((argmodes[i] != PROARGMODE_IN) && (argtypes[i] == TEXTOID))
-		{
-			if (!(p = palloc(sizeof(void*))))
-				elog(ERROR, "Not enough memory");
+	for (i = 0; i < desc->nparams; i++, m++)
+		args[i] = m->to_arg(m, fcinfo->arg[m->argno], fcinfo->argnull[m->argno], &argbuf[i]);
 
-			*p = (*pparams)[i];
-			(*pparams)[i] = p;
-		}
-	}
+	MemoryContextSwitchTo(oldcxt);
+	plmono_stat_phase(PLMONO_PHASE_MANAGED);
+
+	return args;
 }
 
 /*
@@ -92,40 +89,36 @@ plmono_func_build_args(FunctionCallInfo fcinfo, Oid *argtypes, char *argmodes, i
  *     INOUT and OUT arguments will be grouped in a tuple
  */
 Datum
-plmono_func_build_out_args(FunctionCallInfo fcinfo, TupleDesc resultTupleDesc, Oid *argtypes, char *argmodes, int argcount, gpointer *params)
+plmono_func_build_out_args(FunctionCallInfo fcinfo, PLMonoFunction *desc, gpointer *args)
 {
+	PLMonoMarshal *m = desc->argplan;
+	Datum *retvals = desc->outvals;
+	bool *nulls = desc->outnulls;
 	HeapTuple rettuple;
-	Datum *retvals;
-	bool *nulls;
 	int nretvals, i;
-	void *p;
-
-	if (!(retvals = palloc(resultTupleDesc->natts * sizeof(Datum))))
-		elog(ERROR, "Not enough memory");
-
-	if (!(nulls = palloc(resultTupleDesc->natts * sizeof(bool))))
-		elog(ERROR, "Not enough memory");
 
 	nretvals = 0;
-	for (i = 0; i < argcount; i++)
+	for (i = 0; i < desc->nparams; i++, m++)
 	{
-		if (argmodes[i] != PROARGMODE_IN)
+		if (m->byref)
 		{
-			if (argtypes[i] != TEXTOID)
-				p = params[i];
-			else
-				p = *((void**) params[i]);
-
-			retvals[nretvals] = plmono_obj_to_datum(p, argtypes[i]);
-			nulls[nretvals] = 0;
+			/*
+             * Reference type parameters may have been set to null
+             */
+			nulls[nretvals] = m->tm->is_reference && ((PLMonoValue*) args[i])->p == NULL;
+			if (!nulls[nretvals])
+				retvals[nretvals] = m->from_arg(m, (PLMonoValue*) args[i]);
 			nretvals++;
 		}
 	}
 	
 	if (nretvals == 1)
-		return retvals[0];
+	{
+		fcinfo->isnull = nulls[0];
+		return nulls[0] ? (Datum) 0 : retvals[0];
+	}
 
-	rettuple = heap_form_tuple(resultTupleDesc, retvals, nulls);
+	rettuple = heap_form_tuple(desc->rettupdesc, retvals, nulls);
 	return HeapTupleGetDatum(rettuple);
 }
 
@@ -137,20 +130,33 @@ plmono_func_build_out_args(FunctionCallInfo fcinfo, TupleDesc resultTupleDesc, O
  *     set to function's return value.  
  */
 Datum
-plmono_func_build_result(FunctionCallInfo fcinfo, Form_pg_proc procStruct, Oid *argtypes, char *argmodes, int argcount, gpointer *params, MonoObject *result)
+plmono_func_build_result(FunctionCallInfo fcinfo, PLMonoFunction *desc, gpointer *args, MonoObject *result)
 {
-	TupleDesc resultTupleDesc;
-	TypeFuncClass call_res_type = get_call_result_type(fcinfo, NULL, &resultTupleDesc);
-
-	if (argmodes == NULL)
+	if (desc->nouts == 0)
 	{
-		if (call_res_type == TYPEFUNC_SCALAR)
-			return plmono_obj_to_datum(mono_object_unbox(result), procStruct->prorettype);
-		else
+		/*
+         * Composite results are formed from fields of the returned object
+         */
+		if (desc->rettypeclass == TYPEFUNC_COMPOSITE || desc->rettypeclass == TYPEFUNC_RECORD)
+			return plmono_composite_from_result(fcinfo, desc, result);
+
+		if (desc->rettypeclass != TYPEFUNC_SCALAR)
 			elog(ERROR, "Multiple values can be returned only using OUT arguments");
+
+		/*
+         * Null references and empty Nullable<T> values, which are boxed as
+         * null, are returned as NULL
+         */
+		if (!result && desc->rettype != VOIDOID)
+		{
+			fcinfo->isnull = true;
+			return (Datum) 0;
+		}
+
+		return desc->retplan.from_result(&desc->retplan, result);
 	}
 
-	return plmono_func_build_out_args(fcinfo, resultTupleDesc, argtypes, argmodes, argcount, params);
+	return plmono_func_build_out_args(fcinfo, desc, args);
 }
 
 /*
@@ -161,50 +167,99 @@ plmono_func_build_result(FunctionCallInfo fcinfo, Form_pg_proc procStruct, Oid *
 Datum
 plmono_func_handler(PG_FUNCTION_ARGS)
 {
-	MonoImage *image;
-	MonoMethod *method;
-	MonoObject *result;
-	MonoType **paramtypes;
-	Form_pg_proc procStruct;
-	MonoClass *klass;
-	char *assembly, *method_name, *sig;
-
-	Oid *argtypes;
-	char **argnames;
-	char *argmodes;
-	int argcount;
-	
+	PLMonoFunction *desc;
+	MonoObject *result, *exc = NULL;
 	gpointer *args;
-	char *source;
+	PLMonoSpiFrame frame;
+	PLMonoStatCall stat;
+	PLMonoProfileNode *prof;
+	Datum retval;
 
 	/*
-     * Get characteristics of called function and parse its body
+     * Get resolved function from cache
      */
-	plmono_lookup_pg_function(fcinfo->flinfo->fn_oid, &procStruct, &source, 
-	    &argtypes, &argnames, &argmodes, &argcount);
-	plmono_parse_function_body(source, &assembly, &sig, &method_name);
+	plmono_stat_start(&stat);
+	desc = plmono_cache_get(fcinfo);
 
 	/*
-     * Find corresponding Mono method
+     * Queries run by managed code are attributed to this call
      */
-	paramtypes = plmono_func_build_param_types(fcinfo, argtypes, argmodes, argcount);
-	image = plmono_image_open(assembly);
-	klass = plmono_class_find(image, sig);
-	method = plmono_method_find(klass, method_name, paramtypes, argcount);
+	plmono_spi_push(&frame, desc);
 
-	/*
-     * Prepare arguments for method invokation
-     */
-	plmono_func_build_args(fcinfo, argtypes, argmodes, argcount, &args);
+	desc->depth++;
+	plmono_stat_begin(&stat, desc);
+	prof = plmono_profile_push(desc->fn_oid);
+	PG_TRY();
+	{
+		plmono_stat_phase(PLMONO_PHASE_MANAGED);
 
-	/*
-     * Invoke method
-     */
-	result = mono_runtime_invoke(method, NULL, args, NULL);
+		if (desc->retset)
+		{
+			/*
+             * Set-returning functions enumerate method's result
+             */
+			retval = plmono_srf_handler(fcinfo, desc);
+		}
+		else if (desc->agg_role != PLMONO_AGG_NONE)
+		{
+			/*
+             * Aggregate support functions operate on managed state
+             */
+			retval = plmono_agg_handler(fcinfo, desc);
+		}
+		else if (!desc->method)
+		{
+			/*
+             * Functions having only a batch method pass it a single row
+             */
+			retval = plmono_batch_call(fcinfo, desc);
+		}
+		else if (desc->thunk_caller)
+		{
+			/*
+             * Scalar methods are called through their unmanaged thunks
+             */
+			retval = plmono_thunk_invoke(fcinfo, desc);
+		}
+		else
+		{
+			/*
+             * Prepare arguments and invoke method
+             */
+			args = plmono_func_build_args(fcinfo, desc);
+
+			result = mono_runtime_invoke(desc->method, plmono_instance_get(desc), args, &exc);
+			if (exc)
+				plmono_report_exception(exc);
+
+			/*
+             * Return method's return value or arguments passed by reference
+             */
+			plmono_stat_phase(PLMONO_PHASE_RESULT);
+			retval = plmono_func_build_result(fcinfo, desc, args, result);
+		}
+
+		if (!desc->retset)
+			plmono_stat_result(desc, retval, fcinfo->isnull);
+	}
+	PG_CATCH();
+	{
+		plmono_profile_pop(prof);
+		plmono_stat_end(&stat);
+		plmono_cache_release(desc);
+		plmono_spi_pop(&frame, true);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	plmono_profile_pop(prof);
+	plmono_stat_end(&stat);
 
 	/*
-     * Return method's return value or arguments passed by reference
+     * Managed objects hold their own copies of the arguments, so temporaries
+     * go away with the outermost call rather than with the query
      */
-	return plmono_func_build_result(fcinfo, procStruct, argtypes, argmodes, argcount, args, result);
-}
+	plmono_cache_release(desc);
+	plmono_spi_pop(&frame, false);
 
+	return retval;
+}
@@ -35,48 +35,116 @@ mono_class_find(MonoImage *image, char *sig)
 }
 
 /*
- * mono_method_find
+ * Method indexes of classes, built on first lookup: MonoClass* -> GHashTable
+ * mapping method keys to MonoMethod*
+ */
+static GHashTable *method_indexes = NULL;
+
+/*
+ * mono_method_key_append_param
  *
- *     Get method by its name and argument types
+ *     Append parameter type to method key
  */
-MonoMethod*
-mono_method_find(MonoClass *klass, char *name, MonoType **params, int nparams)
+static void
+mono_method_key_append_param(GString *key, MonoType *type)
+{
+	g_string_append_printf(key, "%p%s,", (void*) mono_class_from_mono_type(type),
+	    mono_type_is_byref(type) ? "&" : "");
+}
+
+/*
+ * mono_method_key
+ *
+ *     Build key identifying method by its name, arity and parameter classes
+ */
+static gchar*
+mono_method_key(const char *name, MonoType **params, int nparams)
 {
-	MonoMethod *method = NULL;
+	GString *key = g_string_new(name);
+	int i;
+
+	g_string_append_printf(key, "/%d/", nparams);
+	for (i = 0; i < nparams; i++)
+		mono_method_key_append_param(key, params[i]);
+
+	return g_string_free(key, FALSE);
+}
+
+/*
+ * mono_method_key_from_signature
+ *
+ *     Build key of an existing method
+ */
+static gchar*
+mono_method_key_from_signature(MonoMethod *method)
+{
+	MonoMethodSignature *sig = mono_method_signature(method);
+	GString *key = g_string_new(mono_method_get_name(method));
 	MonoType *param_type;
-	MonoMethodSignature *sig;
-	gpointer method_iter = NULL;
 	gpointer param_iter = NULL;
-	int i;
 
+	g_string_append_printf(key, "/%d/", mono_signature_get_param_count(sig));
+	while ((param_type = mono_signature_get_params(sig, &param_iter)))
+		mono_method_key_append_param(key, param_type);
+
+	return g_string_free(key, FALSE);
+}
+
+/*
+ * mono_class_get_method_index
+ *
+ *     Get method index of class, building it on first use
+ */
+static GHashTable*
+mono_class_get_method_index(MonoClass *klass)
+{
+	GHashTable *index;
+	MonoMethod *method;
+	gpointer method_iter = NULL;
+	gchar *key;
+
+	if (!method_indexes)
+		method_indexes = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	if ((index = g_hash_table_lookup(method_indexes, klass)))
+		return index;
+
+	index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 	while ((method = mono_class_get_methods(klass, &method_iter)))
 	{
-		if (strcmp(mono_method_get_name(method), name))
-			continue;
-
-		sig = mono_method_signature(method);
-
-		if (mono_signature_get_param_count(sig) != nparams)
-			continue;
-
-		i = 0;
-		while ((param_type = mono_signature_get_params(sig, &param_iter)))
-		{
-			if (mono_class_from_mono_type(param_type) != mono_class_from_mono_type(params[i]))
-				break;
-
-			if (mono_type_is_byref(param_type) != mono_type_is_byref(params[i]))
-				break;
-
-			i++;
-		}
-		
-		if (i == nparams)
-		{
-			return method;
-		}
+		key = mono_method_key_from_signature(method);
+
+		if (g_hash_table_lookup(index, key))
+			g_free(key);
+		else
+			g_hash_table_insert(index, key, method);
 	}
 
-	return NULL;
+	g_hash_table_insert(method_indexes, klass, index);
+
+	return index;
 }
 
+/*
+ * mono_method_find
+ *
+ *     Get method by its name and argument types. Types not known yet, such
+ *     as those of composite arguments before matching, find nothing
+ */
+MonoMethod*
+mono_method_find(MonoClass *klass, char *name, MonoType **params, int nparams)
+{
+	MonoMethod *method;
+	gchar *key;
+	int i;
+
+	for (i = 0; i < nparams; i++)
+		if (!params[i])
+			return NULL;
+
+	key = mono_method_key(name, params, nparams);
+	method = g_hash_table_lookup(mono_class_get_method_index(klass), key);
+	g_free(key);
+
+	return method;
+}
@@ -0,0 +1,295 @@
+/*-------------------------------------------------------------------------
+ *
+ * instance.c
+ *     objects instance methods are invoked on, and their lifecycle hooks
+ *
+ * Copyright (c) 2009, Olexandr Melnyk <me@omelnyk.net>
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/xact.h"
+#include "storage/ipc.h"
+#include "utils/guc.h"
+
+#include <mono/jit/jit.h>
+#include <mono/metadata/assembly.h>
+#include <mono/metadata/appdomain.h>
+#include <mono/metadata/object.h>
+#include <mono/metadata/tabledefs.h>
+
+#include "core.h"
+#include "assembly.h"
+#include "marshal.h"
+#include "cache.h"
+#include "instance.h"
+
+/*
+ * Lifetime of objects instance methods are invoked on
+ * (plmono.instance_scope)
+ */
+int plmono_instance_scope = PLMONO_INSTANCE_BACKEND;
+
+const struct config_enum_entry plmono_instance_scope_options[] = {
+	{"backend", PLMONO_INSTANCE_BACKEND, false},
+	{"function", PLMONO_INSTANCE_FUNCTION, false},
+	{NULL, 0, false}
+};
+
+/*
+ * Objects of backend scope, keyed by class
+ */
+static GHashTable *backend_instances = NULL;
+
+/*
+ * All live objects of either scope, told about transaction end and backend
+ * exit
+ */
+static GPtrArray *all_instances = NULL;
+
+/*
+ * plmono_instance_warn
+ *
+ *     Report exception thrown by a lifecycle hook. Hooks run when the
+ *     transaction can no longer fail, so exceptions are only logged
+ */
+static void
+plmono_instance_warn(PLMonoInstance *inst, MonoObject *exc)
+{
+	char *utf8;
+
+	utf8 = mono_string_to_utf8(mono_object_to_string(exc, NULL));
+	ereport(WARNING,
+			(errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+			 errmsg("Unhandled exception %s.%s in lifecycle hook of %s",
+					mono_class_get_namespace(mono_object_get_class(exc)),
+					mono_class_get_name(mono_object_get_class(exc)),
+					mono_class_get_name(inst->klass)),
+			 errdetail("%s", utf8)));
+	g_free(utf8);
+}
+
+/*
+ * plmono_instance_hook
+ *
+ *     Invoke lifecycle hook of the object, if it implements one. Hooks run
+ *     outside of any PL/Mono call, so SPI is not available to them; an error
+ *     raised while the hook runs is reported as a warning, as the transaction
+ *     is already committed or aborted
+ */
+static void
+plmono_instance_hook(PLMonoInstance *inst, MonoMethod *method, gpointer *args)
+{
+	MemoryContext oldcxt = CurrentMemoryContext;
+	MonoObject *exc = NULL;
+
+	if (!method)
+		return;
+
+	PG_TRY();
+	{
+		mono_runtime_invoke(method, mono_gchandle_get_target(inst->handle), args, &exc);
+		if (exc)
+			plmono_instance_warn(inst, exc);
+	}
+	PG_CATCH();
+	{
+		ErrorData *edata;
+
+		MemoryContextSwitchTo(oldcxt);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		ereport(WARNING,
+				(errcode(edata->sqlerrcode),
+				 errmsg("Error in lifecycle hook of %s: %s",
+						mono_class_get_name(inst->klass), edata->message)));
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+}
+
+/*
+ * plmono_instance_xact_callback
+ *
+ *     Tell objects that the transaction has ended
+ */
+static void
+plmono_instance_xact_callback(XactEvent event, void *arg)
+{
+	MonoBoolean committed;
+	gpointer args[1];
+	guint i;
+
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_ABORT)
+		return;
+
+	committed = (event == XACT_EVENT_COMMIT);
+	args[0] = &committed;
+
+	for (i = 0; i < all_instances->len; i++)
+	{
+		PLMonoInstance *inst = (PLMonoInstance*) g_ptr_array_index(all_instances, i);
+
+		plmono_instance_hook(inst, inst->xact_end, args);
+	}
+}
+
+/*
+ * plmono_instance_exit
+ *
+ *     Dispose objects when the backend exits
+ */
+static void
+plmono_instance_exit(int code, Datum arg)
+{
+	guint i;
+
+	for (i = 0; i < all_instances->len; i++)
+	{
+		PLMonoInstance *inst = (PLMonoInstance*) g_ptr_array_index(all_instances, i);
+
+		plmono_instance_hook(inst, inst->dispose, NULL);
+	}
+}
+
+/*
+ * plmono_instance_interface_method
+ *
+ *     Get implementation of interface method by the object, or NULL if its
+ *     class doesn't implement the interface
+ */
+static MonoMethod*
+plmono_instance_interface_method(MonoObject *obj, MonoImage *image, const char *namespace,
+								 const char *name, const char *method, int nparams)
+{
+	MonoClass *iface = plmono_class_from_name(image, namespace, name);
+
+	if (!mono_class_is_assignable_from(iface, mono_object_get_class(obj)))
+		return NULL;
+
+	return mono_object_get_virtual_method(obj, mono_class_get_method_from_name(iface, method, nparams));
+}
+
+/*
+ * plmono_instance_new
+ *
+ *     Construct object of the class and look up its lifecycle hooks
+ */
+static PLMonoInstance*
+plmono_instance_new(MonoClass *klass)
+{
+	PLMonoInstance *inst;
+	MonoObject *obj, *exc = NULL;
+
+	obj = mono_object_new(plmono_get_domain(), klass);
+	mono_runtime_invoke(mono_class_get_method_from_name(klass, ".ctor", 0), obj, NULL, &exc);
+	if (exc)
+		plmono_report_exception(exc);
+
+	if (!all_instances)
+	{
+		all_instances = g_ptr_array_new();
+		RegisterXactCallback(plmono_instance_xact_callback, NULL);
+		on_proc_exit(plmono_instance_exit, (Datum) 0);
+	}
+
+	inst = g_new0(PLMonoInstance, 1);
+	inst->klass = klass;
+	inst->handle = mono_gchandle_new(obj, FALSE);
+	inst->xact_end = plmono_instance_interface_method(obj, plmono_get_plmono_image(),
+													  "PLMono", "ITransactionCallback",
+													  "OnTransactionEnd", 1);
+	inst->dispose = plmono_instance_interface_method(obj, plmono_get_corlib_image(),
+													 "System", "IDisposable", "Dispose", 0);
+	g_ptr_array_add(all_instances, inst);
+
+	return inst;
+}
+
+/*
+ * plmono_instance_resolve
+ *
+ *     Check that class of instance method can be constructed. The object
+ *     itself is created on first call, in the scope configured at the time
+ *     the function is resolved
+ */
+void
+plmono_instance_resolve(PLMonoFunction *desc)
+{
+	desc->instance = NULL;
+	desc->instance_scope = plmono_instance_scope;
+	desc->is_static = !desc->method || desc->agg_role != PLMONO_AGG_NONE ||
+		(mono_method_get_flags(desc->method, NULL) & METHOD_ATTRIBUTE_STATIC) != 0;
+
+	if (desc->is_static)
+		return;
+
+	if (mono_class_is_valuetype(desc->klass))
+		elog(ERROR, "Class %s declaring instance method %s must be a reference type",
+			 desc->sig, desc->method_name);
+
+	if (!mono_class_get_method_from_name(desc->klass, ".ctor", 0))
+		elog(ERROR, "Class %s declaring instance method %s has no default constructor",
+			 desc->sig, desc->method_name);
+}
+
+/*
+ * plmono_instance_get
+ *
+ *     Get object function's method is invoked on, constructing it on first
+ *     call, or NULL for static methods
+ */
+MonoObject*
+plmono_instance_get(PLMonoFunction *desc)
+{
+	PLMonoInstance *inst;
+
+	if (desc->is_static)
+		return NULL;
+
+	if (!(inst = desc->instance))
+	{
+		if (desc->instance_scope == PLMONO_INSTANCE_FUNCTION)
+			inst = plmono_instance_new(desc->klass);
+		else
+		{
+			if (!backend_instances)
+				backend_instances = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+			if (!(inst = (PLMonoInstance*) g_hash_table_lookup(backend_instances, desc->klass)))
+			{
+				inst = plmono_instance_new(desc->klass);
+				g_hash_table_insert(backend_instances, desc->klass, inst);
+			}
+		}
+
+		desc->instance = inst;
+	}
+
+	return mono_gchandle_get_target(inst->handle);
+}
+
+/*
+ * plmono_instance_release
+ *
+ *     Dispose object of function scope once the function is resolved anew.
+ *     Objects of backend scope stay shared by other functions of the class
+ */
+void
+plmono_instance_release(PLMonoFunction *desc)
+{
+	PLMonoInstance *inst = desc->instance;
+
+	desc->instance = NULL;
+	if (!inst || desc->instance_scope != PLMONO_INSTANCE_FUNCTION)
+		return;
+
+	g_ptr_array_remove(all_instances, inst);
+	plmono_instance_hook(inst, inst->dispose, NULL);
+	mono_gchandle_free(inst->handle);
+	g_free(inst);
+}
@@ -0,0 +1,36 @@
+#ifndef _PLMONO_INSTANCE_H
+#define _PLMONO_INSTANCE_H
+
+/*
+ * Lifetime of objects instance methods are invoked on
+ * (plmono.instance_scope)
+ */
+typedef enum PLMonoInstanceScope
+{
+	PLMONO_INSTANCE_BACKEND,               /* one object per class */
+	PLMONO_INSTANCE_FUNCTION               /* one object per function */
+} PLMonoInstanceScope;
+
+/*
+ * Object instance methods of a class are invoked on, kept alive by a GC
+ * handle until the backend exits or, in function scope, the function is
+ * redefined
+ */
+typedef struct PLMonoInstance
+{
+	MonoClass *klass;                      /* class of the object */
+	guint32 handle;                        /* GC handle of the object */
+	MonoMethod *xact_end;                  /* ITransactionCallback
+	                                        * .OnTransactionEnd, if implemented */
+	MonoMethod *dispose;                   /* IDisposable.Dispose, if
+	                                        * implemented */
+} PLMonoInstance;
+
+extern int plmono_instance_scope;
+extern const struct config_enum_entry plmono_instance_scope_options[];
+
+void plmono_instance_resolve(PLMonoFunction *desc);
+MonoObject* plmono_instance_get(PLMonoFunction *desc);
+void plmono_instance_release(PLMonoFunction *desc);
+
+#endif
@@ -0,0 +1,610 @@
+/*-------------------------------------------------------------------------
+ *
+ * marshal.c
+ *     conversion of values between Postgres and Mono
+ *
+ * Copyright (c) 2009, Olexandr Melnyk <me@omelnyk.net>
+ *
+ *------------------------------------------------------------------------- 
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "mb/pg_wchar.h"
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+
+#include <mono/jit/jit.h>
+#include <mono/metadata/assembly.h>
+#include <mono/metadata/appdomain.h>
+#include <mono/metadata/object.h>
+#include <mono/metadata/reflection.h>
+
+#include "core.h"
+#include "marshal.h"
+
+/*
+ * Array types not named in pg_type.h of older servers
+ */
+#ifndef BOOLARRAYOID
+#define BOOLARRAYOID 1000
+#endif
+#ifndef INT2ARRAYOID
+#define INT2ARRAYOID 1005
+#endif
+#ifndef INT8ARRAYOID
+#define INT8ARRAYOID 1016
+#endif
+#ifndef FLOAT8ARRAYOID
+#define FLOAT8ARRAYOID 1022
+#endif
+
+/*
+ * Converters of individual types
+ */
+
+static gpointer
+plmono_bool_to_obj(Datum val, PLMonoValue *slot)
+{
+	slot->b = DatumGetBool(val);
+	return slot;
+}
+
+static Datum
+plmono_bool_to_datum(gpointer obj)
+{
+	return BoolGetDatum(*((MonoBoolean*) obj));
+}
+
+static gpointer
+plmono_int2_to_obj(Datum val, PLMonoValue *slot)
+{
+	slot->s = DatumGetInt16(val);
+	return slot;
+}
+
+static Datum
+plmono_int2_to_datum(gpointer obj)
+{
+	return Int16GetDatum(*((gint16*) obj));
+}
+
+static gpointer
+plmono_int4_to_obj(Datum val, PLMonoValue *slot)
+{
+	slot->i = DatumGetInt32(val);
+	return slot;
+}
+
+static Datum
+plmono_int4_to_datum(gpointer obj)
+{
+	return Int32GetDatum(*((gint32*) obj));
+}
+
+static gpointer
+plmono_int8_to_obj(Datum val, PLMonoValue *slot)
+{
+	slot->l = DatumGetInt64(val);
+	return slot;
+}
+
+static Datum
+plmono_int8_to_datum(gpointer obj)
+{
+	return Int64GetDatum(*((gint64*) obj));
+}
+
+static gpointer
+plmono_float4_to_obj(Datum val, PLMonoValue *slot)
+{
+	slot->f = DatumGetFloat4(val);
+	return slot;
+}
+
+static Datum
+plmono_float4_to_datum(gpointer obj)
+{
+	return Float4GetDatum(*((float*) obj));
+}
+
+static gpointer
+plmono_float8_to_obj(Datum val, PLMonoValue *slot)
+{
+	slot->d = DatumGetFloat8(val);
+	return slot;
+}
+
+static Datum
+plmono_float8_to_datum(gpointer obj)
+{
+	return Float8GetDatum(*((double*) obj));
+}
+
+/*
+ * Text is decoded into a managed string straight from the varlena, and
+ * managed strings are encoded straight into a new varlena, so large values
+ * are not copied through intermediate C strings
+ */
+
+static gpointer
+plmono_text_to_obj(Datum val, PLMonoValue *slot)
+{
+	text *t = DatumGetTextPP(val);
+	char *data = VARDATA_ANY(t);
+	int len = VARSIZE_ANY_EXHDR(t);
+	char *converted = data;
+	MonoString *str;
+
+	/*
+     * Conversion returns its input when there is nothing to convert, which
+     * is not NUL-terminated
+     */
+	if (GetDatabaseEncoding() != PG_UTF8)
+		converted = (char*) pg_do_encoding_conversion((unsigned char*) data, len, GetDatabaseEncoding(), PG_UTF8);
+
+	if (converted != data)
+	{
+		str = mono_string_new_len(plmono_get_domain(), converted, strlen(converted));
+		pfree(converted);
+	}
+	else
+		str = mono_string_new_len(plmono_get_domain(), data, len);
+
+	if ((Pointer) t != DatumGetPointer(val))
+		pfree(t);
+
+	return str;
+}
+
+static Datum
+plmono_text_to_datum(gpointer obj)
+{
+	MonoString *str = (MonoString*) obj;
+	gunichar2 *chars = mono_string_chars(str);
+	int len = mono_string_length(str);
+	int size = 0, i;
+	gunichar c;
+	text *result;
+	char *p, *converted;
+
+	/*
+     * Measure UTF-8 form of the string, so that it is written only once.
+     * Unpaired surrogates become U+FFFD
+     */
+	for (i = 0; i < len; i++)
+	{
+		c = chars[i];
+		if (c < 0x80)
+			size += 1;
+		else if (c < 0x800)
+			size += 2;
+		else if (c >= 0xD800 && c < 0xDC00 && i + 1 < len && chars[i + 1] >= 0xDC00 && chars[i + 1] < 0xE000)
+		{
+			size += 4;
+			i++;
+		}
+		else
+			size += 3;
+	}
+
+	result = (text*) palloc(size + VARHDRSZ);
+	SET_VARSIZE(result, size + VARHDRSZ);
+	p = VARDATA(result);
+
+	for (i = 0; i < len; i++)
+	{
+		c = chars[i];
+		if (c < 0x80)
+			*p++ = c;
+		else if (c < 0x800)
+		{
+			*p++ = 0xC0 | (c >> 6);
+			*p++ = 0x80 | (c & 0x3F);
+		}
+		else
+		{
+			if (c >= 0xD800 && c < 0xDC00 && i + 1 < len && chars[i + 1] >= 0xDC00 && chars[i + 1] < 0xE000)
+			{
+				c = 0x10000 + ((c - 0xD800) << 10) + (chars[++i] - 0xDC00);
+				*p++ = 0xF0 | (c >> 18);
+				*p++ = 0x80 | ((c >> 12) & 0x3F);
+			}
+			else
+			{
+				if (c >= 0xD800 && c < 0xE000)
+					c = 0xFFFD;
+				*p++ = 0xE0 | (c >> 12);
+			}
+			*p++ = 0x80 | ((c >> 6) & 0x3F);
+			*p++ = 0x80 | (c & 0x3F);
+		}
+	}
+
+	if (GetDatabaseEncoding() != PG_UTF8)
+	{
+		converted = (char*) pg_do_encoding_conversion((unsigned char*) VARDATA(result), size, PG_UTF8, GetDatabaseEncoding());
+		if (converted != VARDATA(result))
+		{
+			pfree(result);
+			return PointerGetDatum(cstring_to_text(converted));
+		}
+	}
+
+	return PointerGetDatum(result);
+}
+
+static MonoClass*
+plmono_bytea_get_class(void)
+{
+	return mono_array_class_get(mono_get_byte_class(), 1);
+}
+
+static gpointer
+plmono_bytea_to_obj(Datum val, PLMonoValue *slot)
+{
+	bytea *data = DatumGetByteaPP(val);
+	int len = VARSIZE_ANY_EXHDR(data);
+	MonoArray *arr;
+
+	arr = mono_array_new(plmono_get_domain(), mono_get_byte_class(), len);
+	memcpy(mono_array_addr(arr, char, 0), VARDATA_ANY(data), len);
+
+	if ((Pointer) data != DatumGetPointer(val))
+		pfree(data);
+
+	return arr;
+}
+
+static Datum
+plmono_bytea_to_datum(gpointer obj)
+{
+	MonoArray *arr = (MonoArray*) obj;
+	int len = mono_array_length(arr);
+	bytea *data;
+
+	data = (bytea*) palloc(len + VARHDRSZ);
+	SET_VARSIZE(data, len + VARHDRSZ);
+	memcpy(VARDATA(data), mono_array_addr(arr, char, 0), len);
+
+	return PointerGetDatum(data);
+}
+
+/*
+ * One-dimensional arrays of fixed-width types are copied to and from managed
+ * arrays as a whole, since both lay elements out contiguously
+ */
+
+static gpointer
+plmono_array_to_obj(Datum val, Oid elemtype, MonoClass *elemclass, int elsize)
+{
+	ArrayType *arr = DatumGetArrayTypeP(val);
+	MonoArray *result;
+	int n;
+
+	if (ARR_ELEMTYPE(arr) != elemtype)
+		elog(ERROR, "Array with element type %u expected", elemtype);
+
+	if (ARR_NDIM(arr) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("Multidimensional arrays are not supported by PL/Mono")));
+
+	if (ARR_HASNULL(arr))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("Arrays with NULL elements are not supported by PL/Mono")));
+
+	n = ARR_NDIM(arr) ? ARR_DIMS(arr)[0] : 0;
+	result = mono_array_new(plmono_get_domain(), elemclass, n);
+	memcpy(mono_array_addr_with_size(result, elsize, 0), ARR_DATA_PTR(arr), n * elsize);
+
+	return result;
+}
+
+static Datum
+plmono_array_to_datum(gpointer obj, Oid elemtype, int elsize)
+{
+	MonoArray *src = (MonoArray*) obj;
+	int n = mono_array_length(src);
+	ArrayType *result;
+	int size;
+
+	if (n == 0)
+		return PointerGetDatum(construct_empty_array(elemtype));
+
+	/*
+     * Build the array in place rather than through construct_array, which
+     * would take the elements one by one
+     */
+	size = ARR_OVERHEAD_NONULLS(1) + n * elsize;
+	result = (ArrayType*) palloc0(size);
+	SET_VARSIZE(result, size);
+	result->ndim = 1;
+	result->dataoffset = 0;
+	result->elemtype = elemtype;
+	ARR_DIMS(result)[0] = n;
+	ARR_LBOUND(result)[0] = 1;
+	memcpy(ARR_DATA_PTR(result), mono_array_addr_with_size(src, elsize, 0), n * elsize);
+
+	return PointerGetDatum(result);
+}
+
+#define PLMONO_ARRAY_CONVERTERS(name, elemtype, get_elem_class, ctype) \
+static MonoClass* \
+plmono_##name##_array_get_class(void) \
+{ \
+	return mono_array_class_get(get_elem_class(), 1); \
+} \
+\
+static gpointer \
+plmono_##name##_array_to_obj(Datum val, PLMonoValue *slot) \
+{ \
+	return plmono_array_to_obj(val, elemtype, get_elem_class(), sizeof(ctype)); \
+} \
+\
+static Datum \
+plmono_##name##_array_to_datum(gpointer obj) \
+{ \
+	return plmono_array_to_datum(obj, elemtype, sizeof(ctype)); \
+}
+
+PLMONO_ARRAY_CONVERTERS(bool,   BOOLOID,   mono_get_boolean_class, MonoBoolean)
+PLMONO_ARRAY_CONVERTERS(int2,   INT2OID,   mono_get_int16_class,   gint16)
+PLMONO_ARRAY_CONVERTERS(int4,   INT4OID,   mono_get_int32_class,   gint32)
+PLMONO_ARRAY_CONVERTERS(int8,   INT8OID,   mono_get_int64_class,   gint64)
+PLMONO_ARRAY_CONVERTERS(float4, FLOAT4OID, mono_get_single_class,  float)
+PLMONO_ARRAY_CONVERTERS(float8, FLOAT8OID, mono_get_double_class,  double)
+
+static gpointer
+plmono_void_to_obj(Datum val, PLMonoValue *slot)
+{
+	elog(ERROR, "Arguments of type void are not supported by PL/Mono");
+	return NULL;
+}
+
+static Datum
+plmono_void_to_datum(gpointer obj)
+{
+	return (Datum) 0;
+}
+
+/*
+ * Types supported by PL/Mono
+ */
+static const PLMonoTypeMarshal type_marshals[] =
+{
+	{BOOLOID,   mono_get_boolean_class, false, PLMONO_KIND_BOOL,   plmono_bool_to_obj,   plmono_bool_to_datum  },
+	{INT2OID,   mono_get_int16_class,   false, PLMONO_KIND_INT16,  plmono_int2_to_obj,   plmono_int2_to_datum  },
+	{INT4OID,   mono_get_int32_class,   false, PLMONO_KIND_INT32,  plmono_int4_to_obj,   plmono_int4_to_datum  },
+	{INT8OID,   mono_get_int64_class,   false, PLMONO_KIND_INT64,  plmono_int8_to_obj,   plmono_int8_to_datum  },
+	{FLOAT4OID, mono_get_single_class,  false, PLMONO_KIND_FLOAT4, plmono_float4_to_obj, plmono_float4_to_datum},
+	{FLOAT8OID, mono_get_double_class,  false, PLMONO_KIND_FLOAT8, plmono_float8_to_obj, plmono_float8_to_datum},
+	{TEXTOID,   mono_get_string_class,  true,  PLMONO_KIND_NONE,   plmono_text_to_obj,   plmono_text_to_datum  },
+	{BYTEAOID,  plmono_bytea_get_class, true,  PLMONO_KIND_NONE,   plmono_bytea_to_obj,  plmono_bytea_to_datum },
+	{BOOLARRAYOID,   plmono_bool_array_get_class,   true, PLMONO_KIND_NONE, plmono_bool_array_to_obj,   plmono_bool_array_to_datum  },
+	{INT2ARRAYOID,   plmono_int2_array_get_class,   true, PLMONO_KIND_NONE, plmono_int2_array_to_obj,   plmono_int2_array_to_datum  },
+	{INT4ARRAYOID,   plmono_int4_array_get_class,   true, PLMONO_KIND_NONE, plmono_int4_array_to_obj,   plmono_int4_array_to_datum  },
+	{INT8ARRAYOID,   plmono_int8_array_get_class,   true, PLMONO_KIND_NONE, plmono_int8_array_to_obj,   plmono_int8_array_to_datum  },
+	{FLOAT4ARRAYOID, plmono_float4_array_get_class, true, PLMONO_KIND_NONE, plmono_float4_array_to_obj, plmono_float4_array_to_datum},
+	{FLOAT8ARRAYOID, plmono_float8_array_get_class, true, PLMONO_KIND_NONE, plmono_float8_array_to_obj, plmono_float8_array_to_datum},
+	{VOIDOID,   mono_get_void_class,    true,  PLMONO_KIND_NONE,   plmono_void_to_obj,   plmono_void_to_datum  }
+};
+
+/*
+ * Argument and result converters, one of each is picked for a position when
+ * its plan is built
+ */
+
+/*
+ * plmono_marshal_null_arg
+ *
+ *     Report NULL passed to parameter of a value type which can't hold it
+ */
+static void
+plmono_marshal_null_arg(PLMonoMarshal *m)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+			 errmsg("NULL cannot be passed to parameter of type %s", mono_class_get_name(m->klass)),
+			 errhint("Declare the parameter as Nullable<%s> or the function as STRICT.", mono_class_get_name(m->klass))));
+}
+
+static gpointer
+plmono_marshal_to_arg(PLMonoMarshal *m, Datum val, bool isnull, PLMonoValue *slot)
+{
+	if (isnull)
+	{
+		if (!m->tm->is_reference)
+			plmono_marshal_null_arg(m);
+		return NULL;
+	}
+
+	return m->tm->to_obj(val, slot);
+}
+
+static gpointer
+plmono_marshal_to_ref_arg(PLMonoMarshal *m, Datum val, bool isnull, PLMonoValue *slot)
+{
+	slot->p = isnull ? NULL : m->tm->to_obj(val, slot);
+	return slot;
+}
+
+static gpointer
+plmono_marshal_to_out_arg(PLMonoMarshal *m, Datum val, bool isnull, PLMonoValue *slot)
+{
+	MemSet(slot, 0, sizeof(PLMonoValue));
+	return slot;
+}
+
+static gpointer
+plmono_marshal_to_nullable_arg(PLMonoMarshal *m, Datum val, bool isnull, PLMonoValue *slot)
+{
+	PLMonoValue value;
+	gpointer obj;
+
+	MemSet(slot, 0, sizeof(PLMonoValue));
+	if (!isnull)
+	{
+		obj = m->tm->to_obj(val, &value);
+		memcpy((char*) slot + m->value_offset, obj, mono_class_value_size(m->tm->get_class(), NULL));
+		*((MonoBoolean*) ((char*) slot + m->has_value_offset)) = TRUE;
+	}
+
+	return slot;
+}
+
+static Datum
+plmono_marshal_from_value_arg(PLMonoMarshal *m, PLMonoValue *slot)
+{
+	return m->tm->to_datum(slot);
+}
+
+static Datum
+plmono_marshal_from_ref_arg(PLMonoMarshal *m, PLMonoValue *slot)
+{
+	return m->tm->to_datum(slot->p);
+}
+
+static Datum
+plmono_marshal_from_boxed(PLMonoMarshal *m, MonoObject *obj)
+{
+	return m->tm->to_datum(mono_object_unbox(obj));
+}
+
+static Datum
+plmono_marshal_from_reference(PLMonoMarshal *m, MonoObject *obj)
+{
+	return m->tm->to_datum(obj);
+}
+
+/*
+ * plmono_marshal_find
+ *
+ *     Get conversions of Postgres data type, or NULL if the type is not
+ *     supported
+ */
+const PLMonoTypeMarshal*
+plmono_marshal_find(Oid typeoid)
+{
+	int i;
+
+	for (i = 0; i < lengthof(type_marshals); i++)
+		if (type_marshals[i].typeoid == typeoid)
+			return &type_marshals[i];
+
+	return NULL;
+}
+
+/*
+ * plmono_marshal_lookup
+ *
+ *     Get conversions of Postgres data type, or report error if the type is
+ *     not supported
+ */
+const PLMonoTypeMarshal*
+plmono_marshal_lookup(Oid typeoid)
+{
+	const PLMonoTypeMarshal *tm;
+
+	if (!(tm = plmono_marshal_find(typeoid)))
+		elog(ERROR, "Data type with OID %d is not supported by PL/Mono", typeoid);
+
+	return tm;
+}
+
+/*
+ * plmono_marshal_use
+ *
+ *     Make marshalling plan convert values with specified conversions, which
+ *     need not be the default ones of its type
+ */
+void
+plmono_marshal_use(PLMonoMarshal *m, const PLMonoTypeMarshal *tm)
+{
+	m->tm = tm;
+	m->klass = tm->get_class();
+	m->type = m->byref ? mono_class_get_byref_type(m->klass) : mono_class_get_type(m->klass);
+
+	if (tm->is_reference)
+	{
+		m->to_arg = m->byref ? plmono_marshal_to_ref_arg : plmono_marshal_to_arg;
+		m->from_arg = plmono_marshal_from_ref_arg;
+		m->from_result = plmono_marshal_from_reference;
+	}
+	else
+	{
+		m->to_arg = plmono_marshal_to_arg;
+		m->from_arg = plmono_marshal_from_value_arg;
+		m->from_result = plmono_marshal_from_boxed;
+	}
+
+	/*
+     * OUT arguments have no input value
+     */
+	if (m->out)
+		m->to_arg = plmono_marshal_to_out_arg;
+}
+
+/*
+ * plmono_marshal_nullable_class
+ *
+ *     Get class of Nullable<T> for value type T
+ */
+MonoClass*
+plmono_marshal_nullable_class(MonoClass *klass)
+{
+	static MonoClass *nullable = NULL;
+	MonoType *type = mono_class_get_type(klass);
+
+	if (!nullable)
+		nullable = mono_class_from_name(mono_get_corlib(), "System", "Nullable`1");
+
+	return mono_class_bind_generic_parameters(nullable, 1, &type, FALSE);
+}
+
+/*
+ * plmono_marshal_use_nullable
+ *
+ *     Make marshalling plan of a value type argument pass it as Nullable<T>,
+ *     so that NULL can be passed
+ */
+void
+plmono_marshal_use_nullable(PLMonoMarshal *m, MonoClass *nullable)
+{
+	MonoClassField *value, *has_value;
+
+	if (!(has_value = mono_class_get_field_from_name(nullable, "has_value")))
+		has_value = mono_class_get_field_from_name(nullable, "hasValue");
+	value = mono_class_get_field_from_name(nullable, "value");
+
+	if (!value || !has_value || mono_class_value_size(nullable, NULL) > sizeof(PLMonoValue))
+		elog(ERROR, "Unsupported layout of Nullable<%s>", mono_class_get_name(m->klass));
+
+	m->value_offset = mono_field_get_offset(value) - sizeof(MonoObject);
+	m->has_value_offset = mono_field_get_offset(has_value) - sizeof(MonoObject);
+	m->klass = nullable;
+	m->type = mono_class_get_type(nullable);
+	m->to_arg = plmono_marshal_to_nullable_arg;
+}
+
+/*
+ * plmono_marshal_init
+ *
+ *     Build marshalling plan of an argument or result position. Result
+ *     positions are described by PROARGMODE_IN and argno of -1
+ */
+void
+plmono_marshal_init(PLMonoMarshal *m, Oid typeoid, char argmode, int argno)
+{
+	m->typeoid = typeoid;
+	get_typlenbyval(typeoid, &m->typlen, &m->typbyval);
+	m->byref = (argmode != PROARGMODE_IN && argmode != PROARGMODE_VARIADIC);
+	m->out = (argno < 0 && m->byref);
+	m->argno = (argno < 0) ? 0 : argno;
+
+	plmono_marshal_use(m, plmono_marshal_lookup(typeoid));
+}
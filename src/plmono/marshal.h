@@ -0,0 +1,97 @@
+#ifndef _PLMONO_MARSHAL_H
+#define _PLMONO_MARSHAL_H
+
+/*
+ * Slot holding a primitive value or an object reference passed to a method
+ */
+typedef union PLMonoValue
+{
+	MonoBoolean b;
+	gint16 s;
+	gint32 i;
+	gint64 l;
+	float f;
+	double d;
+	gpointer p;
+	gint64 n[2];                           /* Nullable<T> of any of the above */
+} PLMonoValue;
+
+/*
+ * Primitive kinds of values, selecting PLMonoValue member they occupy
+ */
+typedef enum PLMonoValueKind
+{
+	PLMONO_KIND_NONE = -1,                 /* not a primitive */
+	PLMONO_KIND_BOOL,
+	PLMONO_KIND_INT16,
+	PLMONO_KIND_INT32,
+	PLMONO_KIND_INT64,
+	PLMONO_KIND_FLOAT4,
+	PLMONO_KIND_FLOAT8,
+	PLMONO_NUM_KINDS
+} PLMonoValueKind;
+
+struct PLMonoMarshal;
+
+/*
+ * Converter of a Datum into method argument. Value types are written into the
+ * slot and a pointer to the slot is returned; for reference types the object
+ * itself is returned. NULL becomes a null reference or an empty Nullable<T>,
+ * and is rejected for other value types
+ */
+typedef gpointer (*PLMonoToArg)(struct PLMonoMarshal *m, Datum val, bool isnull, PLMonoValue *slot);
+
+/*
+ * Converter of an argument slot or a method return value into a Datum
+ */
+typedef Datum (*PLMonoFromArg)(struct PLMonoMarshal *m, PLMonoValue *slot);
+typedef Datum (*PLMonoFromResult)(struct PLMonoMarshal *m, MonoObject *obj);
+
+/*
+ * Conversions between a Postgres data type and its Mono counterpart
+ */
+typedef struct PLMonoTypeMarshal
+{
+	Oid typeoid;                           /* Postgres type */
+	MonoClass* (*get_class)(void);         /* Mono counterpart of the type */
+	bool is_reference;                     /* counterpart is a reference type */
+	PLMonoValueKind kind;                  /* primitive kind of counterpart */
+	gpointer (*to_obj)(Datum val, PLMonoValue *slot);
+	Datum (*to_datum)(gpointer obj);       /* takes unboxed value or reference */
+} PLMonoTypeMarshal;
+
+/*
+ * Marshalling plan of a single argument or result position, with converters
+ * specialized for the type and the way it is passed
+ */
+typedef struct PLMonoMarshal
+{
+	Oid typeoid;                           /* Postgres type */
+	int16 typlen;                          /* its length */
+	bool typbyval;                         /* and whether it is by value */
+	MonoClass *klass;                      /* Mono counterpart of the type */
+	MonoType *type;                        /* type of method parameter */
+	bool byref;                            /* passed by reference */
+	bool out;                              /* OUT argument, without input */
+	int value_offset;                      /* offsets of fields of Nullable<T>, */
+	int has_value_offset;                  /* if passed as such */
+	int argno;                             /* index in fcinfo->arg, 0 if none */
+	const PLMonoTypeMarshal *tm;           /* conversions of the type */
+	PLMonoToArg to_arg;                    /* Datum -> argument */
+	PLMonoFromArg from_arg;                /* ref argument slot -> Datum */
+	PLMonoFromResult from_result;          /* return value -> Datum */
+} PLMonoMarshal;
+
+/*
+ * Caller of an unmanaged thunk with a particular native signature
+ */
+typedef void (*PLMonoThunkCaller)(gpointer thunk, PLMonoValue *args, PLMonoValue *result, MonoException **exc);
+
+const PLMonoTypeMarshal* plmono_marshal_find(Oid typeoid);
+const PLMonoTypeMarshal* plmono_marshal_lookup(Oid typeoid);
+void plmono_marshal_use(PLMonoMarshal *m, const PLMonoTypeMarshal *tm);
+void plmono_marshal_use_nullable(PLMonoMarshal *m, MonoClass *nullable);
+MonoClass* plmono_marshal_nullable_class(MonoClass *klass);
+void plmono_marshal_init(PLMonoMarshal *m, Oid typeoid, char argmode, int argno);
+
+#endif
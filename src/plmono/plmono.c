@@ -12,20 +12,33 @@
 #include "executor/spi.h"
 #include "commands/trigger.h"
 #include "fmgr.h"
+#include "miscadmin.h"
 #include "access/heapam.h"
 #include "utils/syscache.h"
 #include "utils/builtins.h"
 #include "catalog/pg_proc.h"
 #include "catalog/pg_type.h"
+#include "funcapi.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "nodes/execnodes.h"
 
 #include "core.h"
+#include "assembly.h"
+#include "marshal.h"
+#include "cache.h"
 #include "function.h"
 #include "trigger.h"
+#include "instance.h"
+#include "stats.h"
+#include "profile.h"
 
 #ifdef PG_MODULE_MAGIC
 PG_MODULE_MAGIC;
 #endif
 
+void _PG_init(void);
+
 extern Datum plmono_call_handler(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(plmono_call_handler);
 
@@ -34,12 +47,144 @@ PG_FUNCTION_INFO_V1(plmono_validator);
 
 Datum plmono_trigger_handler(PG_FUNCTION_ARGS);
 
+/*
+ * Module initialization: define configuration variables and warm up Mono
+ * runtime, unless the library is being preloaded into postmaster. Variables
+ * read when the runtime is initialized can't be changed once the backend has
+ * started
+ */
+void
+_PG_init(void)
+{
+	DefineCustomStringVariable("plmono.assembly_path",
+							   "Path of PLMono assembly.",
+							   "A leading $libdir is replaced with package library directory.",
+							   &plmono_assembly_path,
+							   "$libdir/PLMono.dll",
+							   PGC_BACKEND, 0,
+							   NULL, NULL);
+
+	DefineCustomStringVariable("plmono.preload_assemblies",
+							   "Comma-separated list of assemblies loaded when Mono runtime is initialized.",
+							   NULL,
+							   &plmono_preload_assemblies,
+							   "",
+							   PGC_BACKEND, 0,
+							   NULL, NULL);
+
+	DefineCustomBoolVariable("plmono.preload_jit",
+							 "Compile SQL methods of preloaded assemblies when Mono runtime is initialized.",
+							 NULL,
+							 &plmono_preload_jit,
+							 false,
+							 PGC_BACKEND, 0,
+							 NULL, NULL);
+
+	DefineCustomStringVariable("plmono.runtime_version",
+							   "Version of Mono runtime to initialize.",
+							   NULL,
+							   &plmono_runtime_version,
+							   "v2.0.50727",
+							   PGC_BACKEND, 0,
+							   NULL, NULL);
+
+	DefineCustomStringVariable("plmono.aot_cache_dir",
+							   "Directory of AOT compiled assemblies.",
+							   "Assemblies compiled there by plmono_aot_compile are loaded without JIT compilation. A leading $libdir is replaced with package library directory.",
+							   &plmono_aot_cache_dir,
+							   "",
+							   PGC_BACKEND, 0,
+							   NULL, NULL);
+
+	DefineCustomBoolVariable("plmono.track_functions",
+							 "Collect call statistics of PL/Mono functions.",
+							 "Statistics are kept by each backend and shown by pg_stat_plmono.",
+							 &plmono_track_functions,
+							 false,
+							 PGC_SUSET, 0,
+							 NULL, NULL);
+
+	DefineCustomBoolVariable("plmono.profile_instrument",
+							 "Instrument managed code for profiling when Mono runtime is initialized.",
+							 "Instrumented code is slower even when calls are not recorded.",
+							 &plmono_profile_instrument,
+							 false,
+							 PGC_BACKEND, 0,
+							 NULL, NULL);
+
+	DefineCustomBoolVariable("plmono.profile",
+							 "Record managed methods called by PL/Mono functions.",
+							 "Takes effect only if plmono.profile_instrument is set; may be set for individual functions.",
+							 &plmono_profile,
+							 false,
+							 PGC_SUSET, 0,
+							 NULL, NULL);
+
+	DefineCustomEnumVariable("plmono.instance_scope",
+							 "Lifetime of objects instance methods are invoked on.",
+							 "Objects are shared by all functions of a class in the backend, or constructed for each function.",
+							 &plmono_instance_scope,
+							 PLMONO_INSTANCE_BACKEND,
+							 plmono_instance_scope_options,
+							 PGC_USERSET, 0,
+							 NULL, NULL);
+
+	EmitWarningsOnPlaceholders("plmono");
+
+	/*
+     * Mono runtime starts finalizer and GC threads, which don't survive
+     * fork(), so when preloaded into postmaster, only the library is loaded
+     * and each backend warms up on its own
+     */
+	if (process_shared_preload_libraries_in_progress)
+		return;
+
+	/*
+     * Failing warm-up must not prevent the library from loading; it will be
+     * retried on first call
+     */
+	PG_TRY();
+	{
+		plmono_warm_up();
+	}
+	PG_CATCH();
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+		ErrorData *edata = CopyErrorData();
+
+		FlushErrorState();
+		MemoryContextSwitchTo(oldcxt);
+
+		elog(WARNING, "PL/Mono warm-up failed: %s", edata->message);
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+}
+
 /*
  * Call handler for both trigger and non-trigger functions
  */
 Datum
 plmono_call_handler(PG_FUNCTION_ARGS)
 {
+	ReturnSetInfo *rsinfo;
+	int i;
+
+	/*
+     * Strict functions return NULL for NULL input without the runtime being
+     * touched, which makes them cheap on sparse columns
+     */
+	if (fcinfo->flinfo->fn_strict)
+		for (i = 0; i < fcinfo->nargs; i++)
+			if (fcinfo->argnull[i])
+			{
+				rsinfo = (ReturnSetInfo*) fcinfo->resultinfo;
+				if (fcinfo->flinfo->fn_retset && rsinfo && IsA(rsinfo, ReturnSetInfo))
+					rsinfo->isDone = ExprEndResult;
+
+				PG_RETURN_NULL();
+			}
+
 	plmono_warm_up();
 
 	if (CALLED_AS_TRIGGER(fcinfo))
@@ -49,14 +194,28 @@ plmono_call_handler(PG_FUNCTION_ARGS)
 }
 
 /*
- * Function validator
+ * Function validator: resolve the method when the function is created, so
+ * that errors in its body are reported then rather than on first call, and
+ * the resolved and compiled function is cached for the backend
  */
 Datum
 plmono_validator(PG_FUNCTION_ARGS)
 {
+	Oid fn_oid = PG_GETARG_OID(0);
+
+#if PG_VERSION_NUM >= 90000
+	if (!CheckFunctionValidatorAccess(fcinfo->flinfo->fn_oid, fn_oid))
+		PG_RETURN_VOID();
+#endif
+
 	/*
-     * All checks are deferred to method invokation
+     * Dumps may be restored before the assemblies are deployed
      */
+	if (!check_function_bodies)
+		PG_RETURN_VOID();
+
+	plmono_warm_up();
+	plmono_cache_validate(fn_oid);
 
-	PG_RETURN_INT32(0);
+	PG_RETURN_VOID();
 }
@@ -0,0 +1,524 @@
+/*-------------------------------------------------------------------------
+ *
+ * profile.c
+ *     profiling of managed methods called by SQL functions
+ *
+ * Copyright (c) 2009, Olexandr Melnyk <me@omelnyk.net>
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
+#include "portability/instr_time.h"
+
+#include <pthread.h>
+
+#include <mono/jit/jit.h>
+#include <mono/metadata/assembly.h>
+#include <mono/metadata/appdomain.h>
+#include <mono/metadata/object.h>
+#include <mono/metadata/profiler.h>
+
+#include "core.h"
+#include "profile.h"
+
+extern Datum plmono_profile_functions(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(plmono_profile_functions);
+
+extern Datum plmono_profile_dump(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(plmono_profile_dump);
+
+extern Datum plmono_profile_reset(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(plmono_profile_reset);
+
+/*
+ * Whether managed code is instrumented for profiling when Mono runtime is
+ * initialized (plmono.profile_instrument)
+ */
+bool plmono_profile_instrument = false;
+
+/*
+ * Whether calls of instrumented code are recorded (plmono.profile)
+ */
+bool plmono_profile = false;
+
+/*
+ * State of the profiler, passed back to callbacks by Mono
+ */
+struct _MonoProfiler
+{
+	pthread_t thread;                      /* thread running SQL functions */
+};
+
+static MonoProfiler profiler;
+
+/*
+ * Whether the profiler has been installed
+ */
+static bool profile_installed = false;
+
+/*
+ * Call trees, keyed by function Oid
+ */
+static GHashTable *profile_roots = NULL;
+
+/*
+ * Node of the method being executed, or NULL if calls aren't recorded
+ */
+static PLMonoProfileNode *profile_current = NULL;
+
+/*
+ * plmono_profile_node_new
+ *
+ *     Create call tree node. Callbacks run in managed code, where Postgres
+ *     errors cannot be raised, so nodes are allocated by glib
+ */
+static PLMonoProfileNode*
+plmono_profile_node_new(PLMonoProfileNode *parent, MonoMethod *method, Oid fn_oid)
+{
+	PLMonoProfileNode *node = g_new0(PLMonoProfileNode, 1);
+
+	node->method = method;
+	node->fn_oid = fn_oid;
+	node->parent = parent;
+	node->children = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	return node;
+}
+
+/*
+ * plmono_profile_node_free
+ *
+ *     Free call tree node and its subtree
+ */
+static void
+plmono_profile_node_free(gpointer data)
+{
+	PLMonoProfileNode *node = (PLMonoProfileNode*) data;
+	GHashTableIter iter;
+	gpointer child;
+
+	g_hash_table_iter_init(&iter, node->children);
+	while (g_hash_table_iter_next(&iter, NULL, &child))
+		plmono_profile_node_free(child);
+
+	g_hash_table_destroy(node->children);
+	g_free(node);
+}
+
+/*
+ * plmono_profile_is_recording
+ *
+ *     Check whether callback should record the event: only methods called by
+ *     the function being profiled are, and not those of finalizer and other
+ *     runtime threads
+ */
+static inline bool
+plmono_profile_is_recording(MonoProfiler *prof)
+{
+	return profile_current && pthread_equal(pthread_self(), prof->thread);
+}
+
+/*
+ * plmono_profile_enter
+ *
+ *     Method entry callback: descend into the node of the callee
+ */
+static void
+plmono_profile_enter(MonoProfiler *prof, MonoMethod *method)
+{
+	PLMonoProfileNode *node;
+
+	if (!plmono_profile_is_recording(prof))
+		return;
+
+	if (!(node = (PLMonoProfileNode*) g_hash_table_lookup(profile_current->children, method)))
+	{
+		node = plmono_profile_node_new(profile_current, method, profile_current->fn_oid);
+		g_hash_table_insert(profile_current->children, method, node);
+	}
+
+	node->calls++;
+	INSTR_TIME_SET_CURRENT(node->start);
+	profile_current = node;
+}
+
+/*
+ * plmono_profile_leave
+ *
+ *     Method exit callback, also called for frames unwound by an exception:
+ *     return to the node of the caller
+ */
+static void
+plmono_profile_leave(MonoProfiler *prof, MonoMethod *method)
+{
+	instr_time now;
+
+	if (!plmono_profile_is_recording(prof) || profile_current->method != method)
+		return;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_ACCUM_DIFF(profile_current->total, now, profile_current->start);
+	profile_current = profile_current->parent;
+}
+
+/*
+ * plmono_profile_allocation
+ *
+ *     Allocation callback: count object against the method allocating it
+ */
+static void
+plmono_profile_allocation(MonoProfiler *prof, MonoObject *obj, MonoClass *klass)
+{
+	if (!plmono_profile_is_recording(prof))
+		return;
+
+	profile_current->allocations++;
+	profile_current->allocated_bytes += mono_object_get_size(obj);
+}
+
+/*
+ * plmono_profile_install
+ *
+ *     Install the profiler if plmono.profile_instrument is set. Must be done
+ *     before Mono runtime is initialized, since methods are instrumented
+ *     when they are compiled
+ */
+void
+plmono_profile_install(void)
+{
+	if (!plmono_profile_instrument || profile_installed)
+		return;
+
+	profiler.thread = pthread_self();
+
+	mono_profiler_install(&profiler, NULL);
+	mono_profiler_install_enter_leave(plmono_profile_enter, plmono_profile_leave);
+	mono_profiler_install_exception(NULL, plmono_profile_leave, NULL);
+	mono_profiler_install_allocation(plmono_profile_allocation);
+	mono_profiler_set_events(MONO_PROFILE_ENTER_LEAVE | MONO_PROFILE_EXCEPTIONS | MONO_PROFILE_ALLOCATIONS);
+
+	profile_installed = true;
+}
+
+/*
+ * plmono_profile_push
+ *
+ *     Start recording methods called by the function, if plmono.profile is
+ *     set for it. Returns node to be passed to plmono_profile_pop when the
+ *     call ends, whether normally or by error
+ */
+PLMonoProfileNode*
+plmono_profile_push(Oid fn_oid)
+{
+	PLMonoProfileNode *prev = profile_current, *root;
+
+	if (!profile_installed)
+		return prev;
+
+	if (!plmono_profile)
+	{
+		profile_current = NULL;
+		return prev;
+	}
+
+	if (!profile_roots)
+		profile_roots = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, plmono_profile_node_free);
+
+	if (!(root = (PLMonoProfileNode*) g_hash_table_lookup(profile_roots, GUINT_TO_POINTER(fn_oid))))
+	{
+		root = plmono_profile_node_new(NULL, NULL, fn_oid);
+		g_hash_table_insert(profile_roots, GUINT_TO_POINTER(fn_oid), root);
+	}
+
+	root->calls++;
+	INSTR_TIME_SET_CURRENT(root->start);
+	profile_current = root;
+
+	return prev;
+}
+
+/*
+ * plmono_profile_pop
+ *
+ *     Stop recording methods of the function, and resume recording those of
+ *     the calling one. Frames left open by an error are abandoned
+ */
+void
+plmono_profile_pop(PLMonoProfileNode *prev)
+{
+	PLMonoProfileNode *root = profile_current;
+	instr_time now;
+
+	while (root && root->parent)
+		root = root->parent;
+
+	if (root)
+	{
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_ACCUM_DIFF(root->total, now, root->start);
+	}
+
+	profile_current = prev;
+}
+
+/*
+ * plmono_profile_self_time
+ *
+ *     Get time spent in node's calls outside of its callees
+ */
+static instr_time
+plmono_profile_self_time(PLMonoProfileNode *node)
+{
+	instr_time self = node->total;
+	GHashTableIter iter;
+	gpointer child;
+
+	g_hash_table_iter_init(&iter, node->children);
+	while (g_hash_table_iter_next(&iter, NULL, &child))
+		INSTR_TIME_SUBTRACT(self, ((PLMonoProfileNode*) child)->total);
+
+	return self;
+}
+
+/*
+ * plmono_profile_append_frame
+ *
+ *     Append method of node to collapsed stack
+ */
+static void
+plmono_profile_append_frame(StringInfo stack, PLMonoProfileNode *node)
+{
+	MonoClass *klass = mono_method_get_class(node->method);
+
+	if (stack->len > 0)
+		appendStringInfoChar(stack, ';');
+
+	if (*mono_class_get_namespace(klass))
+		appendStringInfo(stack, "%s.", mono_class_get_namespace(klass));
+	appendStringInfo(stack, "%s:%s", mono_class_get_name(klass), mono_method_get_name(node->method));
+}
+
+/*
+ * Visitor of call tree nodes, given collapsed stack of the node
+ */
+typedef void (*PLMonoProfileVisitor)(PLMonoProfileNode *node, StringInfo stack, int depth, void *arg);
+
+/*
+ * plmono_profile_walk
+ *
+ *     Visit node and its subtree, depth first
+ */
+static void
+plmono_profile_walk(PLMonoProfileNode *node, StringInfo stack, int depth,
+					PLMonoProfileVisitor visitor, void *arg)
+{
+	GHashTableIter iter;
+	gpointer child;
+	int len = stack->len;
+
+	if (node->method)
+		plmono_profile_append_frame(stack, node);
+
+	visitor(node, stack, depth, arg);
+
+	g_hash_table_iter_init(&iter, node->children);
+	while (g_hash_table_iter_next(&iter, NULL, &child))
+		plmono_profile_walk((PLMonoProfileNode*) child, stack, depth + 1, visitor, arg);
+
+	stack->len = len;
+	stack->data[len] = '\0';
+}
+
+/*
+ * plmono_profile_walk_all
+ *
+ *     Visit nodes of all call trees
+ */
+static void
+plmono_profile_walk_all(PLMonoProfileVisitor visitor, void *arg)
+{
+	StringInfoData stack;
+	GHashTableIter iter;
+	gpointer root;
+
+	if (!profile_roots)
+		return;
+
+	initStringInfo(&stack);
+
+	g_hash_table_iter_init(&iter, profile_roots);
+	while (g_hash_table_iter_next(&iter, NULL, &root))
+		plmono_profile_walk((PLMonoProfileNode*) root, &stack, 0, visitor, arg);
+
+	pfree(stack.data);
+}
+
+/*
+ * Output of plmono_profile_functions being built
+ */
+typedef struct PLMonoProfileOutput
+{
+	Tuplestorestate *tupstore;
+	TupleDesc tupdesc;
+} PLMonoProfileOutput;
+
+/*
+ * plmono_profile_put_node
+ *
+ *     Add row of node to plmono_profile_functions output
+ */
+static void
+plmono_profile_put_node(PLMonoProfileNode *node, StringInfo stack, int depth, void *arg)
+{
+	PLMonoProfileOutput *output = (PLMonoProfileOutput*) arg;
+	Datum values[8];
+	bool nulls[8];
+
+	MemSet(nulls, 0, sizeof(nulls));
+
+	values[0] = ObjectIdGetDatum(node->fn_oid);
+	values[1] = Int32GetDatum(depth);
+	values[2] = CStringGetTextDatum(stack->data);
+	values[3] = Int64GetDatum(node->calls);
+	values[4] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(node->total));
+	values[5] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(plmono_profile_self_time(node)));
+	values[6] = Int64GetDatum(node->allocations);
+	values[7] = Int64GetDatum(node->allocated_bytes);
+
+	tuplestore_putvalues(output->tupstore, output->tupdesc, values, nulls);
+}
+
+/*
+ * plmono_profile_functions
+ *
+ *     List nodes of call trees of profiled functions. Roots have empty stacks
+ *     and account for time of the functions outside managed methods
+ */
+Datum
+plmono_profile_functions(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo*) fcinfo->resultinfo;
+	PLMonoProfileOutput output;
+	TupleDesc tupdesc;
+	MemoryContext per_query_ctx, oldcontext;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	output.tupdesc = CreateTupleDescCopy(tupdesc);
+	output.tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = output.tupstore;
+	rsinfo->setDesc = output.tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	plmono_profile_walk_all(plmono_profile_put_node, &output);
+
+	tuplestore_donestoring(output.tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * plmono_profile_write_node
+ *
+ *     Write line of node to collapsed stack file: stack prefixed with name of
+ *     the function, and self time in microseconds as the weight
+ */
+static void
+plmono_profile_write_node(PLMonoProfileNode *node, StringInfo stack, int depth, void *arg)
+{
+	FILE *file = (FILE*) arg;
+	char *fn_name = get_func_name(node->fn_oid);
+	instr_time self = plmono_profile_self_time(node);
+
+	fprintf(file, "%s%s%s " INT64_FORMAT "\n",
+			fn_name ? fn_name : "?", stack->len > 0 ? ";" : "", stack->data,
+			(int64) INSTR_TIME_GET_MICROSEC(self));
+
+	if (fn_name)
+		pfree(fn_name);
+}
+
+/*
+ * plmono_profile_dump
+ *
+ *     Write call trees into a file of the data directory in collapsed stack
+ *     format, as read by flame graph tools. Returns path of the file
+ */
+Datum
+plmono_profile_dump(PG_FUNCTION_ARGS)
+{
+	char path[MAXPGPATH];
+	char *filename;
+	FILE *file;
+
+	if (!superuser())
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser to dump profile")));
+
+	if (PG_ARGISNULL(0))
+		snprintf(path, MAXPGPATH, "%s/plmono_profile.%d.folded", DataDir, MyProcPid);
+	else
+	{
+		filename = text_to_cstring(PG_GETARG_TEXT_PP(0));
+		if (first_dir_separator(filename))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("profile must be written into the data directory")));
+		snprintf(path, MAXPGPATH, "%s/%s", DataDir, filename);
+	}
+
+	if (!(file = AllocateFile(path, "w")))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("Could not open file %s: %m", path)));
+
+	plmono_profile_walk_all(plmono_profile_write_node, file);
+
+	if (FreeFile(file))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("Could not write file %s: %m", path)));
+
+	PG_RETURN_TEXT_P(cstring_to_text(path));
+}
+
+/*
+ * plmono_profile_reset
+ *
+ *     Discard call trees recorded so far, unless called by a function being
+ *     profiled, whose tree is still being recorded
+ */
+Datum
+plmono_profile_reset(PG_FUNCTION_ARGS)
+{
+	if (profile_roots && !profile_current)
+		g_hash_table_remove_all(profile_roots);
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,31 @@
+#ifndef _PLMONO_PROFILE_H
+#define _PLMONO_PROFILE_H
+
+#include "portability/instr_time.h"
+
+/*
+ * Node of call tree of managed methods, rooted at the SQL function calling
+ * them. Each node is the method called along one path from the root, so
+ * that the path of a node is a collapsed stack
+ */
+typedef struct PLMonoProfileNode
+{
+	MonoMethod *method;                    /* method, NULL for roots */
+	Oid fn_oid;                            /* function the tree belongs to */
+	struct PLMonoProfileNode *parent;      /* caller, NULL for roots */
+	GHashTable *children;                  /* callees, keyed by method */
+	int64 calls;                           /* number of calls */
+	instr_time total;                      /* time in calls */
+	instr_time start;                      /* when the call in progress began */
+	int64 allocations;                     /* objects allocated by the method */
+	int64 allocated_bytes;                 /* and their size */
+} PLMonoProfileNode;
+
+extern bool plmono_profile_instrument;
+extern bool plmono_profile;
+
+void plmono_profile_install(void);
+PLMonoProfileNode* plmono_profile_push(Oid fn_oid);
+void plmono_profile_pop(PLMonoProfileNode *prev);
+
+#endif
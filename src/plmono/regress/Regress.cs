@@ -0,0 +1,124 @@
+using System;
+using System.Collections;
+
+namespace PLMonoRegress
+{
+	public class Point
+	{
+		public int X;
+		public int Y;
+	}
+
+	public static class Functions
+	{
+		public static int Add(int a, int b)
+		{
+			return a + b;
+		}
+
+		public static int? IncNullable(int? x)
+		{
+			return x.HasValue ? x + 1 : null;
+		}
+
+		public static string Upper(string s)
+		{
+			return s == null ? null : s.ToUpperInvariant();
+		}
+
+		public static int Explode(int x)
+		{
+			throw new InvalidOperationException("called with " + x);
+		}
+
+		public static void MinMax(int a, int b, out int min, out int max)
+		{
+			min = Math.Min(a, b);
+			max = Math.Max(a, b);
+		}
+
+		public static void Double(int a, out int doubled)
+		{
+			doubled = a * 2;
+		}
+
+		public static Point MakePoint(int x, int y)
+		{
+			Point p = new Point();
+
+			p.X = x;
+			p.Y = y;
+			return p;
+		}
+
+		public static Point NullPoint()
+		{
+			return null;
+		}
+
+		public static int SumPoint(Point p)
+		{
+			return p.X + p.Y;
+		}
+
+		public static IEnumerable Series(int start, int finish)
+		{
+			for (int i = start; i <= finish; i++)
+				yield return i;
+		}
+
+		public static IEnumerable SeriesWithNull()
+		{
+			yield return 1;
+			yield return null;
+			yield return 3;
+		}
+
+		public static IEnumerable NullSet()
+		{
+			return null;
+		}
+
+		public static object NotASet()
+		{
+			return 42;
+		}
+
+		public static IEnumerable FailingSeries(int n)
+		{
+			for (int i = 1; i <= n; i++)
+				yield return i;
+
+			throw new InvalidOperationException("enumeration failed");
+		}
+
+		public static IEnumerable Pairs(int n)
+		{
+			for (int i = 1; i <= n; i++)
+				yield return new object[] {i, i * i};
+		}
+
+		public static IEnumerable BadPairs()
+		{
+			yield return new object[] {1};
+		}
+	}
+
+	public class Sum
+	{
+		private long sum;
+
+		public void Accumulate(int value)
+		{
+			if (value < 0)
+				throw new ArgumentOutOfRangeException("value");
+
+			sum += value;
+		}
+
+		public long Terminate()
+		{
+			return sum;
+		}
+	}
+}
@@ -0,0 +1,410 @@
+/*-------------------------------------------------------------------------
+ *
+ * row.c
+ *     rows of relations exposed to managed code as PLMono.TableRow
+ *
+ * Copyright (c) 2009, Olexandr Melnyk <me@omelnyk.net>
+ *
+ *------------------------------------------------------------------------- 
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "access/heapam.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+#include <mono/jit/jit.h>
+#include <mono/metadata/assembly.h>
+#include <mono/metadata/appdomain.h>
+#include <mono/metadata/exception.h>
+#include <mono/metadata/object.h>
+
+#include "core.h"
+#include "marshal.h"
+#include "spi.h"
+#include "row.h"
+
+/*
+ * Row layouts of relations, keyed by relation Oid
+ */
+static HTAB *relation_cache = NULL;
+
+/*
+ * Fields of PLMono.TableRow set when a row is bound to it
+ */
+static MonoClassField *tablerow_handle = NULL;
+static MonoClassField *tablerow_layout = NULL;
+
+/*
+ * plmono_relation_invalidate
+ *
+ *     Relcache callback marking layouts of changed relations as invalid
+ */
+static void
+plmono_relation_invalidate(Datum arg, Oid relid)
+{
+	HASH_SEQ_STATUS status;
+	PLMonoRelation *rel;
+
+	hash_seq_init(&status, relation_cache);
+	while ((rel = (PLMonoRelation*) hash_seq_search(&status)))
+		if (relid == InvalidOid || rel->relid == relid)
+			rel->valid = false;
+}
+
+/*
+ * plmono_relation_cache_init
+ *
+ *     Create relation layout cache and subscribe to relcache invalidations
+ */
+static void
+plmono_relation_cache_init(void)
+{
+	HASHCTL ctl;
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(PLMonoRelation);
+	ctl.hash = oid_hash;
+	ctl.hcxt = TopMemoryContext;
+
+	relation_cache = hash_create("PL/Mono relation cache", 32, &ctl,
+								 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+
+	CacheRegisterRelcacheCallback(plmono_relation_invalidate, (Datum) 0);
+}
+
+/*
+ * plmono_relation_build_layout
+ *
+ *     Create PLMono.RowLayout holding column names of the relation, so that
+ *     they are converted to managed strings only once
+ */
+static MonoObject*
+plmono_relation_build_layout(TupleDesc tupdesc)
+{
+	MonoDomain *domain = plmono_get_domain();
+	MonoClass *klass;
+	MonoMethod *ctor;
+	MonoArray *names;
+	MonoObject *layout, *exc = NULL;
+	gpointer args[1];
+	int i;
+
+	names = mono_array_new(domain, mono_get_string_class(), tupdesc->natts);
+	for (i = 0; i < tupdesc->natts; i++)
+	{
+		if (tupdesc->attrs[i]->attisdropped)
+			continue;
+
+		mono_array_setref(names, i, mono_string_new(domain, NameStr(tupdesc->attrs[i]->attname)));
+	}
+
+	klass = plmono_class_from_name(plmono_get_plmono_image(), "PLMono", "RowLayout");
+	ctor = mono_class_get_method_from_name(klass, ".ctor", 1);
+
+	layout = mono_object_new(domain, klass);
+	args[0] = names;
+	mono_runtime_invoke(ctor, layout, args, &exc);
+	if (exc)
+		plmono_report_exception(exc);
+
+	return layout;
+}
+
+/*
+ * plmono_relation_get
+ *
+ *     Get row layout of relation, building it on first use or after the
+ *     relation has changed
+ */
+PLMonoRelation*
+plmono_relation_get(Relation relation)
+{
+	PLMonoRelation *rel;
+	MemoryContext oldcxt;
+	TupleDesc tupdesc;
+	Oid relid = RelationGetRelid(relation);
+	bool found;
+	int i;
+
+	if (!relation_cache)
+		plmono_relation_cache_init();
+
+	rel = (PLMonoRelation*) hash_search(relation_cache, &relid, HASH_ENTER, &found);
+	if (found && rel->valid)
+		return rel;
+
+	if (found)
+	{
+		mono_gchandle_free(rel->layout);
+		MemoryContextDelete(rel->mcxt);
+	}
+
+	rel->valid = false;
+	rel->layout = 0;
+	rel->mcxt = AllocSetContextCreate(TopMemoryContext,
+									  "PL/Mono relation",
+									  ALLOCSET_SMALL_MINSIZE,
+									  ALLOCSET_SMALL_INITSIZE,
+									  ALLOCSET_SMALL_MAXSIZE);
+	oldcxt = MemoryContextSwitchTo(rel->mcxt);
+
+	tupdesc = rel->tupdesc = CreateTupleDescCopy(RelationGetDescr(relation));
+	rel->marshals = (const PLMonoTypeMarshal**) palloc0((tupdesc->natts + 1) * sizeof(PLMonoTypeMarshal*));
+
+	for (i = 0; i < tupdesc->natts; i++)
+		if (!tupdesc->attrs[i]->attisdropped)
+			rel->marshals[i] = plmono_marshal_find(tupdesc->attrs[i]->atttypid);
+
+	MemoryContextSwitchTo(oldcxt);
+
+	rel->layout = mono_gchandle_new(plmono_relation_build_layout(tupdesc), FALSE);
+	rel->valid = true;
+
+	return rel;
+}
+
+/*
+ * plmono_row_new
+ *
+ *     Create row of relation backed by the tuple, which may be NULL for an
+ *     empty row
+ */
+PLMonoRow*
+plmono_row_new(PLMonoRelation *rel, HeapTuple tuple)
+{
+	int natts = rel->tupdesc->natts;
+	PLMonoRow *row;
+
+	if (!(row = (PLMonoRow*) palloc(sizeof(PLMonoRow))))
+		elog(ERROR, "Not enough memory");
+
+	row->rel = rel;
+	row->mcxt = CurrentMemoryContext;
+	row->tuple = tuple;
+	row->values = (Datum*) palloc((natts + 1) * sizeof(Datum));
+	row->nulls = (bool*) palloc((natts + 1) * sizeof(bool));
+	row->decoded = (bool*) palloc((natts + 1) * sizeof(bool));
+	row->dirty = (bool*) palloc0((natts + 1) * sizeof(bool));
+	row->ndirty = 0;
+
+	MemSet(row->decoded, tuple == NULL, (natts + 1) * sizeof(bool));
+	MemSet(row->nulls, tuple == NULL, (natts + 1) * sizeof(bool));
+
+	return row;
+}
+
+/*
+ * plmono_row_reset
+ *
+ *     Make row backed by another tuple of the same relation, discarding
+ *     decoded and assigned values
+ */
+void
+plmono_row_reset(PLMonoRow *row, HeapTuple tuple)
+{
+	int natts = row->rel->tupdesc->natts;
+
+	row->tuple = tuple;
+	row->ndirty = 0;
+
+	MemSet(row->decoded, tuple == NULL, (natts + 1) * sizeof(bool));
+	MemSet(row->nulls, tuple == NULL, (natts + 1) * sizeof(bool));
+	MemSet(row->dirty, 0, (natts + 1) * sizeof(bool));
+}
+
+/*
+ * plmono_row_check_access
+ *
+ *     Raise managed exception unless the attribute of the row can be accessed
+ */
+static void
+plmono_row_check_access(PLMonoRow *row, gint32 index)
+{
+	if (!row)
+		mono_raise_exception(mono_get_exception_invalid_operation("Row is accessible only while trigger is executed"));
+
+	if (index < 0 || index >= row->rel->tupdesc->natts || row->rel->tupdesc->attrs[index]->attisdropped)
+		mono_raise_exception(mono_get_exception_index_out_of_range());
+
+	if (!row->rel->marshals[index])
+		mono_raise_exception(mono_get_exception_not_supported("Data type of the column is not supported by PL/Mono"));
+}
+
+/*
+ * plmono_row_get_value
+ *
+ *     Internal call PLMono.TableRow::GetValue: get value of row attribute,
+ *     decoding it from the tuple on first access. Detoasting and conversion
+ *     run in a subtransaction, so that their errors become managed exceptions
+ */
+static MonoObject*
+plmono_row_get_value(PLMonoRow *row, gint32 index)
+{
+	const PLMonoTypeMarshal *tm;
+	PLMonoSpiSubxact sx;
+	MonoException *exc = NULL;
+	PLMonoValue slot;
+	gpointer obj = NULL;
+
+	plmono_row_check_access(row, index);
+
+	tm = row->rel->marshals[index];
+
+	plmono_spi_subxact_begin(&sx);
+	PG_TRY();
+	{
+		if (!row->decoded[index])
+		{
+			row->values[index] = heap_getattr(row->tuple, index + 1, row->rel->tupdesc, &row->nulls[index]);
+			row->decoded[index] = true;
+		}
+
+		if (!row->nulls[index])
+			obj = tm->to_obj(row->values[index], &slot);
+
+		plmono_spi_subxact_commit(&sx);
+	}
+	PG_CATCH();
+	{
+		exc = plmono_spi_subxact_abort(&sx);
+	}
+	PG_END_TRY();
+
+	if (exc)
+		mono_raise_exception(exc);
+
+	if (row->nulls[index])
+		return NULL;
+
+	return tm->is_reference ? (MonoObject*) obj : mono_value_box(plmono_get_domain(), tm->get_class(), obj);
+}
+
+/*
+ * plmono_row_set_value
+ *
+ *     Internal call PLMono.TableRow::SetValue: assign value to row attribute
+ */
+static void
+plmono_row_set_value(PLMonoRow *row, gint32 index, MonoObject *value)
+{
+	const PLMonoTypeMarshal *tm;
+	PLMonoSpiSubxact sx;
+	MonoException *exc = NULL;
+	MemoryContext oldcxt;
+	Datum datum = (Datum) 0;
+
+	plmono_row_check_access(row, index);
+
+	tm = row->rel->marshals[index];
+	if (value && mono_object_get_class(value) != tm->get_class())
+		mono_raise_exception(mono_get_exception_argument("value", "Value type doesn't match column type"));
+
+	if (value)
+	{
+		plmono_spi_subxact_begin(&sx);
+		PG_TRY();
+		{
+			oldcxt = MemoryContextSwitchTo(row->mcxt);
+			datum = tm->to_datum(tm->is_reference ? (gpointer) value : mono_object_unbox(value));
+			MemoryContextSwitchTo(oldcxt);
+
+			plmono_spi_subxact_commit(&sx);
+		}
+		PG_CATCH();
+		{
+			exc = plmono_spi_subxact_abort(&sx);
+		}
+		PG_END_TRY();
+
+		if (exc)
+			mono_raise_exception(exc);
+	}
+
+	row->nulls[index] = (value == NULL);
+	row->values[index] = datum;
+	row->decoded[index] = true;
+
+	if (!row->dirty[index])
+	{
+		row->dirty[index] = true;
+		row->ndirty++;
+	}
+}
+
+/*
+ * plmono_row_is_modified
+ *
+ *     Internal call PLMono.TableRow::IsModified: check whether row attribute
+ *     has been assigned
+ */
+static MonoBoolean
+plmono_row_is_modified(PLMonoRow *row, gint32 index)
+{
+	plmono_row_check_access(row, index);
+
+	return row->dirty[index];
+}
+
+/*
+ * plmono_row_register_icalls
+ *
+ *     Register internal calls of PLMono.TableRow
+ */
+void
+plmono_row_register_icalls(void)
+{
+	mono_add_internal_call("PLMono.TableRow::GetValue", plmono_row_get_value);
+	mono_add_internal_call("PLMono.TableRow::SetValue", plmono_row_set_value);
+	mono_add_internal_call("PLMono.TableRow::IsModified", plmono_row_is_modified);
+}
+
+/*
+ * plmono_row_bind
+ *
+ *     Make PLMono.TableRow object expose the row, or detach it from any row
+ *     if row is NULL
+ */
+void
+plmono_row_bind(MonoObject *tablerow, PLMonoRow *row)
+{
+	MonoObject *layout;
+
+	if (!tablerow_handle)
+	{
+		MonoClass *klass = mono_object_get_class(tablerow);
+
+		tablerow_handle = mono_class_get_field_from_name(klass, "handle");
+		tablerow_layout = mono_class_get_field_from_name(klass, "layout");
+	}
+
+	mono_field_set_value(tablerow, tablerow_handle, &row);
+	if (row)
+	{
+		layout = mono_gchandle_get_target(row->rel->layout);
+		mono_field_set_value(tablerow, tablerow_layout, &layout);
+	}
+}
+
+/*
+ * plmono_row_build_tuple
+ *
+ *     Build tuple holding row values. The original tuple is returned as is if
+ *     no attributes have been assigned; otherwise only assigned ones are
+ *     replaced
+ */
+HeapTuple
+plmono_row_build_tuple(PLMonoRow *row)
+{
+	if (row->tuple && row->ndirty == 0)
+		return row->tuple;
+
+	if (row->tuple)
+		return heap_modify_tuple(row->tuple, row->rel->tupdesc, row->values, row->nulls, row->dirty);
+
+	return heap_form_tuple(row->rel->tupdesc, row->values, row->nulls);
+}
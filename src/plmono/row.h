@@ -0,0 +1,45 @@
+#ifndef _PLMONO_ROW_H
+#define _PLMONO_ROW_H
+
+#include "utils/rel.h"
+
+/*
+ * Layout of a relation's rows, shared by all rows of the relation
+ */
+typedef struct PLMonoRelation
+{
+	Oid relid;                             /* hash key, must be first */
+	bool valid;                            /* false once relation has changed */
+	MemoryContext mcxt;                    /* context holding the layout */
+	TupleDesc tupdesc;                     /* copy of relation's descriptor */
+	const PLMonoTypeMarshal **marshals;    /* conversions of attributes, NULL
+	                                        * for dropped and unsupported ones */
+	guint32 layout;                        /* GC handle of PLMono.RowLayout with
+	                                        * interned column names */
+} PLMonoRelation;
+
+/*
+ * Row exposed to managed code through PLMono.TableRow. Values are decoded
+ * from the original tuple on first access, and assigned ones are tracked, so
+ * that only they are replaced when the result tuple is built
+ */
+typedef struct PLMonoRow
+{
+	PLMonoRelation *rel;                   /* layout of the row */
+	MemoryContext mcxt;                    /* context of assigned values */
+	HeapTuple tuple;                       /* original tuple, or NULL */
+	Datum *values;                         /* decoded or assigned values */
+	bool *nulls;                           /* null flags of the above */
+	bool *decoded;                         /* value has been decoded or set */
+	bool *dirty;                           /* value has been assigned */
+	int ndirty;                            /* number of assigned values */
+} PLMonoRow;
+
+void plmono_row_register_icalls(void);
+PLMonoRelation* plmono_relation_get(Relation relation);
+PLMonoRow* plmono_row_new(PLMonoRelation *rel, HeapTuple tuple);
+void plmono_row_reset(PLMonoRow *row, HeapTuple tuple);
+void plmono_row_bind(MonoObject *tablerow, PLMonoRow *row);
+HeapTuple plmono_row_build_tuple(PLMonoRow *row);
+
+#endif
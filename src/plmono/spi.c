@@ -0,0 +1,1065 @@
+/*-------------------------------------------------------------------------
+ *
+ * spi.c
+ *     queries run from managed code through PLMono.Spi, PLMono.SpiPlan and
+ *     PLMono.SpiCursor
+ *
+ * Copyright (c) 2009, Olexandr Melnyk <me@omelnyk.net>
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/heapam.h"
+#include "access/xact.h"
+#include "executor/spi.h"
+#include "parser/parse_type.h"
+#include "utils/memutils.h"
+#include "utils/resowner.h"
+
+#include <mono/jit/jit.h>
+#include <mono/metadata/assembly.h>
+#include <mono/metadata/appdomain.h>
+#include <mono/metadata/exception.h>
+#include <mono/metadata/object.h>
+
+#include "core.h"
+#include "assembly.h"
+#include "marshal.h"
+#include "cache.h"
+#include "spi.h"
+
+/*
+ * Cursors double their batch after each fetch, up to this many rows, so that
+ * long scans need few fetches, each run in its own subtransaction
+ */
+#define PLMONO_SPI_MAX_BATCH 10000
+
+/*
+ * Prepared plan, saved for the lifetime of the backend and shared by all
+ * descriptors of the function which prepared it, so that SpiPlan objects
+ * kept by managed code outlive redefinition of the function
+ */
+typedef struct PLMonoSpiPlan
+{
+	SPIPlanPtr plan;                       /* saved plan */
+	int nargs;                             /* number of parameters */
+	Oid *argtypes;                         /* parameter types */
+	const PLMonoTypeMarshal **marshals;    /* conversions of parameters */
+} PLMonoSpiPlan;
+
+/*
+ * Cursor exposed to managed code through PLMono.SpiCursor. Rows are fetched
+ * in batches, and values of the current row are decoded on access
+ */
+typedef struct PLMonoSpiCursor
+{
+	Portal portal;                         /* portal of the cursor */
+	PLMonoSpiFrame *frame;                 /* call which opened the cursor */
+	guint32 owner;                         /* weak GC handle of SpiCursor */
+	int batch;                             /* rows fetched at once, grows up
+	                                        * to PLMONO_SPI_MAX_BATCH */
+	SPITupleTable *tuptable;               /* current batch, or NULL */
+	int nrows;                             /* rows in current batch */
+	int pos;                               /* current row in batch */
+	bool done;                             /* no more rows to fetch */
+	HeapTuple tuple;                       /* current row, or NULL */
+	TupleDesc tupdesc;                     /* descriptor of rows */
+	const PLMonoTypeMarshal **marshals;    /* conversions of columns, NULL for
+	                                        * unsupported ones */
+} PLMonoSpiCursor;
+
+/*
+ * Managed object exposing memory of a call, whose handle field is cleared
+ * when the call returns
+ */
+typedef struct PLMonoSpiTracked
+{
+	guint32 owner;                         /* weak GC handle of the object */
+	MonoClassField *handle;                /* IntPtr field to clear */
+} PLMonoSpiTracked;
+
+/*
+ * Innermost PL/Mono call in progress
+ */
+static PLMonoSpiFrame *spi_frame = NULL;
+
+/*
+ * Fields of managed classes set by this module
+ */
+static MonoClassField *spicursor_handle = NULL;
+static MonoClassField *spiexception_sqlstate = NULL;
+
+/*
+ * Context of prepared plans
+ */
+static MemoryContext spi_plan_mcxt = NULL;
+
+/*
+ * plmono_spi_push
+ *
+ *     Make the frame describe the innermost call in progress
+ */
+void
+plmono_spi_push(PLMonoSpiFrame *frame, PLMonoFunction *desc)
+{
+	frame->desc = desc;
+	frame->mcxt = CurrentMemoryContext;
+	frame->connected = false;
+	frame->cursors = NIL;
+	frame->tracked = NIL;
+	frame->prev = spi_frame;
+
+	spi_frame = frame;
+}
+
+/*
+ * plmono_spi_detach
+ *
+ *     Clear handle of the managed cursor, so that using it afterwards raises
+ *     ObjectDisposedException instead of touching freed memory
+ */
+static void
+plmono_spi_detach(PLMonoSpiCursor *cursor)
+{
+	MonoObject *obj = mono_gchandle_get_target(cursor->owner);
+	gpointer handle = NULL;
+
+	if (obj)
+		mono_field_set_value(obj, spicursor_handle, &handle);
+
+	mono_gchandle_free(cursor->owner);
+	cursor->owner = 0;
+}
+
+/*
+ * plmono_spi_pop
+ *
+ *     Release cursors and SPI connection of the innermost call. On error
+ *     portals and SPI are cleaned up by transaction abort, so only managed
+ *     cursors are detached
+ */
+void
+plmono_spi_pop(PLMonoSpiFrame *frame, bool error)
+{
+	MemoryContext oldcxt;
+	ListCell *lc;
+
+	spi_frame = frame->prev;
+
+	foreach(lc, frame->cursors)
+	{
+		PLMonoSpiCursor *cursor = (PLMonoSpiCursor*) lfirst(lc);
+
+		plmono_spi_detach(cursor);
+		if (!error)
+			SPI_cursor_close(cursor->portal);
+	}
+
+	foreach(lc, frame->tracked)
+	{
+		PLMonoSpiTracked *tracked = (PLMonoSpiTracked*) lfirst(lc);
+		MonoObject *obj = mono_gchandle_get_target(tracked->owner);
+		gpointer handle = NULL;
+
+		if (obj)
+			mono_field_set_value(obj, tracked->handle, &handle);
+		mono_gchandle_free(tracked->owner);
+	}
+
+	if (frame->connected && !error)
+	{
+		oldcxt = CurrentMemoryContext;
+		if (SPI_finish() != SPI_OK_FINISH)
+			elog(ERROR, "SPI_finish failed");
+		MemoryContextSwitchTo(oldcxt);
+	}
+}
+
+/*
+ * plmono_spi_track
+ *
+ *     Have IntPtr field of the object cleared when the innermost call returns,
+ *     as it points to memory of the call
+ */
+void
+plmono_spi_track(MonoObject *obj, MonoClassField *handle)
+{
+	MemoryContext oldcxt;
+	PLMonoSpiTracked *tracked;
+
+	if (!spi_frame)
+		return;
+
+	oldcxt = MemoryContextSwitchTo(spi_frame->mcxt);
+
+	tracked = (PLMonoSpiTracked*) palloc(sizeof(PLMonoSpiTracked));
+	tracked->owner = mono_gchandle_new_weakref(obj, FALSE);
+	tracked->handle = handle;
+	spi_frame->tracked = lappend(spi_frame->tracked, tracked);
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * plmono_spi_connect
+ *
+ *     Connect to SPI on behalf of the innermost call, unless already done
+ */
+static void
+plmono_spi_connect(void)
+{
+	MemoryContext oldcxt;
+
+	if (!spi_frame)
+		mono_raise_exception(mono_get_exception_invalid_operation("Queries can be run only while a PL/Mono function is executed"));
+
+	if (spi_frame->connected)
+		return;
+
+	/*
+     * SPI_connect switches to its own context, values of the call must stay
+     * in the caller's one
+     */
+	oldcxt = CurrentMemoryContext;
+	if (SPI_connect() != SPI_OK_CONNECT)
+		mono_raise_exception(mono_get_exception_invalid_operation("Could not connect to SPI manager"));
+	MemoryContextSwitchTo(oldcxt);
+
+	spi_frame->connected = true;
+}
+
+/*
+ * plmono_spi_subxact_begin
+ *
+ *     Start subtransaction, so that an error raised by the query, or by other
+ *     work of an internal call, can be turned into a managed exception
+ */
+void
+plmono_spi_subxact_begin(PLMonoSpiSubxact *sx)
+{
+	sx->mcxt = CurrentMemoryContext;
+	sx->owner = CurrentResourceOwner;
+
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(sx->mcxt);
+}
+
+/*
+ * plmono_spi_subxact_commit
+ *
+ *     Commit subtransaction of a successful query
+ */
+void
+plmono_spi_subxact_commit(PLMonoSpiSubxact *sx)
+{
+	ReleaseCurrentSubTransaction();
+	MemoryContextSwitchTo(sx->mcxt);
+	CurrentResourceOwner = sx->owner;
+
+#if PG_VERSION_NUM < 100000
+	SPI_restore_connection();
+#endif
+}
+
+/*
+ * plmono_spi_subxact_abort
+ *
+ *     Roll back subtransaction of a failed query and build PLMono.SpiException
+ *     describing the error. Must be called from PG_CATCH; the exception is to
+ *     be raised after PG_END_TRY
+ */
+MonoException*
+plmono_spi_subxact_abort(PLMonoSpiSubxact *sx)
+{
+	ErrorData *edata;
+	MonoException *exc;
+	MonoString *sqlstate;
+
+	MemoryContextSwitchTo(sx->mcxt);
+	edata = CopyErrorData();
+	FlushErrorState();
+
+	RollbackAndReleaseCurrentSubTransaction();
+	MemoryContextSwitchTo(sx->mcxt);
+	CurrentResourceOwner = sx->owner;
+
+#if PG_VERSION_NUM < 100000
+	SPI_restore_connection();
+#endif
+
+	exc = mono_exception_from_name_msg(plmono_get_plmono_image(), "PLMono", "SpiException", edata->message);
+
+	if (!spiexception_sqlstate)
+		spiexception_sqlstate = mono_class_get_field_from_name(mono_object_get_class((MonoObject*) exc), "sqlState");
+
+	sqlstate = mono_string_new(plmono_get_domain(), unpack_sql_state(edata->sqlerrcode));
+	mono_field_set_value((MonoObject*) exc, spiexception_sqlstate, &sqlstate);
+
+	FreeErrorData(edata);
+
+	return exc;
+}
+
+/*
+ * plmono_spi_string
+ *
+ *     Copy managed string into palloc'd memory
+ */
+static char*
+plmono_spi_string(MonoString *str)
+{
+	char *utf8, *result;
+
+	if (!str)
+		mono_raise_exception(mono_get_exception_argument_null("query"));
+
+	utf8 = mono_string_to_utf8(str);
+	result = pstrdup(utf8);
+	g_free(utf8);
+
+	return result;
+}
+
+/*
+ * plmono_spi_check_result
+ *
+ *     Raise error unless SPI function has succeeded
+ */
+static void
+plmono_spi_check_result(int rc, const char *what)
+{
+	if (rc < 0)
+		elog(ERROR, "%s failed: %s", what, SPI_result_code_string(rc));
+}
+
+/*
+ * plmono_spi_bind
+ *
+ *     Convert managed parameters of the plan into Datums
+ */
+static void
+plmono_spi_bind(PLMonoSpiPlan *plan, MonoArray *args, Datum *values, char *nulls)
+{
+	int nargs = args ? mono_array_length(args) : 0;
+	int i;
+
+	if (nargs != plan->nargs)
+		mono_raise_exception(mono_get_exception_argument("args", "Number of arguments doesn't match the plan"));
+
+	for (i = 0; i < nargs; i++)
+	{
+		const PLMonoTypeMarshal *tm = plan->marshals[i];
+		MonoObject *value = mono_array_get(args, MonoObject*, i);
+
+		if (!value)
+		{
+			values[i] = (Datum) 0;
+			nulls[i] = 'n';
+			continue;
+		}
+
+		if (mono_object_get_class(value) != tm->get_class())
+			mono_raise_exception(mono_get_exception_argument("args", "Argument type doesn't match parameter type"));
+
+		values[i] = tm->to_datum(tm->is_reference ? (gpointer) value : mono_object_unbox(value));
+		nulls[i] = ' ';
+	}
+}
+
+/*
+ * plmono_spi_execute
+ *
+ *     Internal call PLMono.Spi::ExecuteQuery: run query, returning the number
+ *     of rows processed
+ */
+static gint32
+plmono_spi_execute(MonoString *query, gint32 limit)
+{
+	PLMonoSpiSubxact sx;
+	MonoException *exc = NULL;
+	char *src = plmono_spi_string(query);
+	gint32 processed = 0;
+
+	plmono_spi_connect();
+
+	plmono_spi_subxact_begin(&sx);
+	PG_TRY();
+	{
+		plmono_spi_check_result(SPI_execute(src, false, limit), "SPI_execute");
+		processed = SPI_processed;
+		SPI_freetuptable(SPI_tuptable);
+
+		plmono_spi_subxact_commit(&sx);
+	}
+	PG_CATCH();
+	{
+		exc = plmono_spi_subxact_abort(&sx);
+	}
+	PG_END_TRY();
+
+	pfree(src);
+
+	if (exc)
+		mono_raise_exception(exc);
+
+	return processed;
+}
+
+/*
+ * plmono_spi_prepare
+ *
+ *     Internal call PLMono.Spi::PrepareQuery: prepare query taking parameters
+ *     of given types. Plans are cached per function, so preparing the same
+ *     query again is a hash lookup
+ */
+static PLMonoSpiPlan*
+plmono_spi_prepare(MonoString *query, MonoArray *argtypes)
+{
+	PLMonoFunction *desc;
+	PLMonoSpiPlan *plan;
+	PLMonoSpiSubxact sx;
+	MonoException *exc = NULL;
+	SPIPlanPtr volatile tmp = NULL;
+	MemoryContext oldcxt;
+	StringInfoData key;
+	char *src, **typenames;
+	int nargs = argtypes ? mono_array_length(argtypes) : 0;
+	int i;
+
+	plmono_spi_connect();
+	desc = spi_frame->desc;
+
+	/*
+     * Plans are keyed by query text followed by parameter type names
+     */
+	src = plmono_spi_string(query);
+	initStringInfo(&key);
+	appendStringInfoString(&key, src);
+
+	typenames = (char**) palloc((nargs + 1) * sizeof(char*));
+	for (i = 0; i < nargs; i++)
+	{
+		typenames[i] = plmono_spi_string(mono_array_get(argtypes, MonoString*, i));
+		appendStringInfo(&key, "\n%s", typenames[i]);
+	}
+
+	if ((plan = (PLMonoSpiPlan*) g_hash_table_lookup(desc->plans, key.data)))
+	{
+		pfree(key.data);
+		return plan;
+	}
+
+	if (!spi_plan_mcxt)
+		spi_plan_mcxt = AllocSetContextCreate(TopMemoryContext,
+											  "PL/Mono SPI plans",
+											  ALLOCSET_SMALL_MINSIZE,
+											  ALLOCSET_SMALL_INITSIZE,
+											  ALLOCSET_SMALL_MAXSIZE);
+
+	oldcxt = MemoryContextSwitchTo(spi_plan_mcxt);
+	plan = (PLMonoSpiPlan*) palloc0(sizeof(PLMonoSpiPlan));
+	plan->nargs = nargs;
+	plan->argtypes = (Oid*) palloc((nargs + 1) * sizeof(Oid));
+	plan->marshals = (const PLMonoTypeMarshal**) palloc0((nargs + 1) * sizeof(PLMonoTypeMarshal*));
+	MemoryContextSwitchTo(oldcxt);
+
+	plmono_spi_subxact_begin(&sx);
+	PG_TRY();
+	{
+		int32 typmod;
+
+		for (i = 0; i < nargs; i++)
+		{
+#if PG_VERSION_NUM >= 90400
+			parseTypeString(typenames[i], &plan->argtypes[i], &typmod, false);
+#else
+			parseTypeString(typenames[i], &plan->argtypes[i], &typmod);
+#endif
+			plan->marshals[i] = plmono_marshal_lookup(plan->argtypes[i]);
+		}
+
+		if (!(tmp = SPI_prepare(src, nargs, plan->argtypes)))
+			elog(ERROR, "SPI_prepare failed: %s", SPI_result_code_string(SPI_result));
+
+		if (!(plan->plan = SPI_saveplan(tmp)))
+			elog(ERROR, "SPI_saveplan failed: %s", SPI_result_code_string(SPI_result));
+		SPI_freeplan(tmp);
+		tmp = NULL;
+
+		plmono_spi_subxact_commit(&sx);
+	}
+	PG_CATCH();
+	{
+		exc = plmono_spi_subxact_abort(&sx);
+	}
+	PG_END_TRY();
+
+	if (exc)
+	{
+		/*
+         * Unsaved plan lives in the SPI connection, which outlives the
+         * subtransaction
+         */
+		if (tmp)
+			SPI_freeplan(tmp);
+
+		pfree(plan->argtypes);
+		pfree(plan->marshals);
+		pfree(plan);
+		pfree(key.data);
+
+		mono_raise_exception(exc);
+	}
+
+	g_hash_table_insert(desc->plans, g_strdup(key.data), plan);
+	pfree(key.data);
+
+	return plan;
+}
+
+/*
+ * plmono_spi_execute_plan
+ *
+ *     Internal call PLMono.SpiPlan::ExecutePlan: run prepared plan, returning
+ *     the number of rows processed
+ */
+static gint32
+plmono_spi_execute_plan(PLMonoSpiPlan *plan, MonoArray *args, gint32 limit)
+{
+	PLMonoSpiSubxact sx;
+	MonoException *exc = NULL;
+	Datum *values;
+	char *nulls;
+	gint32 processed = 0;
+
+	if (!plan)
+		mono_raise_exception(mono_get_exception_argument_null("plan"));
+
+	plmono_spi_connect();
+
+	values = (Datum*) palloc((plan->nargs + 1) * sizeof(Datum));
+	nulls = (char*) palloc((plan->nargs + 1) * sizeof(char));
+	plmono_spi_bind(plan, args, values, nulls);
+
+	plmono_spi_subxact_begin(&sx);
+	PG_TRY();
+	{
+		plmono_spi_check_result(SPI_execute_plan(plan->plan, values, nulls, false, limit), "SPI_execute_plan");
+		processed = SPI_processed;
+		SPI_freetuptable(SPI_tuptable);
+
+		plmono_spi_subxact_commit(&sx);
+	}
+	PG_CATCH();
+	{
+		exc = plmono_spi_subxact_abort(&sx);
+	}
+	PG_END_TRY();
+
+	pfree(values);
+	pfree(nulls);
+
+	if (exc)
+		mono_raise_exception(exc);
+
+	return processed;
+}
+
+/*
+ * plmono_spi_cursor_new
+ *
+ *     Register cursor on the portal with the innermost call and the managed
+ *     object exposing it
+ */
+static PLMonoSpiCursor*
+plmono_spi_cursor_new(MonoObject *owner, Portal portal, gint32 batch)
+{
+	MemoryContext oldcxt;
+	PLMonoSpiCursor *cursor;
+
+	if (!spicursor_handle)
+		spicursor_handle = mono_class_get_field_from_name(mono_object_get_class(owner), "handle");
+
+	oldcxt = MemoryContextSwitchTo(spi_frame->mcxt);
+
+	cursor = (PLMonoSpiCursor*) palloc0(sizeof(PLMonoSpiCursor));
+	cursor->portal = portal;
+	cursor->frame = spi_frame;
+	cursor->owner = mono_gchandle_new_weakref(owner, FALSE);
+	cursor->batch = batch > 0 ? batch : 1;
+
+	spi_frame->cursors = lappend(spi_frame->cursors, cursor);
+
+	MemoryContextSwitchTo(oldcxt);
+
+	return cursor;
+}
+
+/*
+ * plmono_spi_open_query
+ *
+ *     Internal call PLMono.SpiCursor::OpenQuery: open cursor on query
+ */
+static PLMonoSpiCursor*
+plmono_spi_open_query(MonoObject *owner, MonoString *query, gint32 batch)
+{
+	PLMonoSpiSubxact sx;
+	MonoException *exc = NULL;
+	char *src = plmono_spi_string(query);
+	Portal portal = NULL;
+
+	plmono_spi_connect();
+
+	plmono_spi_subxact_begin(&sx);
+	PG_TRY();
+	{
+		if (!(portal = SPI_cursor_open_with_args(NULL, src, 0, NULL, NULL, NULL, false, 0)))
+			elog(ERROR, "SPI_cursor_open_with_args failed: %s", SPI_result_code_string(SPI_result));
+
+		plmono_spi_subxact_commit(&sx);
+	}
+	PG_CATCH();
+	{
+		exc = plmono_spi_subxact_abort(&sx);
+	}
+	PG_END_TRY();
+
+	pfree(src);
+
+	if (exc)
+		mono_raise_exception(exc);
+
+	return plmono_spi_cursor_new(owner, portal, batch);
+}
+
+/*
+ * plmono_spi_open_plan
+ *
+ *     Internal call PLMono.SpiCursor::OpenPlan: open cursor on prepared plan
+ */
+static PLMonoSpiCursor*
+plmono_spi_open_plan(MonoObject *owner, PLMonoSpiPlan *plan, MonoArray *args, gint32 batch)
+{
+	PLMonoSpiSubxact sx;
+	MonoException *exc = NULL;
+	Portal portal = NULL;
+	Datum *values;
+	char *nulls;
+
+	if (!plan)
+		mono_raise_exception(mono_get_exception_argument_null("plan"));
+
+	plmono_spi_connect();
+
+	values = (Datum*) palloc((plan->nargs + 1) * sizeof(Datum));
+	nulls = (char*) palloc((plan->nargs + 1) * sizeof(char));
+	plmono_spi_bind(plan, args, values, nulls);
+
+	plmono_spi_subxact_begin(&sx);
+	PG_TRY();
+	{
+		if (!(portal = SPI_cursor_open(NULL, plan->plan, values, nulls, false)))
+			elog(ERROR, "SPI_cursor_open failed: %s", SPI_result_code_string(SPI_result));
+
+		plmono_spi_subxact_commit(&sx);
+	}
+	PG_CATCH();
+	{
+		exc = plmono_spi_subxact_abort(&sx);
+	}
+	PG_END_TRY();
+
+	pfree(values);
+	pfree(nulls);
+
+	if (exc)
+		mono_raise_exception(exc);
+
+	return plmono_spi_cursor_new(owner, portal, batch);
+}
+
+/*
+ * plmono_spi_check_cursor
+ *
+ *     Raise managed exception unless the cursor is open and used by the call
+ *     which opened it, as batches are fetched into its SPI connection
+ */
+static void
+plmono_spi_check_cursor(PLMonoSpiCursor *cursor)
+{
+	if (!cursor)
+		mono_raise_exception(mono_get_exception_invalid_operation("Cursor is closed"));
+
+	if (cursor->frame != spi_frame)
+		mono_raise_exception(mono_get_exception_invalid_operation("Cursor can be used only by the call which opened it"));
+}
+
+/*
+ * plmono_spi_fetch
+ *
+ *     Replace current batch of the cursor with the next one
+ */
+static void
+plmono_spi_fetch(PLMonoSpiCursor *cursor)
+{
+	PLMonoSpiSubxact sx;
+	MonoException *exc = NULL;
+	MemoryContext oldcxt;
+	int i;
+
+	if (cursor->tuptable)
+	{
+		SPI_freetuptable(cursor->tuptable);
+		cursor->tuptable = NULL;
+	}
+
+	plmono_spi_subxact_begin(&sx);
+	PG_TRY();
+	{
+		SPI_cursor_fetch(cursor->portal, true, cursor->batch);
+		cursor->tuptable = SPI_tuptable;
+		cursor->nrows = SPI_processed;
+		cursor->pos = 0;
+		cursor->done = (cursor->nrows < cursor->batch);
+
+		plmono_spi_subxact_commit(&sx);
+
+		if (cursor->batch < PLMONO_SPI_MAX_BATCH)
+			cursor->batch = Min(cursor->batch * 2, PLMONO_SPI_MAX_BATCH);
+	}
+	PG_CATCH();
+	{
+		exc = plmono_spi_subxact_abort(&sx);
+	}
+	PG_END_TRY();
+
+	if (exc)
+	{
+		cursor->done = true;
+		cursor->nrows = 0;
+		mono_raise_exception(exc);
+	}
+
+	/*
+     * Column conversions are looked up once per cursor
+     */
+	if (!cursor->tupdesc && cursor->tuptable)
+	{
+		TupleDesc tupdesc = cursor->tuptable->tupdesc;
+
+		oldcxt = MemoryContextSwitchTo(cursor->frame->mcxt);
+		cursor->tupdesc = CreateTupleDescCopy(tupdesc);
+		cursor->marshals = (const PLMonoTypeMarshal**) palloc0((tupdesc->natts + 1) * sizeof(PLMonoTypeMarshal*));
+		MemoryContextSwitchTo(oldcxt);
+
+		for (i = 0; i < tupdesc->natts; i++)
+			if (!tupdesc->attrs[i]->attisdropped)
+				cursor->marshals[i] = plmono_marshal_find(tupdesc->attrs[i]->atttypid);
+	}
+}
+
+/*
+ * plmono_spi_read
+ *
+ *     Internal call PLMono.SpiCursor::Read: advance to the next row, fetching
+ *     the next batch when the current one is exhausted
+ */
+static MonoBoolean
+plmono_spi_read(PLMonoSpiCursor *cursor)
+{
+	plmono_spi_check_cursor(cursor);
+
+	if (cursor->tuptable && cursor->pos + 1 < cursor->nrows)
+	{
+		cursor->tuple = cursor->tuptable->vals[++cursor->pos];
+		return TRUE;
+	}
+
+	cursor->tuple = NULL;
+	if (cursor->done)
+		return FALSE;
+
+	plmono_spi_fetch(cursor);
+	if (cursor->nrows == 0)
+	{
+		cursor->done = true;
+		return FALSE;
+	}
+
+	cursor->tuple = cursor->tuptable->vals[0];
+
+	return TRUE;
+}
+
+/*
+ * plmono_spi_close
+ *
+ *     Internal call PLMono.SpiCursor::Close: close cursor before the function
+ *     returns
+ */
+static void
+plmono_spi_close(PLMonoSpiCursor *cursor)
+{
+	plmono_spi_check_cursor(cursor);
+
+	cursor->frame->cursors = list_delete_ptr(cursor->frame->cursors, cursor);
+
+	plmono_spi_detach(cursor);
+	if (cursor->tuptable)
+		SPI_freetuptable(cursor->tuptable);
+	SPI_cursor_close(cursor->portal);
+	pfree(cursor);
+}
+
+/*
+ * plmono_spi_get_field_count
+ *
+ *     Internal call PLMono.SpiCursor::GetFieldCount
+ */
+static gint32
+plmono_spi_get_field_count(PLMonoSpiCursor *cursor)
+{
+	plmono_spi_check_cursor(cursor);
+
+	if (!cursor->tupdesc)
+		mono_raise_exception(mono_get_exception_invalid_operation("No row has been read yet"));
+
+	return cursor->tupdesc->natts;
+}
+
+/*
+ * plmono_spi_get_name
+ *
+ *     Internal call PLMono.SpiCursor::GetName: get name of result column
+ */
+static MonoString*
+plmono_spi_get_name(PLMonoSpiCursor *cursor, gint32 index)
+{
+	if (index < 0 || index >= plmono_spi_get_field_count(cursor))
+		mono_raise_exception(mono_get_exception_index_out_of_range());
+
+	return plmono_intern_string(NameStr(cursor->tupdesc->attrs[index]->attname));
+}
+
+/*
+ * plmono_spi_getattr
+ *
+ *     Get value of column of the current row
+ */
+static Datum
+plmono_spi_getattr(PLMonoSpiCursor *cursor, gint32 index, bool *isnull)
+{
+	plmono_spi_check_cursor(cursor);
+
+	if (!cursor->tuple)
+		mono_raise_exception(mono_get_exception_invalid_operation("No current row"));
+
+	if (index < 0 || index >= cursor->tupdesc->natts || cursor->tupdesc->attrs[index]->attisdropped)
+		mono_raise_exception(mono_get_exception_index_out_of_range());
+
+	return heap_getattr(cursor->tuple, index + 1, cursor->tupdesc, isnull);
+}
+
+/*
+ * plmono_spi_is_null
+ *
+ *     Internal call PLMono.SpiCursor::IsNull
+ */
+static MonoBoolean
+plmono_spi_is_null(PLMonoSpiCursor *cursor, gint32 index)
+{
+	bool isnull;
+
+	plmono_spi_getattr(cursor, index, &isnull);
+
+	return isnull;
+}
+
+/*
+ * plmono_spi_get_value
+ *
+ *     Internal call PLMono.SpiCursor::GetValue: get boxed value of column,
+ *     or null
+ */
+static MonoObject*
+plmono_spi_get_value(PLMonoSpiCursor *cursor, gint32 index)
+{
+	const PLMonoTypeMarshal *tm;
+	PLMonoSpiSubxact sx;
+	MonoException *exc = NULL;
+	PLMonoValue slot;
+	gpointer obj = NULL;
+	Datum val;
+	bool isnull;
+
+	val = plmono_spi_getattr(cursor, index, &isnull);
+	if (isnull)
+		return NULL;
+
+	if (!(tm = cursor->marshals[index]))
+		mono_raise_exception(mono_get_exception_not_supported("Data type of the column is not supported by PL/Mono"));
+
+	/*
+     * Detoasting the value may fail
+     */
+	plmono_spi_subxact_begin(&sx);
+	PG_TRY();
+	{
+		obj = tm->to_obj(val, &slot);
+
+		plmono_spi_subxact_commit(&sx);
+	}
+	PG_CATCH();
+	{
+		exc = plmono_spi_subxact_abort(&sx);
+	}
+	PG_END_TRY();
+
+	if (exc)
+		mono_raise_exception(exc);
+
+	return tm->is_reference ? (MonoObject*) obj : mono_value_box(plmono_get_domain(), tm->get_class(), obj);
+}
+
+/*
+ * plmono_spi_get_primitive
+ *
+ *     Decode column of the given primitive kind into the slot, without boxing
+ */
+static void
+plmono_spi_get_primitive(PLMonoSpiCursor *cursor, gint32 index, PLMonoValueKind kind, PLMonoValue *slot)
+{
+	const PLMonoTypeMarshal *tm;
+	Datum val;
+	bool isnull;
+
+	val = plmono_spi_getattr(cursor, index, &isnull);
+	if (isnull)
+		mono_raise_exception(mono_get_exception_invalid_operation("Column value is null"));
+
+	tm = cursor->marshals[index];
+	if (!tm || tm->kind != kind)
+		mono_raise_exception(mono_get_exception_invalid_cast());
+
+	tm->to_obj(val, slot);
+}
+
+/*
+ * plmono_spi_get_boolean, plmono_spi_get_int32, plmono_spi_get_int64,
+ * plmono_spi_get_double
+ *
+ *     Internal calls PLMono.SpiCursor::Get*: typed readers of columns
+ */
+static MonoBoolean
+plmono_spi_get_boolean(PLMonoSpiCursor *cursor, gint32 index)
+{
+	PLMonoValue slot;
+
+	plmono_spi_get_primitive(cursor, index, PLMONO_KIND_BOOL, &slot);
+
+	return slot.b;
+}
+
+static gint32
+plmono_spi_get_int32(PLMonoSpiCursor *cursor, gint32 index)
+{
+	PLMonoValue slot;
+
+	plmono_spi_get_primitive(cursor, index, PLMONO_KIND_INT32, &slot);
+
+	return slot.i;
+}
+
+static gint64
+plmono_spi_get_int64(PLMonoSpiCursor *cursor, gint32 index)
+{
+	PLMonoValue slot;
+
+	plmono_spi_get_primitive(cursor, index, PLMONO_KIND_INT64, &slot);
+
+	return slot.l;
+}
+
+static double
+plmono_spi_get_double(PLMonoSpiCursor *cursor, gint32 index)
+{
+	PLMonoValue slot;
+
+	plmono_spi_get_primitive(cursor, index, PLMONO_KIND_FLOAT8, &slot);
+
+	return slot.d;
+}
+
+/*
+ * plmono_spi_get_string
+ *
+ *     Internal call PLMono.SpiCursor::GetString: get text representation of
+ *     column of any type, or null
+ */
+static MonoString*
+plmono_spi_get_string(PLMonoSpiCursor *cursor, gint32 index)
+{
+	PLMonoSpiSubxact sx;
+	MonoException *exc = NULL;
+	MonoString *result;
+	bool isnull;
+	char *str = NULL;
+
+	plmono_spi_getattr(cursor, index, &isnull);
+	if (isnull)
+		return NULL;
+
+	/*
+     * Output function of the type may raise an error
+     */
+	plmono_spi_subxact_begin(&sx);
+	PG_TRY();
+	{
+		str = SPI_getvalue(cursor->tuple, cursor->tupdesc, index + 1);
+
+		plmono_spi_subxact_commit(&sx);
+	}
+	PG_CATCH();
+	{
+		exc = plmono_spi_subxact_abort(&sx);
+	}
+	PG_END_TRY();
+
+	if (exc)
+		mono_raise_exception(exc);
+
+	result = mono_string_new(plmono_get_domain(), str);
+	pfree(str);
+
+	return result;
+}
+
+/*
+ * plmono_spi_register_icalls
+ *
+ *     Register internal calls of PLMono.Spi, PLMono.SpiPlan and
+ *     PLMono.SpiCursor
+ */
+void
+plmono_spi_register_icalls(void)
+{
+	mono_add_internal_call("PLMono.Spi::ExecuteQuery", plmono_spi_execute);
+	mono_add_internal_call("PLMono.Spi::PrepareQuery", plmono_spi_prepare);
+	mono_add_internal_call("PLMono.SpiPlan::ExecutePlan", plmono_spi_execute_plan);
+	mono_add_internal_call("PLMono.SpiCursor::OpenQuery", plmono_spi_open_query);
+	mono_add_internal_call("PLMono.SpiCursor::OpenPlan", plmono_spi_open_plan);
+	mono_add_internal_call("PLMono.SpiCursor::Read", plmono_spi_read);
+	mono_add_internal_call("PLMono.SpiCursor::Close", plmono_spi_close);
+	mono_add_internal_call("PLMono.SpiCursor::GetFieldCount", plmono_spi_get_field_count);
+	mono_add_internal_call("PLMono.SpiCursor::GetName", plmono_spi_get_name);
+	mono_add_internal_call("PLMono.SpiCursor::IsNull", plmono_spi_is_null);
+	mono_add_internal_call("PLMono.SpiCursor::GetValue", plmono_spi_get_value);
+	mono_add_internal_call("PLMono.SpiCursor::GetBoolean", plmono_spi_get_boolean);
+	mono_add_internal_call("PLMono.SpiCursor::GetInt32", plmono_spi_get_int32);
+	mono_add_internal_call("PLMono.SpiCursor::GetInt64", plmono_spi_get_int64);
+	mono_add_internal_call("PLMono.SpiCursor::GetDouble", plmono_spi_get_double);
+	mono_add_internal_call("PLMono.SpiCursor::GetString", plmono_spi_get_string);
+}
@@ -0,0 +1,38 @@
+#ifndef _PLMONO_SPI_H
+#define _PLMONO_SPI_H
+
+#include "utils/resowner.h"
+
+/*
+ * SPI state of a PL/Mono function call in progress. Frames of nested calls
+ * form a stack; SPI is connected on the first query a call runs, and both
+ * the connection and cursors left open are released when the call returns
+ */
+typedef struct PLMonoSpiFrame
+{
+	struct PLMonoFunction *desc;           /* function being executed */
+	MemoryContext mcxt;                    /* context of the call */
+	bool connected;                        /* SPI_connect has been done */
+	List *cursors;                         /* cursors opened by the call */
+	List *tracked;                         /* objects to detach on return */
+	struct PLMonoSpiFrame *prev;           /* frame of enclosing call */
+} PLMonoSpiFrame;
+
+/*
+ * State saved around work run in its own subtransaction
+ */
+typedef struct PLMonoSpiSubxact
+{
+	MemoryContext mcxt;
+	ResourceOwner owner;
+} PLMonoSpiSubxact;
+
+void plmono_spi_register_icalls(void);
+void plmono_spi_push(PLMonoSpiFrame *frame, struct PLMonoFunction *desc);
+void plmono_spi_pop(PLMonoSpiFrame *frame, bool error);
+void plmono_spi_track(MonoObject *obj, MonoClassField *handle);
+void plmono_spi_subxact_begin(PLMonoSpiSubxact *sx);
+void plmono_spi_subxact_commit(PLMonoSpiSubxact *sx);
+MonoException* plmono_spi_subxact_abort(PLMonoSpiSubxact *sx);
+
+#endif
@@ -0,0 +1,23 @@
+--
+-- Aggregates with managed states
+--
+\set VERBOSITY terse
+
+CREATE TABLE regress_agg_input (g integer, v integer);
+INSERT INTO regress_agg_input VALUES (1, 1), (1, 2), (2, 10), (2, 20), (2, 30), (3, 100);
+
+SELECT regress_sum(v) FROM regress_agg_input;
+SELECT g, regress_sum(v) FROM regress_agg_input GROUP BY g ORDER BY g;
+SELECT g, regress_sum(v), regress_sum(v * 2) AS doubled FROM regress_agg_input GROUP BY g ORDER BY g;
+
+-- Empty input gets the result of a fresh state
+SELECT regress_sum(v) FROM regress_agg_input WHERE false;
+
+-- Errors
+SELECT regress_sum(v) FROM (VALUES (1), (-1)) AS t(v);
+SELECT regress_sum(v) FROM (VALUES (1), (NULL)) AS t(v);
+
+-- States left by failed queries don't affect later ones
+SELECT regress_sum(v) FROM regress_agg_input;
+
+DROP TABLE regress_agg_input;
@@ -0,0 +1,23 @@
+--
+-- OUT parameters and composite arguments and results
+--
+\set VERBOSITY terse
+
+-- Several OUT parameters form a row, a single one is returned as is
+SELECT * FROM regress_minmax(3, 1);
+SELECT regress_minmax(3, 1);
+SELECT regress_double(21);
+
+-- Composite results are formed from fields named after attributes
+SELECT * FROM regress_make_point(1, 2);
+SELECT (regress_make_point(1, 2)).y;
+SELECT regress_null_point() IS NULL AS isnull;
+
+-- Composite arguments are passed as objects of the method's class
+SELECT regress_sum_point(ROW(3, 4)::regress_point);
+SELECT regress_sum_point(regress_make_point(5, 6));
+
+-- Results declared as record take columns from the call site
+SELECT * FROM regress_make_record(7, 8) AS t(x integer, y integer);
+SELECT * FROM regress_make_record(9, 10) AS t(y integer, x integer);
+SELECT regress_make_record(1, 2);
@@ -0,0 +1,20 @@
+--
+-- NULL arguments and results
+--
+\set VERBOSITY terse
+
+-- Value types can't take NULL
+SELECT regress_add(1, 2);
+SELECT regress_add(1, NULL);
+
+-- Nullable<T> takes and returns NULL
+SELECT regress_inc_nullable(41);
+SELECT regress_inc_nullable(NULL) IS NULL AS isnull;
+
+-- References take and return null
+SELECT regress_upper('abc');
+SELECT regress_upper(NULL) IS NULL AS isnull;
+
+-- STRICT functions return NULL without calling the method
+SELECT regress_strict_explode(NULL) IS NULL AS isnull;
+SELECT regress_strict_explode(1);
@@ -0,0 +1,30 @@
+--
+-- Set-returning functions
+--
+\set VERBOSITY terse
+
+-- Sets are materialized when called in FROM, and returned one element per
+-- call in the target list
+SELECT * FROM regress_series(1, 3);
+SELECT regress_series(1, 3);
+SELECT * FROM regress_series(3, 1);
+SELECT regress_series_with_null() IS NULL AS isnull;
+
+-- Rows are enumerated as object arrays
+SELECT * FROM regress_pairs(3);
+SELECT * FROM regress_record_pairs(2) AS t(a integer, b integer);
+
+-- Errors
+SELECT * FROM regress_null_set();
+SELECT * FROM regress_not_a_set();
+SELECT * FROM regress_bad_pairs();
+SELECT * FROM regress_record_pairs(1);
+SELECT * FROM regress_failing_series(2);
+SELECT regress_failing_series(2);
+
+-- Enumerators left by failed calls don't affect later ones
+SELECT count(*) FROM regress_series(1, 1000);
+BEGIN;
+SELECT regress_failing_series(1);
+ROLLBACK;
+SELECT regress_series(1, 2);
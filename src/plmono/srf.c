@@ -0,0 +1,413 @@
+/*-------------------------------------------------------------------------
+ *
+ * srf.c
+ *     set-returning functions backed by IEnumerable methods
+ *
+ * Copyright (c) 2009, Olexandr Melnyk <me@omelnyk.net>
+ *
+ *------------------------------------------------------------------------- 
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "access/heapam.h"
+#include "access/xact.h"
+#include "executor/executor.h"
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
+
+#include <mono/jit/jit.h>
+#include <mono/metadata/assembly.h>
+#include <mono/metadata/appdomain.h>
+#include <mono/metadata/object.h>
+
+#include "core.h"
+#include "assembly.h"
+#include "marshal.h"
+#include "cache.h"
+#include "instance.h"
+#include "function.h"
+#include "srf.h"
+#include "stats.h"
+
+/*
+ * State of a set-returning function call in ValuePerCall mode. Descriptor of
+ * the function is not kept, as it may be replaced between calls; each call
+ * converts elements with the one it was given
+ */
+typedef struct PLMonoSrfState
+{
+	guint32 handle;                  /* GC handle keeping enumerator alive */
+	MonoMethod *move_next;           /* IEnumerator.MoveNext of enumerator */
+	MonoMethod *get_current;         /* IEnumerator.Current getter */
+} PLMonoSrfState;
+
+/*
+ * Handles of enumerators of ValuePerCall calls in progress. Expression context
+ * callbacks aren't called on abort, so handles left here are released when
+ * transaction ends
+ */
+static GHashTable *srf_handles = NULL;
+
+/*
+ * plmono_srf_get_interface
+ *
+ *     Get class of System.Collections interface
+ */
+static MonoClass*
+plmono_srf_get_interface(const char *name)
+{
+	return plmono_class_from_name(plmono_get_corlib_image(), "System.Collections", name);
+}
+
+/*
+ * plmono_srf_invoke
+ *
+ *     Get result of method invokation
+ */
+static MonoObject*
+plmono_srf_invoke(MonoMethod *method, MonoObject *obj, gpointer *args)
+{
+	MonoObject *result, *exc = NULL;
+
+	result = mono_runtime_invoke(method, obj, args, &exc);
+	if (exc)
+		plmono_report_exception(exc);
+
+	return result;
+}
+
+/*
+ * plmono_srf_start
+ *
+ *     Invoke function's method and get enumerator of its result, which may be
+ *     either IEnumerable or IEnumerator
+ */
+static MonoObject*
+plmono_srf_start(FunctionCallInfo fcinfo, PLMonoFunction *desc, PLMonoSrfState *state)
+{
+	MonoClass *enumerable, *enumerator;
+	MonoObject *result;
+	MonoMethod *method;
+
+	result = plmono_srf_invoke(desc->method, plmono_instance_get(desc), plmono_func_build_args(fcinfo, desc));
+	if (!result)
+		elog(ERROR, "Set-returning PL/Mono function returned null instead of IEnumerable");
+
+	enumerable = plmono_srf_get_interface("IEnumerable");
+	enumerator = plmono_srf_get_interface("IEnumerator");
+
+	if (mono_class_is_assignable_from(enumerable, mono_object_get_class(result)))
+	{
+		method = mono_class_get_method_from_name(enumerable, "GetEnumerator", 0);
+		method = mono_object_get_virtual_method(result, method);
+		result = plmono_srf_invoke(method, result, NULL);
+	}
+
+	if (!result || !mono_class_is_assignable_from(enumerator, mono_object_get_class(result)))
+		elog(ERROR, "Set-returning PL/Mono function must return IEnumerable or IEnumerator");
+
+	method = mono_class_get_method_from_name(enumerator, "MoveNext", 0);
+	state->move_next = mono_object_get_virtual_method(result, method);
+
+	method = mono_property_get_get_method(mono_class_get_property_from_name(enumerator, "Current"));
+	state->get_current = mono_object_get_virtual_method(result, method);
+
+	return result;
+}
+
+/*
+ * plmono_srf_fetch
+ *
+ *     Advance enumerator; return false if it's exhausted, or set *pcurrent to
+ *     its current element otherwise
+ */
+static bool
+plmono_srf_fetch(PLMonoSrfState *state, MonoObject *enumerator, MonoObject **pcurrent)
+{
+	MonoObject *more;
+
+	plmono_stat_phase(PLMONO_PHASE_MANAGED);
+	more = plmono_srf_invoke(state->move_next, enumerator, NULL);
+	if (!*((MonoBoolean*) mono_object_unbox(more)))
+		return false;
+
+	*pcurrent = plmono_srf_invoke(state->get_current, enumerator, NULL);
+	return true;
+}
+
+/*
+ * plmono_srf_build_row
+ *
+ *     Convert enumerated element into result row of the call site. Elements
+ *     of functions returning composite types are object arrays holding column
+ *     values
+ */
+static void
+plmono_srf_build_row(PLMonoFunction *desc, PLMonoCallSite *site, MonoObject *current)
+{
+	PLMonoMarshal *m;
+	MonoArray *arr;
+	MonoObject *val;
+	int natts, i;
+
+	plmono_stat_phase(PLMONO_PHASE_RESULT);
+
+	if (site->rettypeclass != TYPEFUNC_COMPOSITE)
+	{
+		site->nulls[0] = (current == NULL);
+		if (current)
+			site->values[0] = desc->retplan.from_result(&desc->retplan, current);
+
+		return;
+	}
+
+	natts = site->rettupdesc->natts;
+	arr = (MonoArray*) current;
+	if (!arr || mono_array_length(arr) != natts)
+		elog(ERROR, "Set-returning PL/Mono function must enumerate object arrays of %d elements", natts);
+
+	for (i = 0, m = site->colplan; i < natts; i++, m++)
+	{
+		val = mono_array_get(arr, MonoObject*, i);
+
+		site->nulls[i] = (val == NULL);
+		if (val)
+			site->values[i] = m->from_result(m, val);
+	}
+}
+
+/*
+ * plmono_srf_row_datum
+ *
+ *     Get Datum of the row built by plmono_srf_build_row
+ */
+static Datum
+plmono_srf_row_datum(PLMonoCallSite *site, bool *isnull)
+{
+	if (site->rettypeclass != TYPEFUNC_COMPOSITE)
+	{
+		*isnull = site->nulls[0];
+		return site->values[0];
+	}
+
+	*isnull = false;
+	return HeapTupleGetDatum(heap_form_tuple(site->rettupdesc, site->values, site->nulls));
+}
+
+/*
+ * plmono_srf_cleanup
+ *
+ *     Release enumerator of a set-returning function call. Registered as
+ *     expression context callback, so that it's also called when executor
+ *     stops fetching rows before the set is exhausted
+ */
+static void
+plmono_srf_cleanup(Datum arg)
+{
+	PLMonoSrfState *state = (PLMonoSrfState*) DatumGetPointer(arg);
+
+	if (state->handle)
+	{
+		if (g_hash_table_remove(srf_handles, GUINT_TO_POINTER(state->handle)))
+			mono_gchandle_free(state->handle);
+		state->handle = 0;
+	}
+}
+
+/*
+ * plmono_srf_xact_callback
+ *
+ *     Release enumerators of calls the ending transaction didn't finish
+ */
+static void
+plmono_srf_xact_callback(XactEvent event, void *arg)
+{
+	GHashTableIter iter;
+	gpointer handle;
+
+	g_hash_table_iter_init(&iter, srf_handles);
+	while (g_hash_table_iter_next(&iter, &handle, NULL))
+		mono_gchandle_free(GPOINTER_TO_UINT(handle));
+
+	g_hash_table_remove_all(srf_handles);
+}
+
+/*
+ * plmono_srf_value_per_call
+ *
+ *     Return elements of enumerated result one per call
+ */
+static Datum
+plmono_srf_value_per_call(FunctionCallInfo fcinfo, PLMonoFunction *desc)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo*) fcinfo->resultinfo;
+	PLMonoCallSite *site = plmono_cache_site(fcinfo);
+	FuncCallContext *funcctx;
+	PLMonoSrfState *state;
+	MonoObject *enumerator, *current;
+	Datum result;
+	bool isnull;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcxt;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcxt = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		state = (PLMonoSrfState*) palloc0(sizeof(PLMonoSrfState));
+		funcctx->user_fctx = state;
+
+		MemoryContextSwitchTo(oldcxt);
+
+		enumerator = plmono_srf_start(fcinfo, desc, state);
+		state->handle = mono_gchandle_new(enumerator, FALSE);
+
+		if (!srf_handles)
+		{
+			srf_handles = g_hash_table_new(g_direct_hash, g_direct_equal);
+			RegisterXactCallback(plmono_srf_xact_callback, NULL);
+		}
+		g_hash_table_insert(srf_handles, GUINT_TO_POINTER(state->handle), NULL);
+		RegisterExprContextCallback(rsinfo->econtext, plmono_srf_cleanup, PointerGetDatum(state));
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	state = (PLMonoSrfState*) funcctx->user_fctx;
+	enumerator = mono_gchandle_get_target(state->handle);
+
+	if (plmono_srf_fetch(state, enumerator, &current))
+	{
+		plmono_srf_build_row(desc, site, current);
+		result = plmono_srf_row_datum(site, &isnull);
+
+		if (isnull)
+		{
+			funcctx->call_cntr++;
+			fcinfo->isnull = true;
+			rsinfo->isDone = ExprMultipleResult;
+			PG_RETURN_NULL();
+		}
+
+		SRF_RETURN_NEXT(funcctx, result);
+	}
+
+	UnregisterExprContextCallback(rsinfo->econtext, plmono_srf_cleanup, PointerGetDatum(state));
+	plmono_srf_cleanup(PointerGetDatum(state));
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * plmono_srf_materialize
+ *
+ *     Enumerate the whole result into a tuplestore
+ */
+static Datum
+plmono_srf_materialize(FunctionCallInfo fcinfo, PLMonoFunction *desc)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo*) fcinfo->resultinfo;
+	PLMonoCallSite *site = plmono_cache_site(fcinfo);
+	MemoryContext per_query_ctx, oldcxt, rowcxt;
+	Tuplestorestate *tupstore;
+	TupleDesc tupdesc;
+	PLMonoSrfState state;
+	MonoObject *enumerator, *current;
+	guint32 handle;
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcxt = MemoryContextSwitchTo(per_query_ctx);
+
+	if (site->rettypeclass == TYPEFUNC_COMPOSITE)
+		tupdesc = CreateTupleDescCopy(site->rettupdesc);
+	else
+	{
+		tupdesc = CreateTemplateTupleDesc(1, false);
+		TupleDescInitEntry(tupdesc, (AttrNumber) 1, "result", desc->rettype, -1, 0);
+	}
+
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcxt);
+
+	/*
+     * Converted values of each row are released before the next one
+     */
+	rowcxt = AllocSetContextCreate(CurrentMemoryContext,
+								   "PL/Mono SRF row",
+								   ALLOCSET_SMALL_MINSIZE,
+								   ALLOCSET_SMALL_INITSIZE,
+								   ALLOCSET_SMALL_MAXSIZE);
+
+	enumerator = plmono_srf_start(fcinfo, desc, &state);
+	handle = mono_gchandle_new(enumerator, FALSE);
+
+	PG_TRY();
+	{
+		while (plmono_srf_fetch(&state, enumerator, &current))
+		{
+			oldcxt = MemoryContextSwitchTo(rowcxt);
+			plmono_srf_build_row(desc, site, current);
+			tuplestore_putvalues(tupstore, tupdesc, site->values, site->nulls);
+			MemoryContextSwitchTo(oldcxt);
+			MemoryContextReset(rowcxt);
+		}
+	}
+	PG_CATCH();
+	{
+		mono_gchandle_free(handle);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	mono_gchandle_free(handle);
+	MemoryContextDelete(rowcxt);
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * plmono_srf_handler
+ *
+ *     Set-returning function call handler. Elements are streamed one per call
+ *     unless caller can only accept, or prefers, a materialized set
+ */
+Datum
+plmono_srf_handler(FunctionCallInfo fcinfo, PLMonoFunction *desc)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo*) fcinfo->resultinfo;
+	PLMonoCallSite *site = plmono_cache_site(fcinfo);
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (site->rettypeclass == TYPEFUNC_RECORD)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in context "
+						"that cannot accept type record")));
+
+	if (site->rettypeclass != TYPEFUNC_SCALAR && site->rettypeclass != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Set-returning PL/Mono function must return a scalar or composite type");
+
+	if ((rsinfo->allowedModes & SFRM_Materialize) &&
+		(!(rsinfo->allowedModes & SFRM_ValuePerCall) ||
+		 (rsinfo->allowedModes & SFRM_Materialize_Preferred)))
+		return plmono_srf_materialize(fcinfo, desc);
+
+	if (!(rsinfo->allowedModes & SFRM_ValuePerCall))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("PL/Mono cannot return a set in this context")));
+
+	return plmono_srf_value_per_call(fcinfo, desc);
+}
@@ -0,0 +1,6 @@
+#ifndef _PLMONO_SRF_H
+#define _PLMONO_SRF_H
+
+Datum plmono_srf_handler(FunctionCallInfo fcinfo, PLMonoFunction *desc);
+
+#endif
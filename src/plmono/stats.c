@@ -0,0 +1,353 @@
+/*-------------------------------------------------------------------------
+ *
+ * stats.c
+ *     per-function call statistics of the backend
+ *
+ * Copyright (c) 2009, Olexandr Melnyk <me@omelnyk.net>
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "catalog/pg_type.h"
+#include "utils/datum.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/tuplestore.h"
+#include "portability/instr_time.h"
+
+#include <mono/jit/jit.h>
+#include <mono/metadata/assembly.h>
+#include <mono/metadata/appdomain.h>
+#include <mono/metadata/mono-gc.h>
+
+#include "core.h"
+#include "assembly.h"
+#include "marshal.h"
+#include "cache.h"
+#include "stats.h"
+
+extern Datum plmono_stat_functions(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(plmono_stat_functions);
+
+extern Datum plmono_stat_reset(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(plmono_stat_reset);
+
+/*
+ * Whether calls are timed and counted (plmono.track_functions)
+ */
+bool plmono_track_functions = false;
+
+/*
+ * Counters of functions called since the last reset, keyed by function Oid
+ */
+static HTAB *stat_functions = NULL;
+
+/*
+ * Innermost call in progress
+ */
+static PLMonoStatCall *stat_current = NULL;
+
+/*
+ * plmono_stat_init
+ *
+ *     Create hash of function counters
+ */
+static void
+plmono_stat_init(void)
+{
+	HASHCTL ctl;
+
+	MemSet(&ctl, 0, sizeof(ctl));
+	ctl.keysize = sizeof(Oid);
+	ctl.entrysize = sizeof(PLMonoStatEntry);
+	ctl.hash = oid_hash;
+	ctl.hcxt = TopMemoryContext;
+
+	stat_functions = hash_create("PL/Mono function statistics", 64, &ctl,
+								 HASH_ELEM | HASH_FUNCTION | HASH_CONTEXT);
+}
+
+/*
+ * plmono_stat_gc_count
+ *
+ *     Get number of collections of all generations so far
+ */
+static int64
+plmono_stat_gc_count(void)
+{
+	int64 count = 0;
+	int gen;
+
+	for (gen = 0; gen <= mono_gc_max_generation(); gen++)
+		count += mono_gc_collection_count(gen);
+
+	return count;
+}
+
+/*
+ * plmono_stat_start
+ *
+ *     Note when a call starts, before its function is looked up. Nothing is
+ *     recorded if calls aren't tracked
+ */
+void
+plmono_stat_start(PLMonoStatCall *call)
+{
+	call->entry = NULL;
+
+	if (plmono_track_functions)
+		INSTR_TIME_SET_CURRENT(call->start);
+	else
+		INSTR_TIME_SET_ZERO(call->start);
+}
+
+/*
+ * plmono_stat_begin
+ *
+ *     Push call of resolved function onto the stack of calls in progress.
+ *     Every call begun must be ended, including on error
+ */
+void
+plmono_stat_begin(PLMonoStatCall *call, PLMonoFunction *desc)
+{
+	bool found;
+	int i;
+
+	call->prev = stat_current;
+	stat_current = call;
+
+	if (INSTR_TIME_IS_ZERO(call->start))
+		return;
+
+	if (!stat_functions)
+		plmono_stat_init();
+
+	call->entry = (PLMonoStatEntry*) hash_search(stat_functions, &desc->fn_oid, HASH_ENTER, &found);
+	if (!found)
+		MemSet(((char*) call->entry) + sizeof(Oid), 0, sizeof(PLMonoStatEntry) - sizeof(Oid));
+
+	for (i = 0; i < PLMONO_NUM_PHASES; i++)
+		INSTR_TIME_SET_ZERO(call->phases[i]);
+	INSTR_TIME_SET_ZERO(call->nested);
+
+	INSTR_TIME_SET_CURRENT(call->checkpoint);
+	INSTR_TIME_ACCUM_DIFF(call->phases[PLMONO_PHASE_RESOLVE], call->checkpoint, call->start);
+	call->phase = PLMONO_PHASE_ARGS;
+	call->gc_start = plmono_stat_gc_count();
+}
+
+/*
+ * plmono_stat_phase
+ *
+ *     Charge time since the last checkpoint to the current phase of the
+ *     innermost call, and switch it to another phase
+ */
+void
+plmono_stat_phase(PLMonoStatPhase phase)
+{
+	PLMonoStatCall *call = stat_current;
+	instr_time now;
+
+	if (!call || !call->entry || call->phase == phase)
+		return;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_ACCUM_DIFF(call->phases[call->phase], now, call->checkpoint);
+	call->checkpoint = now;
+	call->phase = phase;
+}
+
+/*
+ * plmono_stat_args
+ *
+ *     Count size of arguments of the innermost call
+ */
+void
+plmono_stat_args(PLMonoFunction *desc, FunctionCallInfo fcinfo)
+{
+	PLMonoMarshal *m = desc->argplan;
+	int i;
+
+	if (!stat_current || !stat_current->entry)
+		return;
+
+	for (i = 0; i < desc->nparams; i++, m++)
+		if (!m->out && !fcinfo->argnull[m->argno])
+			stat_current->entry->bytes_in += datumGetSize(fcinfo->arg[m->argno], m->typbyval, m->typlen);
+}
+
+/*
+ * plmono_stat_result
+ *
+ *     Count size of result of the innermost call. Composite results, and
+ *     those made of several OUT parameters, are counted as formed tuples
+ */
+void
+plmono_stat_result(PLMonoFunction *desc, Datum result, bool isnull)
+{
+	PLMonoMarshal *m = &desc->retplan;
+	int i;
+
+	if (!stat_current || !stat_current->entry || isnull)
+		return;
+
+	if (desc->rettypeclass == TYPEFUNC_COMPOSITE || desc->rettypeclass == TYPEFUNC_RECORD)
+	{
+		stat_current->entry->bytes_out += datumGetSize(result, false, -1);
+		return;
+	}
+
+	/*
+     * Single OUT parameter is returned as is
+     */
+	if (desc->nouts == 1)
+		for (i = 0, m = desc->argplan; i < desc->nparams && !m->byref; i++, m++)
+			;
+
+	if (m->tm && m->typeoid != VOIDOID)
+		stat_current->entry->bytes_out += datumGetSize(result, m->typbyval, m->typlen);
+}
+
+/*
+ * plmono_stat_exception
+ *
+ *     Count unhandled exception of the innermost call
+ */
+void
+plmono_stat_exception(void)
+{
+	if (stat_current && stat_current->entry)
+		stat_current->entry->exceptions++;
+}
+
+/*
+ * plmono_stat_end
+ *
+ *     Pop call off the stack and add it to counters of its function. Time of
+ *     nested calls is spent in managed code, and is taken out of that phase
+ */
+void
+plmono_stat_end(PLMonoStatCall *call)
+{
+	PLMonoStatEntry *entry = call->entry;
+	instr_time now, total;
+	int i;
+
+	stat_current = call->prev;
+
+	if (!entry)
+		return;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_ACCUM_DIFF(call->phases[call->phase], now, call->checkpoint);
+	INSTR_TIME_SUBTRACT(call->phases[PLMONO_PHASE_MANAGED], call->nested);
+
+	total = now;
+	INSTR_TIME_SUBTRACT(total, call->start);
+
+	entry->calls++;
+	INSTR_TIME_ADD(entry->total, total);
+	INSTR_TIME_ADD(entry->self, total);
+	INSTR_TIME_SUBTRACT(entry->self, call->nested);
+	for (i = 0; i < PLMONO_NUM_PHASES; i++)
+		INSTR_TIME_ADD(entry->phases[i], call->phases[i]);
+	entry->gc_collections += plmono_stat_gc_count() - call->gc_start;
+
+	if (call->prev && call->prev->entry)
+		INSTR_TIME_ADD(call->prev->nested, total);
+}
+
+/*
+ * plmono_stat_functions
+ *
+ *     List counters of functions called in the backend
+ */
+Datum
+plmono_stat_functions(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo*) fcinfo->resultinfo;
+	Tuplestorestate *tupstore;
+	TupleDesc tupdesc;
+	MemoryContext per_query_ctx, oldcontext;
+	HASH_SEQ_STATUS status;
+	PLMonoStatEntry *entry;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("materialize mode required, but it is not allowed in this context")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "Return type must be a row type");
+
+	per_query_ctx = rsinfo->econtext->ecxt_per_query_memory;
+	oldcontext = MemoryContextSwitchTo(per_query_ctx);
+
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+
+	MemoryContextSwitchTo(oldcontext);
+
+	if (!stat_functions)
+		return (Datum) 0;
+
+	hash_seq_init(&status, stat_functions);
+	while ((entry = (PLMonoStatEntry*) hash_seq_search(&status)))
+	{
+		Datum values[12];
+		bool nulls[12];
+		int i;
+
+		MemSet(nulls, 0, sizeof(nulls));
+
+		values[0] = ObjectIdGetDatum(entry->fn_oid);
+		values[1] = Int64GetDatum(entry->calls);
+		values[2] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(entry->total));
+		values[3] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(entry->self));
+		for (i = 0; i < PLMONO_NUM_PHASES; i++)
+			values[4 + i] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(entry->phases[i]));
+		values[8] = Int64GetDatum(entry->bytes_in);
+		values[9] = Int64GetDatum(entry->bytes_out);
+		values[10] = Int64GetDatum(entry->exceptions);
+		values[11] = Int64GetDatum(entry->gc_collections);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	tuplestore_donestoring(tupstore);
+
+	return (Datum) 0;
+}
+
+/*
+ * plmono_stat_reset
+ *
+ *     Zero counters of all functions in the backend
+ */
+Datum
+plmono_stat_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS status;
+	PLMonoStatEntry *entry;
+
+	if (stat_functions)
+	{
+		hash_seq_init(&status, stat_functions);
+		while ((entry = (PLMonoStatEntry*) hash_seq_search(&status)))
+			MemSet(((char*) entry) + sizeof(Oid), 0, sizeof(PLMonoStatEntry) - sizeof(Oid));
+	}
+
+	PG_RETURN_VOID();
+}
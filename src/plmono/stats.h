@@ -0,0 +1,60 @@
+#ifndef _PLMONO_STATS_H
+#define _PLMONO_STATS_H
+
+#include "portability/instr_time.h"
+
+/*
+ * Phases a call's own time is split into
+ */
+typedef enum PLMonoStatPhase
+{
+	PLMONO_PHASE_RESOLVE,                  /* cache lookup and resolution */
+	PLMONO_PHASE_ARGS,                     /* conversion of arguments */
+	PLMONO_PHASE_MANAGED,                  /* managed code, less nested calls */
+	PLMONO_PHASE_RESULT,                   /* conversion of the result */
+	PLMONO_NUM_PHASES
+} PLMonoStatPhase;
+
+/*
+ * Counters of a function within the backend, keyed by function Oid
+ */
+typedef struct PLMonoStatEntry
+{
+	Oid fn_oid;                            /* hash key, must be first */
+	int64 calls;                           /* number of calls */
+	instr_time total;                      /* time in calls */
+	instr_time self;                       /* the same, less nested calls */
+	instr_time phases[PLMONO_NUM_PHASES];  /* self time by phase */
+	int64 bytes_in;                        /* size of arguments converted */
+	int64 bytes_out;                       /* size of results converted */
+	int64 exceptions;                      /* unhandled managed exceptions */
+	int64 gc_collections;                  /* collections during calls */
+} PLMonoStatEntry;
+
+/*
+ * Call in progress being timed. Calls form a stack, so that nested ones are
+ * left out of self time of the enclosing one
+ */
+typedef struct PLMonoStatCall
+{
+	PLMonoStatEntry *entry;                /* counters, NULL if not tracked */
+	instr_time start;                      /* when the call started */
+	instr_time checkpoint;                 /* when the current phase started */
+	PLMonoStatPhase phase;                 /* current phase */
+	instr_time phases[PLMONO_NUM_PHASES];  /* time spent in each phase */
+	instr_time nested;                     /* time spent in nested calls */
+	int64 gc_start;                        /* collections before the call */
+	struct PLMonoStatCall *prev;           /* enclosing call */
+} PLMonoStatCall;
+
+extern bool plmono_track_functions;
+
+void plmono_stat_start(PLMonoStatCall *call);
+void plmono_stat_begin(PLMonoStatCall *call, PLMonoFunction *desc);
+void plmono_stat_end(PLMonoStatCall *call);
+void plmono_stat_phase(PLMonoStatPhase phase);
+void plmono_stat_args(PLMonoFunction *desc, FunctionCallInfo fcinfo);
+void plmono_stat_result(struct PLMonoFunction *desc, Datum result, bool isnull);
+void plmono_stat_exception(void);
+
+#endif
@@ -0,0 +1,243 @@
+/*-------------------------------------------------------------------------
+ *
+ * thunk.c
+ *     direct invocation of scalar methods through their unmanaged thunks
+ *
+ * Copyright (c) 2009, Olexandr Melnyk <me@omelnyk.net>
+ *
+ *------------------------------------------------------------------------- 
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "access/heapam.h"
+#include "funcapi.h"
+#include "utils/memutils.h"
+
+#include <mono/jit/jit.h>
+#include <mono/metadata/assembly.h>
+#include <mono/metadata/appdomain.h>
+#include <mono/metadata/object.h>
+#include <mono/metadata/tabledefs.h>
+
+#include "core.h"
+#include "assembly.h"
+#include "marshal.h"
+#include "cache.h"
+#include "thunk.h"
+#include "stats.h"
+
+/*
+ * Maximum number of arguments of a method called through its thunk
+ */
+#define PLMONO_THUNK_MAX_ARGS 3
+
+/*
+ * Callers of thunks taking up to PLMONO_THUNK_MAX_ARGS arguments of kind A and
+ * returning value of kind R. Kinds are named after PLMonoValue members
+ */
+#define PLMONO_THUNK_CALLERS(R, RT, A, AT) \
+static void \
+plmono_thunk_call_##R##A##1(gpointer fn, PLMonoValue *a, PLMonoValue *r, MonoException **exc) \
+{ \
+	r->R = ((RT (*)(AT, MonoException**)) fn)(a[0].A, exc); \
+} \
+static void \
+plmono_thunk_call_##R##A##2(gpointer fn, PLMonoValue *a, PLMonoValue *r, MonoException **exc) \
+{ \
+	r->R = ((RT (*)(AT, AT, MonoException**)) fn)(a[0].A, a[1].A, exc); \
+} \
+static void \
+plmono_thunk_call_##R##A##3(gpointer fn, PLMonoValue *a, PLMonoValue *r, MonoException **exc) \
+{ \
+	r->R = ((RT (*)(AT, AT, AT, MonoException**)) fn)(a[0].A, a[1].A, a[2].A, exc); \
+}
+
+#define PLMONO_THUNK_CALLERS_RETURNING(R, RT) \
+static void \
+plmono_thunk_call_##R##0(gpointer fn, PLMonoValue *a, PLMonoValue *r, MonoException **exc) \
+{ \
+	r->R = ((RT (*)(MonoException**)) fn)(exc); \
+} \
+PLMONO_THUNK_CALLERS(R, RT, b, MonoBoolean) \
+PLMONO_THUNK_CALLERS(R, RT, s, gint16) \
+PLMONO_THUNK_CALLERS(R, RT, i, gint32) \
+PLMONO_THUNK_CALLERS(R, RT, l, gint64) \
+PLMONO_THUNK_CALLERS(R, RT, f, float) \
+PLMONO_THUNK_CALLERS(R, RT, d, double)
+
+PLMONO_THUNK_CALLERS_RETURNING(b, MonoBoolean)
+PLMONO_THUNK_CALLERS_RETURNING(s, gint16)
+PLMONO_THUNK_CALLERS_RETURNING(i, gint32)
+PLMONO_THUNK_CALLERS_RETURNING(l, gint64)
+PLMONO_THUNK_CALLERS_RETURNING(f, float)
+PLMONO_THUNK_CALLERS_RETURNING(d, double)
+
+/*
+ * Callers of thunks taking two arguments of kinds A and B, so that methods
+ * mixing kinds, like (int, double), are called through thunks as well
+ */
+#define PLMONO_THUNK_MIXED_CALLER(R, RT, A, AT, B, BT) \
+static void \
+plmono_thunk_call_##R##A##B(gpointer fn, PLMonoValue *a, PLMonoValue *r, MonoException **exc) \
+{ \
+	r->R = ((RT (*)(AT, BT, MonoException**)) fn)(a[0].A, a[1].B, exc); \
+}
+
+#define PLMONO_THUNK_MIXED_CALLERS(R, RT, A, AT) \
+PLMONO_THUNK_MIXED_CALLER(R, RT, A, AT, b, MonoBoolean) \
+PLMONO_THUNK_MIXED_CALLER(R, RT, A, AT, s, gint16) \
+PLMONO_THUNK_MIXED_CALLER(R, RT, A, AT, i, gint32) \
+PLMONO_THUNK_MIXED_CALLER(R, RT, A, AT, l, gint64) \
+PLMONO_THUNK_MIXED_CALLER(R, RT, A, AT, f, float) \
+PLMONO_THUNK_MIXED_CALLER(R, RT, A, AT, d, double)
+
+#define PLMONO_THUNK_MIXED_CALLERS_RETURNING(R, RT) \
+PLMONO_THUNK_MIXED_CALLERS(R, RT, b, MonoBoolean) \
+PLMONO_THUNK_MIXED_CALLERS(R, RT, s, gint16) \
+PLMONO_THUNK_MIXED_CALLERS(R, RT, i, gint32) \
+PLMONO_THUNK_MIXED_CALLERS(R, RT, l, gint64) \
+PLMONO_THUNK_MIXED_CALLERS(R, RT, f, float) \
+PLMONO_THUNK_MIXED_CALLERS(R, RT, d, double)
+
+PLMONO_THUNK_MIXED_CALLERS_RETURNING(b, MonoBoolean)
+PLMONO_THUNK_MIXED_CALLERS_RETURNING(s, gint16)
+PLMONO_THUNK_MIXED_CALLERS_RETURNING(i, gint32)
+PLMONO_THUNK_MIXED_CALLERS_RETURNING(l, gint64)
+PLMONO_THUNK_MIXED_CALLERS_RETURNING(f, float)
+PLMONO_THUNK_MIXED_CALLERS_RETURNING(d, double)
+
+#define PLMONO_THUNK_ROW(R, A) \
+	{plmono_thunk_call_##R##0, plmono_thunk_call_##R##A##1, \
+	 plmono_thunk_call_##R##A##2, plmono_thunk_call_##R##A##3}
+
+#define PLMONO_THUNK_TABLE(R) \
+	{PLMONO_THUNK_ROW(R, b), PLMONO_THUNK_ROW(R, s), PLMONO_THUNK_ROW(R, i), \
+	 PLMONO_THUNK_ROW(R, l), PLMONO_THUNK_ROW(R, f), PLMONO_THUNK_ROW(R, d)}
+
+#define PLMONO_THUNK_MIXED_ROW(R, A) \
+	{plmono_thunk_call_##R##A##b, plmono_thunk_call_##R##A##s, \
+	 plmono_thunk_call_##R##A##i, plmono_thunk_call_##R##A##l, \
+	 plmono_thunk_call_##R##A##f, plmono_thunk_call_##R##A##d}
+
+#define PLMONO_THUNK_MIXED_TABLE(R) \
+	{PLMONO_THUNK_MIXED_ROW(R, b), PLMONO_THUNK_MIXED_ROW(R, s), \
+	 PLMONO_THUNK_MIXED_ROW(R, i), PLMONO_THUNK_MIXED_ROW(R, l), \
+	 PLMONO_THUNK_MIXED_ROW(R, f), PLMONO_THUNK_MIXED_ROW(R, d)}
+
+/*
+ * Thunk callers indexed by return kind, argument kind and number of
+ * arguments; kinds follow order of PLMonoValueKind
+ */
+static const PLMonoThunkCaller thunk_callers[PLMONO_NUM_KINDS][PLMONO_NUM_KINDS][PLMONO_THUNK_MAX_ARGS + 1] =
+{
+	PLMONO_THUNK_TABLE(b),
+	PLMONO_THUNK_TABLE(s),
+	PLMONO_THUNK_TABLE(i),
+	PLMONO_THUNK_TABLE(l),
+	PLMONO_THUNK_TABLE(f),
+	PLMONO_THUNK_TABLE(d)
+};
+
+/*
+ * Thunk callers of two arguments indexed by return kind and kinds of the
+ * arguments
+ */
+static const PLMonoThunkCaller thunk_mixed_callers[PLMONO_NUM_KINDS][PLMONO_NUM_KINDS][PLMONO_NUM_KINDS] =
+{
+	PLMONO_THUNK_MIXED_TABLE(b),
+	PLMONO_THUNK_MIXED_TABLE(s),
+	PLMONO_THUNK_MIXED_TABLE(i),
+	PLMONO_THUNK_MIXED_TABLE(l),
+	PLMONO_THUNK_MIXED_TABLE(f),
+	PLMONO_THUNK_MIXED_TABLE(d)
+};
+
+/*
+ * plmono_thunk_prepare
+ *
+ *     Set up thunk invocation of the function if its method is static, takes
+ *     up to two primitive arguments of any kinds, or up to
+ *     PLMONO_THUNK_MAX_ARGS of the same kind, and returns a primitive value
+ */
+void
+plmono_thunk_prepare(PLMonoFunction *desc)
+{
+	PLMonoValueKind argkinds[PLMONO_THUNK_MAX_ARGS];
+	PLMonoValueKind retkind;
+	bool same = true;
+	int i;
+
+	desc->thunk = NULL;
+	desc->thunk_caller = NULL;
+
+	if (!desc->method || desc->is_trigger || desc->retset || desc->nouts > 0 ||
+		desc->nparams > PLMONO_THUNK_MAX_ARGS)
+		return;
+
+	if (!(mono_method_get_flags(desc->method, NULL) & METHOD_ATTRIBUTE_STATIC))
+		return;
+
+	if (!desc->retplan.tm || (retkind = desc->retplan.tm->kind) == PLMONO_KIND_NONE)
+		return;
+
+	/*
+     * Nullable<T> results and parameters are not primitives
+     */
+	if (mono_class_from_mono_type(mono_signature_get_return_type(mono_method_signature(desc->method))) != desc->retplan.klass)
+		return;
+
+	argkinds[0] = PLMONO_KIND_BOOL;
+	for (i = 0; i < desc->nparams; i++)
+	{
+		if (desc->argplan[i].tm->kind == PLMONO_KIND_NONE ||
+			desc->argplan[i].klass != desc->argplan[i].tm->get_class())
+			return;
+
+		argkinds[i] = desc->argplan[i].tm->kind;
+		if (argkinds[i] != argkinds[0])
+			same = false;
+	}
+
+	if (desc->nparams == 2)
+		desc->thunk_caller = thunk_mixed_callers[retkind][argkinds[0]][argkinds[1]];
+	else if (same)
+		desc->thunk_caller = thunk_callers[retkind][argkinds[0]][desc->nparams];
+	else
+		return;
+
+	desc->thunk = mono_method_get_unmanaged_thunk(desc->method);
+}
+
+/*
+ * plmono_thunk_invoke
+ *
+ *     Call function's method through its thunk, passing and receiving raw
+ *     primitive values
+ */
+Datum
+plmono_thunk_invoke(FunctionCallInfo fcinfo, PLMonoFunction *desc)
+{
+	PLMonoValue *argbuf = desc->argbuf;
+	PLMonoMarshal *m = desc->argplan;
+	MonoException *exc = NULL;
+	MemoryContext oldcxt;
+	PLMonoValue result;
+	int i;
+
+	plmono_stat_phase(PLMONO_PHASE_ARGS);
+	plmono_stat_args(desc, fcinfo);
+
+	oldcxt = MemoryContextSwitchTo(desc->scratch);
+	for (i = 0; i < desc->nparams; i++, m++)
+		m->to_arg(m, fcinfo->arg[m->argno], fcinfo->argnull[m->argno], &argbuf[i]);
+	MemoryContextSwitchTo(oldcxt);
+
+	plmono_stat_phase(PLMONO_PHASE_MANAGED);
+	desc->thunk_caller(desc->thunk, argbuf, &result, &exc);
+	if (exc)
+		plmono_report_exception((MonoObject*) exc);
+
+	plmono_stat_phase(PLMONO_PHASE_RESULT);
+	return desc->retplan.tm->to_datum(&result);
+}
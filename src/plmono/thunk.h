@@ -0,0 +1,7 @@
+#ifndef _PLMONO_THUNK_H
+#define _PLMONO_THUNK_H
+
+void plmono_thunk_prepare(PLMonoFunction *desc);
+Datum plmono_thunk_invoke(FunctionCallInfo fcinfo, PLMonoFunction *desc);
+
+#endif
@@ -0,0 +1,246 @@
+/*-------------------------------------------------------------------------
+ *
+ * toast.c
+ *     text and bytea arguments read through PLMono.ToastStream, detoasting
+ *     only the slices being read
+ *
+ * Copyright (c) 2009, Olexandr Melnyk <me@omelnyk.net>
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/heapam.h"
+#if PG_VERSION_NUM >= 130000
+#include "access/detoast.h"
+#else
+#include "access/tuptoaster.h"
+#endif
+#include "catalog/pg_proc.h"
+#include "catalog/pg_type.h"
+
+#include <mono/jit/jit.h>
+#include <mono/metadata/assembly.h>
+#include <mono/metadata/appdomain.h>
+#include <mono/metadata/exception.h>
+#include <mono/metadata/object.h>
+
+#include "helpers.h"
+#include "core.h"
+#include "assembly.h"
+#include "marshal.h"
+#include "cache.h"
+#include "spi.h"
+#include "toast.h"
+
+/*
+ * Value exposed through PLMono.ToastStream, kept as passed to the function.
+ * Slices can be fetched separately only from values stored uncompressed, so
+ * compressed ones are detoasted as a whole on the first read
+ */
+typedef struct PLMonoToast
+{
+	Datum value;                           /* possibly toasted varlena */
+	gint64 length;                         /* length of detoasted data */
+	bool compressed;                       /* value is yet to be decompressed */
+	MemoryContext mcxt;                    /* context of the call */
+} PLMonoToast;
+
+/*
+ * Field of PLMono.ToastStream pointing to PLMonoToast
+ */
+static MonoClassField *toaststream_handle = NULL;
+
+static MonoClass*
+plmono_stream_get_class(void)
+{
+	return plmono_class_from_name(plmono_get_plmono_image(), "PLMono", "ToastStream");
+}
+
+/*
+ * plmono_stream_to_obj
+ *
+ *     Wrap varlena argument into PLMono.ToastStream, which is usable until
+ *     the function returns
+ */
+static gpointer
+plmono_stream_to_obj(Datum val, PLMonoValue *slot)
+{
+	MonoClass *klass = plmono_stream_get_class();
+	MonoObject *obj;
+	PLMonoToast *toast;
+
+	if (!toaststream_handle)
+		toaststream_handle = mono_class_get_field_from_name(klass, "handle");
+
+	toast = (PLMonoToast*) palloc(sizeof(PLMonoToast));
+	toast->value = val;
+	toast->length = toast_raw_datum_size(val) - VARHDRSZ;
+	toast->compressed = (toast_datum_size(val) < toast->length);
+	toast->mcxt = CurrentMemoryContext;
+
+	obj = mono_object_new(plmono_get_domain(), klass);
+	mono_field_set_value(obj, toaststream_handle, &toast);
+	plmono_spi_track(obj, toaststream_handle);
+
+	return obj;
+}
+
+static Datum
+plmono_stream_to_datum(gpointer obj)
+{
+	elog(ERROR, "Streams cannot be returned by PL/Mono functions");
+	return (Datum) 0;
+}
+
+/*
+ * Conversions of text and bytea arguments taken as streams
+ */
+const PLMonoTypeMarshal plmono_stream_marshal =
+	{InvalidOid, plmono_stream_get_class, true, PLMONO_KIND_NONE, plmono_stream_to_obj, plmono_stream_to_datum};
+
+/*
+ * plmono_toast_resolve
+ *
+ *     Look for method taking System.IO.Stream in place of text and bytea
+ *     arguments, and switch their plans to streams if it is found
+ */
+void
+plmono_toast_resolve(PLMonoFunction *desc)
+{
+	MonoType *stream_type;
+	MonoType **types;
+	MonoMethod *method;
+	bool any = false;
+	int i;
+
+	types = (MonoType**) palloc((desc->nparams + 1) * sizeof(MonoType*));
+	stream_type = mono_class_get_type(mono_class_from_name(mono_get_corlib(), "System.IO", "Stream"));
+
+	for (i = 0; i < desc->nparams; i++)
+	{
+		PLMonoMarshal *m = &desc->argplan[i];
+
+		types[i] = desc->paramtypes[i];
+		if (!m->byref && (m->typeoid == TEXTOID || m->typeoid == BYTEAOID))
+		{
+			types[i] = stream_type;
+			any = true;
+		}
+	}
+
+	if (any && (method = mono_method_find(desc->klass, desc->method_name, types, desc->nparams)))
+	{
+		for (i = 0; i < desc->nparams; i++)
+			if (types[i] != desc->paramtypes[i])
+			{
+				plmono_marshal_use(&desc->argplan[i], &plmono_stream_marshal);
+				desc->paramtypes[i] = types[i];
+			}
+
+		desc->method = method;
+	}
+
+	pfree(types);
+}
+
+/*
+ * plmono_toast_read
+ *
+ *     Internal call PLMono.ToastStream::Read: copy up to count bytes starting
+ *     at position into the buffer, detoasting only that slice of the value
+ *     unless it is compressed
+ */
+static gint32
+plmono_toast_read(PLMonoToast *toast, gint64 position, MonoArray *buffer, gint32 offset, gint32 count)
+{
+	PLMonoSpiSubxact sx;
+	MonoException *exc = NULL;
+	MemoryContext oldcxt;
+	struct varlena *slice;
+	gint32 len = 0;
+
+	if (!toast)
+		mono_raise_exception(mono_get_exception_invalid_operation("Stream is accessible only while the function is executed"));
+
+	if (!buffer)
+		mono_raise_exception(mono_get_exception_argument_null("buffer"));
+
+	if (offset < 0 || count < 0 || offset + count > mono_array_length(buffer))
+		mono_raise_exception(mono_get_exception_argument_out_of_range("count"));
+
+	if (position >= toast->length || count == 0)
+		return 0;
+
+	if (count > toast->length - position)
+		count = toast->length - position;
+
+	/*
+     * Fetching the value may fail, e.g. if it has been deleted concurrently;
+     * the error is returned to the method as an exception
+     */
+	plmono_spi_subxact_begin(&sx);
+	PG_TRY();
+	{
+		if (toast->compressed)
+		{
+			oldcxt = MemoryContextSwitchTo(toast->mcxt);
+			toast->value = PointerGetDatum(pg_detoast_datum((struct varlena*) DatumGetPointer(toast->value)));
+			toast->compressed = false;
+			MemoryContextSwitchTo(oldcxt);
+		}
+
+		if (VARATT_IS_EXTENDED(DatumGetPointer(toast->value)) && !VARATT_IS_SHORT(DatumGetPointer(toast->value)))
+		{
+			slice = pg_detoast_datum_slice((struct varlena*) DatumGetPointer(toast->value), position, count);
+			len = VARSIZE_ANY_EXHDR(slice);
+			memcpy(mono_array_addr(buffer, char, offset), VARDATA_ANY(slice), len);
+			pfree(slice);
+		}
+		else
+		{
+			len = count;
+			memcpy(mono_array_addr(buffer, char, offset), VARDATA_ANY(DatumGetPointer(toast->value)) + position, len);
+		}
+
+		plmono_spi_subxact_commit(&sx);
+	}
+	PG_CATCH();
+	{
+		exc = plmono_spi_subxact_abort(&sx);
+	}
+	PG_END_TRY();
+
+	if (exc)
+		mono_raise_exception(exc);
+
+	return len;
+}
+
+/*
+ * plmono_toast_get_length
+ *
+ *     Internal call PLMono.ToastStream::GetLength
+ */
+static gint64
+plmono_toast_get_length(PLMonoToast *toast)
+{
+	if (!toast)
+		mono_raise_exception(mono_get_exception_invalid_operation("Stream is accessible only while the function is executed"));
+
+	return toast->length;
+}
+
+/*
+ * plmono_toast_register_icalls
+ *
+ *     Register internal calls of PLMono.ToastStream
+ */
+void
+plmono_toast_register_icalls(void)
+{
+	mono_add_internal_call("PLMono.ToastStream::Read", plmono_toast_read);
+	mono_add_internal_call("PLMono.ToastStream::GetLength", plmono_toast_get_length);
+}
@@ -0,0 +1,9 @@
+#ifndef _PLMONO_TOAST_H
+#define _PLMONO_TOAST_H
+
+extern const PLMonoTypeMarshal plmono_stream_marshal;
+
+void plmono_toast_register_icalls(void);
+void plmono_toast_resolve(PLMonoFunction *desc);
+
+#endif
@@ -15,6 +15,12 @@
 #include "access/heapam.h"
 #include "utils/syscache.h"
 #include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/tuplestore.h"
+#include "executor/tuptable.h"
+#include "executor/executor.h"
 #include "catalog/pg_proc.h"
 #include "catalog/pg_type.h"
 #include "funcapi.h"
@@ -23,10 +29,81 @@
 #include <mono/jit/jit.h>
 #include <mono/metadata/assembly.h>
 #include <mono/metadata/appdomain.h>
+#include <mono/metadata/exception.h>
 
 #include "helpers.h"
 #include "core.h"
+#include "assembly.h"
+#include "marshal.h"
+#include "cache.h"
+#include "row.h"
 #include "trigger.h"
+#include "spi.h"
+#include "instance.h"
+#include "stats.h"
+#include "profile.h"
+
+/*
+ * Values of PLMono.TriggerEvent, PLMono.TriggerWhen and PLMono.TriggerLevel
+ */
+#define PLMONO_TRIGGER_INSERT 0
+#define PLMONO_TRIGGER_UPDATE 1
+#define PLMONO_TRIGGER_DELETE 2
+#define PLMONO_TRIGGER_TRUNCATE 3
+
+#define PLMONO_TRIGGER_BEFORE 0
+#define PLMONO_TRIGGER_AFTER 1
+
+#define PLMONO_TRIGGER_ROW 0
+#define PLMONO_TRIGGER_STATEMENT 1
+
+/*
+ * Fields of PLMono.TriggerData set on each invokation
+ */
+static struct
+{
+	MonoClassField *current;
+	MonoClassField *old_row;
+	MonoClassField *new_row;
+	MonoClassField *has_old;
+	MonoClassField *has_new;
+	MonoClassField *event;
+	MonoClassField *when;
+	MonoClassField *level;
+	MonoClassField *trigger_name;
+	MonoClassField *table_name;
+	MonoClassField *table_schema;
+	MonoClassField *old_table;
+	MonoClassField *new_table;
+	MonoClassField *has_old_table;
+	MonoClassField *has_new_table;
+	MonoClassField *table_handle;
+	MonoClassField *table_row;
+} trigdata_fields;
+
+/*
+ * Transition table of a statement-level trigger, read by managed code through
+ * PLMono.TransitionTable
+ */
+typedef struct PLMonoTransitionTable
+{
+	Tuplestorestate *store;          /* transition tuples */
+	TupleTableSlot *slot;            /* slot tuples are read into */
+	HeapTuple tuple;                 /* copy of current tuple, or NULL */
+	PLMonoRow *row;                  /* row exposing current tuple */
+} PLMonoTransitionTable;
+
+/*
+ * Pool of TriggerData objects, one per nesting level of trigger invokations,
+ * kept alive by GC handles
+ */
+static guint32 *trigdata_pool = NULL;
+static int trigdata_pool_size = 0;
+
+/*
+ * Nesting level of trigger invokations in progress
+ */
+static int trigger_depth = 0;
 
 /*
  * plmono_trigger_data_get_class
@@ -36,122 +113,308 @@
 MonoClass*
 plmono_trigger_data_get_class(void)
 {
-	MonoImage *image  = plmono_get_plmono_image();
-	return plmono_class_from_name(image, "PLMono", "TriggerData");
+	static MonoClass *klass = NULL;
+
+	if (!klass)
+		klass = plmono_class_from_name(plmono_get_plmono_image(), "PLMono", "TriggerData");
+
+	return klass;
 }
 
 /*
- * plmono_trigdata_get_columns
+ * plmono_trigdata_get_field
  *
- *     Get Columns property value of TriggerData class
+ *     Get field of TriggerData class, or report error if there is no such field
  */
-MonoObject*
-plmono_trigdata_get_columns(MonoClass *trigdata)
+static MonoClassField*
+plmono_trigdata_get_field(MonoClass *klass, const char *name)
 {
-	MonoVTable *vt;
-	MonoProperty *prop;
+	MonoClassField *field;
 
-	vt = mono_class_vtable(plmono_get_domain(), trigdata);
-	mono_runtime_class_init(vt);
-	prop = mono_class_get_property_from_name(trigdata, "Columns");
-	return mono_property_get_value(prop, NULL, NULL, NULL);
+	if (!(field = mono_class_get_field_from_name(klass, name)))
+		elog(ERROR, "Field %s of PLMono.TriggerData not found", name);
+
+	return field;
 }
 
 /*
- * plmono_trigger_build_args
+ * plmono_trigdata_get
  *
- *     Create TableRow object based trigger's "OLD" row tuple
+ *     Get TriggerData object of specified nesting level, creating it on first
+ *     use of the level
  */
-void
-plmono_trigger_build_args(TriggerData *trigdata, MonoObject *cols)
+static MonoObject*
+plmono_trigdata_get(int depth)
 {
-	MonoClass *rowklass;
-	MonoClass *objklass;
-	MonoMethod* additem;
-	TupleDesc resdesc;
-	gpointer kvpair[2];
-	char *attname;
-	Oid atttype;
-	Datum *atts;
-	bool *nulls;
-	gpointer val;
-	int i;
+	MonoClass *klass = plmono_trigger_data_get_class();
+	MonoClass *tableklass;
+	MonoObject *obj;
 
-	resdesc = trigdata->tg_relation->rd_att;
+	if (!trigdata_pool)
+	{
+		trigdata_fields.current = plmono_trigdata_get_field(klass, "current");
+		trigdata_fields.old_row = plmono_trigdata_get_field(klass, "oldRow");
+		trigdata_fields.new_row = plmono_trigdata_get_field(klass, "newRow");
+		trigdata_fields.has_old = plmono_trigdata_get_field(klass, "hasOld");
+		trigdata_fields.has_new = plmono_trigdata_get_field(klass, "hasNew");
+		trigdata_fields.event = plmono_trigdata_get_field(klass, "triggerEvent");
+		trigdata_fields.when = plmono_trigdata_get_field(klass, "triggerWhen");
+		trigdata_fields.level = plmono_trigdata_get_field(klass, "triggerLevel");
+		trigdata_fields.trigger_name = plmono_trigdata_get_field(klass, "triggerName");
+		trigdata_fields.table_name = plmono_trigdata_get_field(klass, "tableName");
+		trigdata_fields.table_schema = plmono_trigdata_get_field(klass, "tableSchema");
+		trigdata_fields.old_table = plmono_trigdata_get_field(klass, "oldTable");
+		trigdata_fields.new_table = plmono_trigdata_get_field(klass, "newTable");
+		trigdata_fields.has_old_table = plmono_trigdata_get_field(klass, "hasOldTable");
+		trigdata_fields.has_new_table = plmono_trigdata_get_field(klass, "hasNewTable");
+		tableklass = plmono_class_from_name(plmono_get_plmono_image(), "PLMono", "TransitionTable");
+		trigdata_fields.table_handle = mono_class_get_field_from_name(tableklass, "handle");
+		trigdata_fields.table_row = mono_class_get_field_from_name(tableklass, "row");
+
+		trigdata_pool_size = 4;
+		trigdata_pool = (guint32*) MemoryContextAllocZero(TopMemoryContext,
+														  trigdata_pool_size * sizeof(guint32));
+	}
 
-	if (!(atts = palloc(resdesc->natts * sizeof(Datum))))
-		elog(ERROR, "Not enough memory");
+	if (depth >= trigdata_pool_size)
+	{
+		trigdata_pool = (guint32*) repalloc(trigdata_pool, 2 * trigdata_pool_size * sizeof(guint32));
+		MemSet(trigdata_pool + trigdata_pool_size, 0, trigdata_pool_size * sizeof(guint32));
+		trigdata_pool_size *= 2;
+	}
 
-	if (!(nulls = palloc(resdesc->natts * sizeof(bool))))
-		elog(ERROR, "Not enough memory");
+	if (!trigdata_pool[depth])
+	{
+		obj = mono_object_new(plmono_get_domain(), klass);
+		mono_runtime_object_init(obj);
+		trigdata_pool[depth] = mono_gchandle_new(obj, FALSE);
+	}
 
-	heap_deform_tuple(trigdata->tg_trigtuple, resdesc, atts, nulls);
+	return mono_gchandle_get_target(trigdata_pool[depth]);
+}
 
-	rowklass = mono_object_get_class(cols);
-	additem = mono_class_get_method_from_name(rowklass, "Add", 2);
+/*
+ * plmono_trigdata_set_current
+ *
+ *     Set TriggerData.Current static property
+ */
+static void
+plmono_trigdata_set_current(MonoObject *obj)
+{
+	MonoVTable *vt = mono_class_vtable(plmono_get_domain(), plmono_trigger_data_get_class());
 
-	for (i = 0; i < resdesc->natts; i++)
-	{
-		attname = NameStr(resdesc->attrs[i]->attname);
-		atttype = resdesc->attrs[i]->atttypid;
-		val = plmono_datum_to_obj(atts[i], atttype);
+	mono_field_static_set_value(vt, trigdata_fields.current, &obj);
+}
 
-		objklass = plmono_typeoid_to_class(atttype);
-		kvpair[0] = mono_string_new(plmono_get_domain(), attname); /* attribute name */
-		//elog(ERROR, "Val %p ObjClass %p", val, objklass);
+/*
+ * plmono_trigdata_set_int
+ *
+ *     Set integer or enum field of TriggerData
+ */
+static void
+plmono_trigdata_set_int(MonoObject *obj, MonoClassField *field, gint32 val)
+{
+	mono_field_set_value(obj, field, &val);
+}
 
-		if (atttype != TEXTOID)
-			kvpair[1] = mono_value_box(plmono_get_domain(), objklass, val); /* attribute value */
-		else
-			kvpair[1] = val;
+/*
+ * plmono_trigdata_set_string
+ *
+ *     Set string field of TriggerData to interned copy of the string
+ */
+static void
+plmono_trigdata_set_string(MonoObject *obj, MonoClassField *field, const char *str)
+{
+	MonoString *val = plmono_intern_string(str);
 
-		mono_runtime_invoke(additem, cols, kvpair, NULL);
-	}
+	mono_field_set_value(obj, field, &val);
 }
 
 /*
- * plmono_trigger_build_result
+ * plmono_trigdata_bind_row
  *
- *     Build trigger's "NEW" row tuple based on TableRow object content
+ *     Bind row to TableRow object of TriggerData referenced by the field and
+ *     set flag telling whether the row is available
  */
-Datum
-plmono_trigger_build_result(TriggerData *trigdata, MonoObject *cols)
+static void
+plmono_trigdata_bind_row(MonoObject *obj, MonoClassField *row_field, MonoClassField *flag_field, PLMonoRow *row)
 {
-	MonoClass *rowklass;
-	MonoProperty *item;
-	TupleDesc resdesc;
-	gpointer key, val;
-	char *attname;
-	Oid atttype;
-	Datum *atts;
-	bool *nulls;
-	int i;
-
-	resdesc = trigdata->tg_relation->rd_att;
+	MonoObject *tablerow;
+	MonoBoolean available = (row != NULL);
 
-	if (!(atts = palloc(resdesc->natts * sizeof(Datum))))
-		elog(ERROR, "Not enough memory");
+	mono_field_get_value(obj, row_field, &tablerow);
+	plmono_row_bind(tablerow, row);
+	mono_field_set_value(obj, flag_field, &available);
+}
 
-	if (!(nulls = palloc(resdesc->natts * sizeof(bool))))
-		elog(ERROR, "Not enough memory");
+/*
+ * plmono_transition_table_read
+ *
+ *     Internal call PLMono.TransitionTable::Read: advance transition table to
+ *     its next tuple and expose it through the table's row
+ */
+static MonoBoolean
+plmono_transition_table_read(PLMonoTransitionTable *table)
+{
+#if PG_VERSION_NUM >= 100000
+	PLMonoSpiSubxact sx;
+	MonoException *volatile exc = NULL;
+#endif
+	volatile bool found = false;
 
-	rowklass = mono_object_get_class(cols);
-	item = mono_class_get_property_from_name(rowklass, "Item");
+	if (!table)
+		mono_raise_exception(mono_get_exception_invalid_operation("Transition table is accessible only while trigger is executed"));
 
-	for (i = 0; i < resdesc->natts; i++)
+#if PG_VERSION_NUM >= 100000
+	/*
+     * Large transition tables spill to temporary files, which may fail to be
+     * read
+     */
+	plmono_spi_subxact_begin(&sx);
+	PG_TRY();
+	{
+		if (table->tuple)
+			heap_freetuple(table->tuple);
+		table->tuple = NULL;
+
+		if ((found = tuplestore_gettupleslot(table->store, true, false, table->slot)))
+		{
+#if PG_VERSION_NUM >= 120000
+			table->tuple = ExecCopySlotHeapTuple(table->slot);
+#else
+			table->tuple = ExecCopySlotTuple(table->slot);
+#endif
+		}
+
+		plmono_spi_subxact_commit(&sx);
+	}
+	PG_CATCH();
 	{
-		attname = NameStr(resdesc->attrs[i]->attname);
-		atttype = resdesc->attrs[i]->atttypid;
-		key = mono_string_new(plmono_get_domain(), attname); /* attribute name */
-
-		val = mono_property_get_value(item, cols, &key, NULL);
-		if (atttype != TEXTOID)
-			val = mono_object_unbox(val);
-		atts[i] = plmono_obj_to_datum(val, atttype);
-		nulls[i] = 0;
+		exc = plmono_spi_subxact_abort(&sx);
 	}
+	PG_END_TRY();
+
+	if (exc)
+		mono_raise_exception(exc);
+#endif
+
+	plmono_row_reset(table->row, table->tuple);
+
+	return found;
+}
+
+/*
+ * plmono_trigger_register_icalls
+ *
+ *     Register internal calls of PLMono.TransitionTable
+ */
+void
+plmono_trigger_register_icalls(void)
+{
+	mono_add_internal_call("PLMono.TransitionTable::Read", plmono_transition_table_read);
+}
 
-	return PointerGetDatum(heap_form_tuple(resdesc, atts, nulls));
+#if PG_VERSION_NUM >= 100000
+/*
+ * plmono_transition_table_new
+ *
+ *     Prepare transition tuplestore for reading from its start
+ */
+static PLMonoTransitionTable*
+plmono_transition_table_new(PLMonoRelation *rel, Tuplestorestate *store)
+{
+	PLMonoTransitionTable *table;
+
+	if (!store)
+		return NULL;
+
+	table = (PLMonoTransitionTable*) palloc(sizeof(PLMonoTransitionTable));
+	table->store = store;
+	table->tuple = NULL;
+	table->row = plmono_row_new(rel, NULL);
+
+#if PG_VERSION_NUM >= 120000
+	table->slot = MakeSingleTupleTableSlot(rel->tupdesc, &TTSOpsMinimalTuple);
+#else
+	table->slot = MakeSingleTupleTableSlot(rel->tupdesc);
+#endif
+	tuplestore_rescan(store);
+
+	return table;
+}
+#endif
+
+/*
+ * plmono_trigdata_bind_table
+ *
+ *     Bind transition table to TransitionTable object of TriggerData
+ *     referenced by the field, and set flag telling whether it's available
+ */
+static void
+plmono_trigdata_bind_table(MonoObject *obj, MonoClassField *table_field, MonoClassField *flag_field, PLMonoTransitionTable *table)
+{
+	MonoObject *tableobj, *tablerow;
+	MonoBoolean available = (table != NULL);
+
+	mono_field_get_value(obj, table_field, &tableobj);
+	mono_field_set_value(tableobj, trigdata_fields.table_handle, &table);
+	mono_field_set_value(obj, flag_field, &available);
+
+	mono_field_get_value(tableobj, trigdata_fields.table_row, &tablerow);
+	plmono_row_bind(tablerow, table ? table->row : NULL);
+}
+
+/*
+ * plmono_trigdata_fill
+ *
+ *     Describe trigger event in TriggerData object
+ */
+static void
+plmono_trigdata_fill(MonoObject *obj, TriggerData *trigdata, PLMonoRow *oldrow, PLMonoRow *newrow,
+	PLMonoTransitionTable *oldtable, PLMonoTransitionTable *newtable)
+{
+	Relation relation = trigdata->tg_relation;
+	TriggerEvent event = trigdata->tg_event;
+	gint32 op;
+
+	if (TRIGGER_FIRED_BY_INSERT(event))
+		op = PLMONO_TRIGGER_INSERT;
+	else if (TRIGGER_FIRED_BY_UPDATE(event))
+		op = PLMONO_TRIGGER_UPDATE;
+	else if (TRIGGER_FIRED_BY_DELETE(event))
+		op = PLMONO_TRIGGER_DELETE;
+	else
+		op = PLMONO_TRIGGER_TRUNCATE;
+
+	plmono_trigdata_set_int(obj, trigdata_fields.event, op);
+	plmono_trigdata_set_int(obj, trigdata_fields.when,
+		TRIGGER_FIRED_BEFORE(event) ? PLMONO_TRIGGER_BEFORE : PLMONO_TRIGGER_AFTER);
+	plmono_trigdata_set_int(obj, trigdata_fields.level,
+		TRIGGER_FIRED_FOR_ROW(event) ? PLMONO_TRIGGER_ROW : PLMONO_TRIGGER_STATEMENT);
+
+	plmono_trigdata_set_string(obj, trigdata_fields.trigger_name, trigdata->tg_trigger->tgname);
+	plmono_trigdata_set_string(obj, trigdata_fields.table_name, RelationGetRelationName(relation));
+	plmono_trigdata_set_string(obj, trigdata_fields.table_schema,
+		get_namespace_name(RelationGetNamespace(relation)));
+
+	plmono_trigdata_bind_row(obj, trigdata_fields.old_row, trigdata_fields.has_old, oldrow);
+	plmono_trigdata_bind_row(obj, trigdata_fields.new_row, trigdata_fields.has_new, newrow);
+	plmono_trigdata_bind_table(obj, trigdata_fields.old_table, trigdata_fields.has_old_table, oldtable);
+	plmono_trigdata_bind_table(obj, trigdata_fields.new_table, trigdata_fields.has_new_table, newtable);
+}
+
+/*
+ * plmono_trigdata_release
+ *
+ *     Detach TriggerData object from rows of finished invokation
+ */
+static void
+plmono_trigdata_release(MonoObject *obj)
+{
+	plmono_trigdata_bind_row(obj, trigdata_fields.old_row, trigdata_fields.has_old, NULL);
+	plmono_trigdata_bind_row(obj, trigdata_fields.new_row, trigdata_fields.has_new, NULL);
+	plmono_trigdata_bind_table(obj, trigdata_fields.old_table, trigdata_fields.has_old_table, NULL);
+	plmono_trigdata_bind_table(obj, trigdata_fields.new_table, trigdata_fields.has_new_table, NULL);
 }
 
 /*
@@ -163,48 +426,110 @@ Datum
 plmono_trigger_handler(PG_FUNCTION_ARGS)
 {
 	TriggerData *trigdata = (TriggerData*) fcinfo->context;
-	char *source, *assembly, *sig, *method_name;
-	int argcount;
-
-	MonoImage *image;
-	MonoClass *trigklass, *klass;
-	MonoMethod *method;
-	MonoObject *cols;
+	TriggerEvent event = trigdata->tg_event;
+	PLMonoFunction *desc;
+	PLMonoRelation *rel;
+	PLMonoRow *oldrow = NULL, *newrow = NULL;
+	PLMonoTransitionTable *oldtable = NULL, *newtable = NULL;
+	HeapTuple rettuple = NULL;
+
+	MonoObject *obj, *exc = NULL;
+	gpointer args[1];
+	PLMonoSpiFrame frame;
+	PLMonoStatCall stat;
+	PLMonoProfileNode *prof;
+	int depth;
 
 	/*
-     * Get characteristics of called function and parse its body
+     * Get resolved function from cache
      */
-	plmono_lookup_pg_function(fcinfo->flinfo->fn_oid, NULL, &source, NULL, NULL, NULL, &argcount);
-	if (argcount)
-		elog(ERROR, "PL/Mono trigger function cannot have explicit arguments");
-	plmono_parse_function_body(source, &assembly, &sig, &method_name);
+	plmono_stat_start(&stat);
+	desc = plmono_cache_get(fcinfo);
 
 	/*
-     * Find corresponding Mono method
+     * Expose OLD and NEW rows of row-level triggers; their values are
+     * decoded only when accessed
      */
-	image = plmono_image_open(assembly);
-	klass = plmono_class_find(image, sig);
-	method = plmono_method_find(klass, method_name, NULL, 0);
+	if (TRIGGER_FIRED_FOR_ROW(event))
+	{
+		rel = plmono_relation_get(trigdata->tg_relation);
+
+		if (TRIGGER_FIRED_BY_INSERT(event))
+			newrow = plmono_row_new(rel, trigdata->tg_trigtuple);
+		else if (TRIGGER_FIRED_BY_UPDATE(event))
+		{
+			oldrow = plmono_row_new(rel, trigdata->tg_trigtuple);
+			newrow = plmono_row_new(rel, trigdata->tg_newtuple);
+		}
+		else
+			oldrow = plmono_row_new(rel, trigdata->tg_trigtuple);
+	}
 
+#if PG_VERSION_NUM >= 100000
 	/*
-     * Get instance of PLMono.TriggerData.Columns
+     * Expose transition tables declared with REFERENCING OLD/NEW TABLE, so
+     * that a statement-level trigger handles all affected rows in one call
      */
-	trigklass = plmono_trigger_data_get_class();
-	cols = plmono_trigdata_get_columns(trigklass);
+	if (trigdata->tg_oldtable || trigdata->tg_newtable)
+	{
+		rel = plmono_relation_get(trigdata->tg_relation);
+		oldtable = plmono_transition_table_new(rel, trigdata->tg_oldtable);
+		newtable = plmono_transition_table_new(rel, trigdata->tg_newtable);
+	}
+#endif
 
 	/*
-     * Prepare Columns object for trigger method invokation
+     * Get TriggerData object of this nesting level and describe the event
      */
-	plmono_trigger_build_args(trigdata, cols);
+	depth = trigger_depth;
+	obj = plmono_trigdata_get(depth);
+	plmono_trigdata_fill(obj, trigdata, oldrow, newrow, oldtable, newtable);
 
 	/*
      * Invoke method
      */
-	mono_runtime_invoke(method, NULL, NULL, NULL);
+	trigger_depth++;
+	plmono_trigdata_set_current(obj);
+	plmono_spi_push(&frame, desc);
+	desc->depth++;
+	plmono_stat_begin(&stat, desc);
+	prof = plmono_profile_push(desc->fn_oid);
+	PG_TRY();
+	{
+		plmono_stat_phase(PLMONO_PHASE_MANAGED);
+		args[0] = obj;
+		mono_runtime_invoke(desc->method, plmono_instance_get(desc), desc->nparams ? args : NULL, &exc);
+		if (exc)
+			plmono_report_exception(exc);
+	}
+	PG_CATCH();
+	{
+		plmono_profile_pop(prof);
+		plmono_stat_end(&stat);
+		plmono_cache_release(desc);
+		plmono_spi_pop(&frame, true);
+		plmono_trigdata_release(obj);
+		trigger_depth = depth;
+		plmono_trigdata_set_current(depth ? plmono_trigdata_get(depth - 1) : NULL);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	plmono_profile_pop(prof);
+	plmono_stat_end(&stat);
+	plmono_cache_release(desc);
+	plmono_spi_pop(&frame, false);
+	plmono_trigdata_release(obj);
+	trigger_depth = depth;
+	plmono_trigdata_set_current(depth ? plmono_trigdata_get(depth - 1) : NULL);
 
 	/*
-     * Return method's return value or arguments passed by reference
+     * Return NEW row, with assigned columns replaced, or OLD row of DELETE
      */
-	return plmono_trigger_build_result(trigdata, cols);
-}
+	if (newrow)
+		rettuple = plmono_row_build_tuple(newrow);
+	else if (oldrow)
+		rettuple = oldrow->tuple;
 
+	return PointerGetDatum(rettuple);
+}